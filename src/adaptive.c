@@ -0,0 +1,150 @@
+// Adaptive Manchester decoder for marginal lines.
+//
+// decodeSplit() classifies each pulse on its own against fixed windows, so
+// a line a few percent slow, or with high pulses longer than low ones,
+// pushes pulses into the dead bands and the frame is lost. This decoder
+// instead places every transition on a grid of half-bit slots, slot 0
+// being the middle of the sync bit. Even slots are mid-bit, odd slots are
+// cell boundaries.
+//
+// A delay-locked loop follows the grid through the frame: each transition's
+// distance from its slot adjusts the grid phase, the half-bit period and
+// the skew between rising and falling edges. The gains start high, so the
+// sync bit and first few cells set the period, and then drop to ride out
+// jitter. Both sets of gains give a critically damped loop.
+//
+// Manchester has a transition in the middle of every bit, which limits
+// where the next transition may fall:
+// - after a boundary, the next one is the mid-bit slot right after it;
+// - after a mid-bit, it is the next boundary or the next mid-bit.
+// When a transition after a mid-bit lands between those two, the following
+// transition settles it: a boundary must be followed by a transition one
+// slot later. A spike much shorter than a half-bit is taken as a glitch and
+// dropped along with the pulse it splits off.
+#include "crc.h"
+#include "manchester.h"
+
+#define ACQUIRE_EDGES 16
+// Loop gains, as shifts: the phase gain is 1/4 while acquiring and 1/16
+// after, and the period gain is 1/64 and then 1/1024.
+#define PHASE_SHIFT_ACQUIRE 2
+#define PERIOD_SHIFT_ACQUIRE 6
+#define PHASE_SHIFT_TRACK 4
+#define PERIOD_SHIFT_TRACK 10
+
+// Times are fixed point, in units of 2^-FRAC ns, and measured from the
+// slot of the previous transition so they stay small.
+#define FRAC 16
+
+#define GLITCH_EIGHTHS 3 // Pulses under 3/8 of a half-bit are glitches
+
+// Width of pulse i of the split durations
+static inline int32_t pulseWidth(const uint8_t *d1, int len1, const uint8_t *d2, int i) {
+  return (i < len1 ? d1[i] : d2[i - len1]) * (RECV_WIDTH << FRAC);
+}
+
+// Same interface as decodeSplit().
+int decodeSplitAdaptive(const uint8_t *d1, int len1, const uint8_t *d2, int len2, uint8_t *bytes, int maxBytes) {
+  int len = len1 + len2;
+  int32_t period = HALF_BIT_NS << FRAC; // Half-bit period
+  int32_t skew = 0; // Falling edges are skew / 2 late, rising ones skew / 2 early
+  int32_t t = 0; // Time since the previous transition's slot
+  int slot = 0; // Slot of the previous transition
+  int edges = 0;
+  int byteCount = 0;
+  int bitCount = 0;
+  uint8_t byte = 0;
+  int i = 0;
+
+  while (i < len) {
+    // Pulse i is low if i is even, so the transition ending it is rising.
+    int rising = (i & 1) == 0;
+    t += pulseWidth(d1, len1, d2, i);
+    // A glitch splits a pulse in three; skip the spike and the rest of the pulse.
+    while (i + 2 < len && pulseWidth(d1, len1, d2, i + 1) < (period * GLITCH_EIGHTHS) >> 3) {
+      t += pulseWidth(d1, len1, d2, i + 1) + pulseWidth(d1, len1, d2, i + 2);
+      i += 2;
+    }
+    i++;
+    int32_t edge = t + ((rising ? skew : -skew) >> 1);
+
+    // Half-bits since the previous slot, against 1/4 half-bit marks
+    int32_t quarter = period >> 2;
+    int step;
+    if (edge < 2 * quarter || edge > 10 * quarter) {
+      decodeError = "bad width";
+      return -1;
+    } else if (slot & 1) {
+      step = 1; // Mid-bit must follow a boundary
+      if (edge > 7 * quarter) {
+        step = 2; // No mid-bit transition: a bad cell
+      }
+    } else if (edge < 5 * quarter || i >= len) {
+      step = edge < 6 * quarter ? 1 : 2;
+    } else if (edge > 7 * quarter) {
+      step = 2;
+    } else {
+      // Too close to call: if this is a boundary, the next transition
+      // comes one slot after it, so the two pulses together are 2 half-bits.
+      // If it is a mid-bit, they are 3 or 4.
+      step = edge + pulseWidth(d1, len1, d2, i) < 10 * quarter ? 1 : 2;
+    }
+    slot += step;
+
+    // Track the grid
+    int32_t predicted = step * period;
+    int32_t err = edge - predicted;
+    int phaseShift = PHASE_SHIFT_TRACK, periodShift = PERIOD_SHIFT_TRACK;
+    if (edges++ < ACQUIRE_EDGES) {
+      phaseShift = PHASE_SHIFT_ACQUIRE;
+      periodShift = PERIOD_SHIFT_ACQUIRE;
+    }
+    t -= predicted + (err >> phaseShift);
+    period += (step == 1 ? err : err >> 1) >> periodShift;
+    skew += (rising ? -err : err) >> phaseShift;
+
+    // A transition on a mid-bit slot gives the bit: falling is 1, rising
+    // is 0. Reaching a boundary in two steps skipped a mid-bit slot, which
+    // had no transition and decodes as 0 like decodeSplit().
+    if ((slot & 1) == 0 || step == 2) {
+      int bit = 0;
+      if ((slot & 1) == 0) {
+        bit = !rising;
+      } else {
+        decodeBadBits++;
+      }
+      byte = (byte << 1) | bit;
+      if (++bitCount == 8) {
+        bytes[byteCount++] = byte;
+        if (byteCount >= maxBytes) {
+          decodeError = "buffer overflow";
+          return -1;
+        }
+        bitCount = 0;
+      }
+    }
+  }
+
+  // The last recorded transition is either the last bit's mid-bit or the
+  // line returning high at the end of a final 1, so the frame ends on a
+  // whole byte either way.
+  if (bitCount != 0) {
+    decodeError = "bad offset2";
+    return -1;
+  }
+  if (byteCount < 2) {
+    decodeError = "short frame";
+    return -1;
+  }
+  uint16_t crcVal = crc(bytes, (byteCount - 2) / 2);
+  uint16_t readCrcVal = (bytes[byteCount - 2] << 8) | bytes[byteCount - 1];
+  if (crcVal != readCrcVal) {
+    decodeError = "bad CRC";
+    return -1;
+  }
+  return byteCount;
+}
+
+int decodeAdaptive(const uint8_t *durations, int len, uint8_t *bytes, int maxBytes) {
+  return decodeSplitAdaptive(durations, len, durations + len, 0, bytes, maxBytes);
+}
@@ -0,0 +1,178 @@
+// PRU backend using prussdrv, for the real BeagleBone hardware.
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <prussdrv.h>
+#include <pruss_intc_mapping.h>
+#include "pru_backend.h"
+
+#define PRUSS_INTC_CUSTOM {   \
+  { PRU0_PRU1_INTERRUPT, PRU1_PRU0_INTERRUPT, PRU0_ARM_INTERRUPT, PRU1_ARM_INTERRUPT, ARM_PRU0_INTERRUPT, ARM_PRU1_INTERRUPT,  15, (char)-1  },  \
+  { {PRU0_PRU1_INTERRUPT,CHANNEL1}, {PRU1_PRU0_INTERRUPT, CHANNEL0}, {PRU0_ARM_INTERRUPT,CHANNEL2}, {PRU1_ARM_INTERRUPT, CHANNEL3}, {ARM_PRU0_INTERRUPT, CHANNEL0}, {ARM_PRU1_INTERRUPT, CHANNEL1}, {15, CHANNEL0}, {-1,-1}},  \
+  {  {CHANNEL0,PRU0}, {CHANNEL1, PRU1}, {CHANNEL2, PRU_EVTOUT0}, {CHANNEL3, PRU_EVTOUT1}, {-1,-1} },  \
+  (PRU0_HOSTEN_MASK | PRU1_HOSTEN_MASK | PRU_EVTOUT0_HOSTEN_MASK | PRU_EVTOUT1_HOSTEN_MASK) /*Enable PRU0, PRU1, PRU_EVTOUT0, PRU_EVTOUT1 */ \
+}
+
+static volatile uint8_t *dataram; // Address of the PRU's data ram
+
+// The uio devices appear once capemgr has loaded the cape's overlay, which
+// may be after the gateway starts at boot.
+#define DEVICE_WAIT_MS 60000
+#define DEVICE_POLL_MS 20
+
+// Each PRU's firmware, read once so it can be reloaded without the files
+struct firmware {
+  const char *dataFile, *textFile;
+  unsigned int *data, *text;
+  int dataLen, textLen; // bytes
+};
+static struct firmware firmware[2] = {
+  { "etherdata.bin", "ethertext.bin" },
+  { "receivedata.bin", "receivetext.bin" }, // With pruDual
+};
+static const unsigned int dataRams[2] = { PRUSS0_PRU0_DATARAM, PRUSS0_PRU1_DATARAM };
+
+// Host event numbers for PRU_EVENT_TX and PRU_EVENT_RX, and the system
+// events the PRUs raise for them
+static const unsigned int hostEvents[PRU_EVENTS] = { PRU_EVTOUT_0, PRU_EVTOUT_1 };
+static const unsigned int sysEvents[PRU_EVENTS] = { PRU0_ARM_INTERRUPT, PRU1_ARM_INTERRUPT };
+
+// Read a whole firmware file into *buf. Returns its length or -1.
+static int readFile(const char *path, unsigned int **buf) {
+  FILE *f = fopen(path, "rb");
+  long len;
+  if (f == NULL || fseek(f, 0, SEEK_END) < 0 || (len = ftell(f)) <= 0) {
+    perror(path);
+    if (f) {
+      fclose(f);
+    }
+    return -1;
+  }
+  rewind(f);
+  *buf = malloc(len);
+  if (fread(*buf, 1, len, f) != (size_t)len) {
+    perror(path);
+    len = -1;
+  }
+  fclose(f);
+  return len;
+}
+
+// Load and start the firmware in one PRU, reading it first if need be.
+// prussdrv_exec_code() disables the PRU, loads the code and restarts it at
+// the beginning.
+static int startPru(int pru) {
+  struct firmware *fw = &firmware[pru];
+  if (fw->data == NULL && ((fw->dataLen = readFile(fw->dataFile, &fw->data)) < 0 ||
+      (fw->textLen = readFile(fw->textFile, &fw->text)) < 0)) {
+    fw->data = NULL;
+    return -1;
+  }
+  prussdrv_pru_disable(pru);
+  if (prussdrv_pru_write_memory(dataRams[pru], 0, fw->data, fw->dataLen) < 0) {
+    fprintf(stderr, "Error loading %s\n", fw->dataFile);
+    return -1;
+  }
+  if (prussdrv_exec_code(pru, fw->text, fw->textLen) < 0) {
+    fprintf(stderr, "Error loading %s\n", fw->textFile);
+    return -1;
+  }
+  return 0;
+}
+
+// Wait for the uio device for a host event to appear.
+static int waitForDevice(int event) {
+  char path[20];
+  int waited;
+  snprintf(path, sizeof(path), "/dev/uio%d", event);
+  for (waited = 0; access(path, R_OK | W_OK) < 0; waited += DEVICE_POLL_MS) {
+    if (waited >= DEVICE_WAIT_MS) {
+      return -1;
+    }
+    if (waited == 0) {
+      fprintf(stderr, "Waiting for %s\n", path);
+    }
+    struct timespec ts = { 0, DEVICE_POLL_MS * 1000000 };
+    nanosleep(&ts, NULL);
+  }
+  return 0;
+}
+
+static int prussdrvOpen() {
+  prussdrv_init();
+  if (waitForDevice(PRU_EVTOUT_0) < 0 || (pruDual && waitForDevice(PRU_EVTOUT_1) < 0)) {
+    fprintf(stderr, "No PRU device after %d s\n", DEVICE_WAIT_MS / 1000);
+  }
+  if (prussdrv_open(PRU_EVTOUT_0) == -1 || (pruDual && prussdrv_open(PRU_EVTOUT_1) == -1)) {
+    fprintf(stderr, "prussdrv_open() failed. Run:\n");
+    fprintf(stderr, "echo PRU-ETHER-ALTO > /sys/devices/bone_capemgr.?/slots\n");
+    return -1;
+  }
+
+  tpruss_intc_initdata pruss_intc_initdata = PRUSS_INTC_CUSTOM;
+  prussdrv_pruintc_init(&pruss_intc_initdata);
+
+  // Start PRU0 first: it sets up the IEP timer the receiving PRU1 uses.
+  if (startPru(0) < 0 || (pruDual && startPru(1) < 0)) {
+    return -1;
+  }
+  if (prussdrv_map_prumem(PRUSS0_PRU0_DATARAM, (void **)&dataram) < 0) {
+    fprintf(stderr, "map_prumem failed");
+    return -1;
+  }
+  return 0;
+}
+
+static volatile uint8_t *prussdrvDataram() {
+  return dataram;
+}
+
+static int prussdrvEventFd(int event) {
+  return prussdrv_pru_event_fd(hostEvents[event]);
+}
+
+static void prussdrvWaitEvent(int event) {
+  prussdrv_pru_wait_event(hostEvents[event]);
+}
+
+static void prussdrvClearEvent(int event) {
+  prussdrv_pru_clear_event(hostEvents[event], sysEvents[event]);
+}
+
+static int prussdrvFinished() {
+  return 0;
+}
+
+// prussdrv maps the whole PRU subsystem, so the IEP timer is there too.
+static uint32_t prussdrvIepNow() {
+  return *(volatile uint32_t *)(dataram + PRU_IEP_COUNT);
+}
+
+// Stop both PRUs and start them again from the firmware read at open(),
+// which also puts back their data RAM as it was loaded. The mappings,
+// the interrupt setup and the event fds stay as they are, apart from any
+// event raised while wedged, which is cleared.
+static int prussdrvRestart() {
+  int i, events = pruDual ? PRU_EVENTS : 1;
+  for (i = 0; i < events; i++) {
+    prussdrv_pru_disable(i);
+    prussdrv_pru_clear_event(hostEvents[i], sysEvents[i]);
+  }
+  if (startPru(0) < 0 || (pruDual && startPru(1) < 0)) {
+    return -1;
+  }
+  return 0;
+}
+
+struct pruBackend prussdrvBackend = {
+  "prussdrv",
+  prussdrvOpen,
+  prussdrvDataram,
+  prussdrvEventFd,
+  prussdrvWaitEvent,
+  prussdrvClearEvent,
+  prussdrvFinished,
+  prussdrvIepNow,
+  prussdrvRestart,
+};
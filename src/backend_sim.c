@@ -0,0 +1,914 @@
+// Simulated PRU backend.
+// A thread stands in for the PRU firmware: it owns a fake struct iface,
+// write buffers and read buffer, and follows the same OWNER_ARM/OWNER_PRU
+// handoff as main.c. Interrupts to the host are signalled on an eventfd
+// per host event. With pruDual, receive uses a second struct iface in
+// PRU1's RAM, as the receive-only firmware on PRU1 does.
+//
+// The thread also plays the rest of the world: it generates frames from a
+// simulated Alto as raw PRU durations, and sends frames to the gateway's
+// UDP port the way IFS would, one per datagram or, with simBatch, batched.
+// With simShm, IFS uses the shared memory transport instead, and checks
+// the frames it gets from the Alto through it.
+// Frames "transmitted" by the PRU are checked and counted.
+// Descriptors are stamped with a simulated IEP timer: CLOCK_MONOTONIC,
+// offset so the gateway has to map it, with the frame's time on the wire
+// at 3 Mb/s.
+//
+// With simReplay set, the frames from the Alto come from a capture file
+// instead, and IFS sends nothing.
+//
+// With simEcho set, neither the Alto nor IFS sends anything of its own.
+// The Alto answers the PUP echoes the PRU sends it, one at a time, since
+// the wire carries one frame at a time; at wire rate, the reply arrives
+// a gap after the request ends.
+//
+// With simBoot set, that many Altos boot at once instead. Each broadcasts
+// a request for simBootFile, and acknowledges the EFTP frames that come
+// back, checking them against the file; it asks again if nothing comes
+// back. IFS takes the frames from the Altos the gateway sends it on
+// UDP_SEND_PORT and answers the requests from simBootDir, so it serves the
+// files when the gateway doesn't. As with echoes, each acknowledgement
+// follows the frame it answers on the wire.
+//
+// The PRU counts up the heartbeat in each iface every time round. With
+// simStall set, it wedges once it has handed over that many frames: the
+// heartbeat stops, and so does everything but the Alto and IFS, until the
+// gateway restarts the firmware. That clears the PRUs' data RAM, as
+// reloading it does, and loses the frames in the transmit ring. At wire
+// rate, the frames the Alto sends meanwhile are missed.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "boot.h"
+#include "capture.h"
+#include "crc.h"
+#include "echo.h"
+#include "gateway.h"
+#include "iface.h"
+#include "manchester.h"
+#include "pru_backend.h"
+#include "shmring.h"
+
+#define SIM_UDP_WINDOW 16 // UDP frames in flight, small enough not to overflow the socket
+#define SIM_GAP_NS 20000 // Gap between frames from the Alto at wire rate
+#define SIM_IEP_OFFSET 0x9e3779b9 // Simulated IEP timer less CLOCK_MONOTONIC
+#define SIM_ALTO_HOST 2
+#define SIM_IFS_HOST 1
+
+int simFrames = 10000;
+int simFrameLength = 560; // Max length PUP plus Ethernet header and CRC
+int simWireRate = 0;
+int simBurst = 0;
+int simCollide = 0;
+int simBatch = 0;
+const char *simShm;
+const char *simReplay;
+int simEcho = 0;
+int simStall = 0;
+int simBoot = 0;
+int simBootFile = 0;
+const char *simBootDir;
+
+static volatile uint8_t *ram;
+static volatile struct iface *rxIface; // PRU1's with pruDual, otherwise the same as txIface
+static volatile struct iface *txIface;
+static int eventFds[PRU_EVENTS] = { -1, -1 };
+static volatile int done;
+static pthread_t thread;
+
+// The frames the simulated Alto (host 2) and IFS (host 1) keep sending
+// each other
+static uint8_t *frame; // From the Alto
+static uint8_t *ifsFrame; // From IFS
+static uint8_t *durations;
+static int durationsLen;
+static uint8_t *udpFrame;
+static uint8_t *halfBits; // ifsFrame as the ARM passes it in TX_MODE_HALF_BITS
+static int halfBitsLen;
+
+static int rxSent, udpSent, txFrames, txBad;
+static int txAttempts, txCollisions, txSkipped;
+static int shmFrames, shmBad; // Frames IFS got through the shared memory transport
+static struct shmringHandle shm;
+static int rxTotal, udpTotal; // Frames to pass each way
+
+// A wedged PRU, and frames that were lost to it
+static volatile int wedged;
+static volatile int restartWanted; // Set by simRestart(), cleared once done
+static int rxMissed, txLost, restarts;
+
+// Frames from the Alto to replay
+static struct captureRecord *replay;
+
+// The Alto's reply to the last frame the PRU sent it, an echo or an
+// acknowledgement, or a booting Alto's request, as durations, to hand over
+// at replyAt
+static uint8_t replyDurations[MAX_PUP_LENGTH * 16];
+static int replyDurationsLen; // 0 when there is none
+static uint64_t replyAt;
+static int echoAnswered;
+
+// With simBoot, the booting Altos, hosts SIM_BOOT_HOST and up, and IFS's
+// end of their transfers
+#define SIM_BOOT_HOST 0100
+#define SIM_BOOT_SOCKET 0100
+#define SIM_IFS_SOCKET 01000 // The simulated IFS's sessions send from this on
+#define SIM_BOOT_RETRY_NS 1000000000 // An Alto asks again if nothing comes back
+static struct {
+  int seq; // Frame it expects next
+  uint64_t askedNs; // When it last asked, 0 if it hasn't
+  uint64_t doneNs; // When the End came, 0 until then
+} altos[SIM_BOOT_ALTOS];
+static int bootsDone;
+static uint64_t bootStartNs; // When the first request went out
+static struct bootFile *bootFile; // What the Altos check the frames against
+static struct bootServer ifsBoot;
+static int ifsSock; // IFS's UDP socket, on UDP_SEND_PORT with simBoot
+static struct sockaddr_in ifsDest; // The gateway's UDP port
+
+// Receive ring state, as kept by the firmware
+static int rHead;
+static uint32_t rPos;
+
+// Transmit ring state
+static int wHead;
+static uint64_t wBusyUntil; // At wire rate, when the current frame is done
+
+static uint64_t nowNs() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// The simulated IEP timer at CLOCK_MONOTONIC ns
+static uint32_t simIep(uint64_t ns) {
+  return ns + SIM_IEP_OFFSET;
+}
+
+// Raise the host event for receive or transmit
+static void simSignal(int event) {
+  uint64_t one = 1;
+  if (pruDual == 0) {
+    event = PRU_EVENT_TX;
+  }
+  if (write(eventFds[event], &one, sizeof(one)) < 0) {
+    perror("eventfd write");
+  }
+}
+
+static uint8_t *makeFrame(int dest, int source) {
+  int i;
+  int len = simFrameLength;
+  uint8_t *f = malloc(len);
+  f[0] = dest; // Destination host
+  f[1] = source; // Source host
+  f[2] = 01000 >> 8; // PUP
+  f[3] = 01000 & 0xff;
+  for (i = 4; i < len - 2; i++) {
+    f[i] = i * 7;
+  }
+  uint16_t crcVal = crc(f, (len - 2) / 2);
+  f[len - 2] = crcVal >> 8;
+  f[len - 1] = crcVal & 0xff;
+  return f;
+}
+
+static void buildFrame() {
+  int len = simFrameLength;
+  frame = makeFrame(SIM_IFS_HOST, SIM_ALTO_HOST);
+  ifsFrame = makeFrame(SIM_ALTO_HOST, SIM_IFS_HOST);
+
+  durations = malloc(len * 16);
+  durationsLen = encodeDurations(frame, len, durations, len * 16);
+
+  halfBits = malloc(len * 2 + 1);
+  halfBitsLen = encodeHalfBits(ifsFrame, len, halfBits, len * 2 + 1);
+
+  // LCM's UDP encoding: length in words, not including the CRC
+  udpFrame = malloc(len);
+  udpFrame[0] = ((len - 2) / 2) >> 8;
+  udpFrame[1] = ((len - 2) / 2) & 0xff;
+  memcpy(udpFrame + 2, ifsFrame, len - 2);
+}
+
+// Decode durations into bytes the way receive_bytes() does on the PRU.
+// Stores at most maxBytes and returns the number stored; *status gets the
+// status receive_bytes() would return.
+static int simDecodeBytes(const uint8_t *durations, int len, uint8_t *bytes, int maxBytes, uint32_t *status) {
+  int count = 0, bits = 0, atMid = 1;
+  uint8_t byte = 0;
+  int i;
+  for (i = 0; i < len; i++) {
+    int width = durations[i] * RECV_WIDTH;
+    if (width < 120 || width >= 400 || (width >= 230 && width < 280) || (width >= 280 && !atMid)) {
+      *status = STATUS_TIMING_ERROR;
+      return count;
+    }
+    if (width < 230) {
+      atMid = !atMid;
+    }
+    if (atMid) {
+      byte = (byte << 1) | (i & 1); // Odd pulses are high
+      if (++bits == 8) {
+        if (count >= maxBytes) {
+          *status = STATUS_INPUT_OVERRUN;
+          return count;
+        }
+        bytes[count++] = byte;
+        bits = 0;
+      }
+    }
+  }
+  *status = bits ? STATUS_BIT_INCOMPLETE : STATUS_INPUT_COMPLETE;
+  return count;
+}
+
+// A frame arrives from the Alto. Store it in the next receive descriptor
+// the way receive_packet() does, or count it as dropped. In
+// RECV_MODE_BYTES, decode it first and store the bytes, as receive_bytes()
+// does.
+static void simReceive(const uint8_t *durations, int durationsLen, uint32_t status) {
+  volatile struct rx_desc *desc = &rxIface->r_desc[rHead];
+  if (desc->owner != OWNER_PRU) {
+    rxIface->r_dropped++;
+    return;
+  }
+  uint32_t start = rxIface->r_buf_start;
+  uint32_t end = rxIface->r_buf_end;
+  uint32_t produced = rxIface->r_produced;
+  uint8_t bytes[MAX_PUP_LENGTH];
+  uint64_t wireNs = 0;
+  int count;
+  for (count = 0; count < durationsLen; count++) {
+    wireNs += durations[count] * RECV_WIDTH;
+  }
+  if (rxIface->r_mode == RECV_MODE_BYTES && status == STATUS_INPUT_COMPLETE) {
+    durationsLen = simDecodeBytes(durations, durationsLen, bytes, rxIface->r_max_length, &status);
+    durations = bytes;
+    if (status == STATUS_INPUT_OVERRUN) {
+      rxIface->r_overrun++;
+    }
+  }
+  if (rPos < start || rPos >= end) {
+    rPos = start;
+  }
+  desc->offset = rPos;
+  // The frame has just ended, so its sync edge was its pulses ago.
+  uint64_t now = nowNs();
+  desc->timestamp = simIep(now - wireNs);
+  desc->end = simIep(now);
+  for (count = 0; count < durationsLen; count++) {
+    if (count >= rxIface->r_max_length || produced - rxIface->r_consumed >= end - start) {
+      rxIface->r_overrun++;
+      status = STATUS_INPUT_OVERRUN;
+      break;
+    }
+    ram[rPos] = durations[count];
+    if (++rPos == end) {
+      rPos = start;
+    }
+    produced++;
+  }
+  desc->length = count;
+  desc->status = status;
+  rxIface->r_produced = produced;
+  __sync_synchronize();
+  desc->owner = OWNER_ARM;
+  simSignal(PRU_EVENT_RX);
+  rHead = (rHead + 1) % RX_RING_SIZE;
+}
+
+// Durations in the next frame from the Alto
+static int rxNextLen() {
+  return replay ? replay[rxSent].header.durationsLen : durationsLen;
+}
+
+// Nonzero if there is a free descriptor and room for len durations
+static int rxRoomFor(int len) {
+  return rxIface->r_desc[rHead].owner == OWNER_PRU &&
+    (rxIface->r_buf_end - rxIface->r_buf_start) - (rxIface->r_produced - rxIface->r_consumed) >= len;
+}
+
+// Nonzero if there is a free descriptor and room for the next frame
+static int rxRoom() {
+  return rxRoomFor(rxNextLen());
+}
+
+static void rxNext() {
+  if (replay) {
+    struct captureRecord *r = &replay[rxSent];
+    simReceive(r->durations, r->header.durationsLen, r->header.status);
+  } else {
+    simReceive(durations, durationsLen, STATUS_INPUT_COMPLETE);
+  }
+  rxSent++;
+}
+
+// Undo encodeHalfBits(): each bit's first half is its value. Returns the
+// number of bytes, or -1 if there are more than maxBytes.
+static int simHalfBitsToBytes(const uint8_t *halfBits, int halves, uint8_t *bytes, int maxBytes) {
+  int len = (halves - 3) / 16;
+  int i, b;
+  if (len > maxBytes) {
+    return -1;
+  }
+  for (i = 0; i < len; i++) {
+    uint8_t byte = 0;
+    for (b = 0; b < 8; b++) {
+      int h = 2 + 16 * i + 2 * b; // After the sync bit
+      byte = (byte << 1) | ((halfBits[h / 8] >> (7 - h % 8)) & 1);
+    }
+    bytes[i] = byte;
+  }
+  return len;
+}
+
+// The bytes of a frame of len the PRU sent, in the ARM's w_mode, into
+// bytes. Returns their number, with the CRC, or -1 if the CRC is wrong.
+static int simSentBytes(const uint8_t *buf, int len, uint8_t *bytes) {
+  if (txIface->w_mode == TX_MODE_HALF_BITS) {
+    len = simHalfBitsToBytes(buf, len, bytes, MAX_PUP_LENGTH);
+  } else if (len <= MAX_PUP_LENGTH) {
+    memcpy(bytes, buf, len);
+  } else {
+    len = -1;
+  }
+  if (len < 4 || crc(bytes, len / 2 - 1) != ((bytes[len - 2] << 8) | bytes[len - 1])) {
+    return -1;
+  }
+  return len;
+}
+
+// Have the Alto send reply, of len bytes with its CRC, at replyAt.
+static void simReply(const uint8_t *reply, int len, uint64_t at) {
+  replyDurationsLen = encodeDurations(reply, len, replyDurations, sizeof(replyDurations));
+  replyAt = at;
+}
+
+// The PRU sent a frame of len bytes to the Alto, ending at end. If it is
+// a good EchoMe for the Alto, make the reply. Returns nonzero if so.
+static int simEchoReply(const uint8_t *buf, int len, uint64_t end) {
+  uint8_t bytes[MAX_PUP_LENGTH], reply[MAX_PUP_LENGTH];
+  len = simSentBytes(buf, len, bytes);
+  if (len < 0 || bytes[0] != SIM_ALTO_HOST) {
+    return 0;
+  }
+  int replyLen = echoAnswer(bytes, len - 2, reply);
+  if (replyLen < 0) {
+    return 0;
+  }
+  simReply(reply, replyLen, end + SIM_GAP_NS + (2 + 16 * replyLen + 1) * HALF_BIT_NS);
+  echoAnswered++;
+  return 1;
+}
+
+// Make a PUP of type with no data from booting Alto a to port dest, which
+// sends it to host on the wire, and have the Alto send it at at.
+static void simBootSend(int a, int host, int type, uint32_t id, const uint8_t *dest, uint64_t at) {
+  uint8_t frame[4 + PUP_HEADER_BYTES + 2 + 2];
+  uint8_t *pup = frame + 4;
+  memset(frame, 0, sizeof(frame));
+  frame[0] = host;
+  frame[1] = SIM_BOOT_HOST + a;
+  pupSetWord(frame + 2, PUP_ETHER_TYPE);
+  pupSetWord(pup + PUP_LENGTH, PUP_HEADER_BYTES + 2);
+  pup[PUP_TYPE] = type;
+  pupSetLong(pup + PUP_ID, id);
+  memcpy(pup + PUP_DEST, dest, 6);
+  pup[PUP_SOURCE + 1] = SIM_BOOT_HOST + a;
+  pupSetLong(pup + PUP_SOURCE + 2, SIM_BOOT_SOCKET);
+  int len = pupFinishFrame(frame);
+  simReply(frame, len, at + (2 + 16 * len + 1) * HALF_BIT_NS);
+}
+
+// Have the next booting Alto that hasn't asked for its boot file, or has
+// had nothing back for SIM_BOOT_RETRY_NS, broadcast its request. Returns
+// nonzero if one did.
+static int simBootAsk(uint64_t now) {
+  static const uint8_t misc[6] = { 0, 0, 0, 0, 0, PUP_MISC_SOCKET };
+  int a;
+  for (a = 0; a < simBoot; a++) {
+    if (altos[a].seq == 0 && (altos[a].askedNs == 0 || now - altos[a].askedNs >= SIM_BOOT_RETRY_NS)) {
+      if (bootStartNs == 0) {
+        bootStartNs = now;
+      }
+      altos[a].askedNs = now;
+      simBootSend(a, 0, PUP_BOOT_FILE_REQUEST, simBootFile, misc, simWireRate && wBusyUntil > now ? wBusyUntil : now);
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// The PRU sent a frame of len bytes, ending at end. If it is the next
+// frame of the boot file for one of the booting Altos, or the one before
+// again, have the Alto acknowledge it. Returns nonzero if it was for one
+// of them and good.
+static int simBootReply(const uint8_t *buf, int len, uint64_t end) {
+  uint8_t bytes[MAX_PUP_LENGTH];
+  len = simSentBytes(buf, len, bytes);
+  int a = len < 0 ? -1 : bytes[0] - SIM_BOOT_HOST;
+  if (a < 0 || a >= simBoot) {
+    return 0;
+  }
+  const uint8_t *pup = pupFind(bytes, len - 2, PUP_EFTP_DATA);
+  if (pup == NULL) {
+    pup = pupFind(bytes, len - 2, PUP_EFTP_END);
+  }
+  uint32_t id = pup ? pupLong(pup + PUP_ID) : 0;
+  if (pup == NULL || id > (uint32_t)altos[a].seq || id >= (uint32_t)bootFile->count) {
+    return 0;
+  }
+  const uint8_t *want = bootFile->frames[id].data + 4;
+  int pupLength = pupWord(pup + PUP_LENGTH);
+  if (pup[PUP_TYPE] != want[PUP_TYPE] || pupLength != pupWord(want + PUP_LENGTH) ||
+      memcmp(pup + PUP_HEADER_BYTES, want + PUP_HEADER_BYTES, pupLength - PUP_HEADER_BYTES - 2) != 0) {
+    return 0;
+  }
+  if (id == (uint32_t)altos[a].seq) {
+    altos[a].seq++;
+    if (pup[PUP_TYPE] == PUP_EFTP_END) {
+      altos[a].doneNs = end;
+      bootsDone++;
+    }
+  }
+  simBootSend(a, bytes[1], PUP_EFTP_ACK, id, pup + PUP_SOURCE, end + SIM_GAP_NS);
+  return 1;
+}
+
+// IFS sends a frame of len bytes, with its CRC, to the gateway.
+static int simIfsSend(const uint8_t *frame, int len, uint64_t now) {
+  uint8_t buf[MAX_PUP_LENGTH];
+  int words = len / 2 - 1;
+  buf[0] = words >> 8;
+  buf[1] = words & 0xff;
+  memcpy(buf + 2, frame, len - 2);
+  return sendto(ifsSock, buf, len, 0, (struct sockaddr *)&ifsDest, sizeof(ifsDest)) >= 0;
+}
+
+// IFS takes the frames from the booting Altos that the gateway sends it,
+// and sends what the boot server has for them. Returns nonzero if there
+// were any.
+static int simIfsBoot() {
+  uint8_t buf[UDP_BATCH_MAX_BYTES];
+  uint64_t now = nowNs();
+  int busy = 0, len;
+  while ((len = recv(ifsSock, buf, sizeof(buf), MSG_DONTWAIT)) >= 2) {
+    int words = pupWord(buf);
+    if (!(words & UDP_BATCH_FLAG) && 2 + 2 * words <= len) {
+      bootReceive(&ifsBoot, buf + 2, 2 * words, now);
+    }
+    busy = 1;
+  }
+  bootTick(&ifsBoot, now);
+  return busy;
+}
+
+// Nonzero while IFS is still sending a file: the acknowledgement of its End
+// may still be on its way through the gateway.
+static int simIfsSending() {
+  int i;
+  for (i = 0; i < BOOT_SESSIONS; i++) {
+    if (ifsBoot.sessions[i].file != NULL) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// Nonzero once the ARM has set up the interface and handed over the
+// receive descriptors
+static int simStarted() {
+  return rxIface->r_desc[RX_RING_SIZE - 1].owner != 0;
+}
+
+// Send up to n frames from IFS in batched datagrams.
+static void simSendBatch(int sock, struct sockaddr_in *dest, int n) {
+  static uint8_t buf[UDP_BATCH_MAX_BYTES];
+  while (n > 0 && udpSent < udpTotal) {
+    int len = 2, count = 0;
+    while (count < n && udpSent + count < udpTotal && len + simFrameLength <= UDP_BATCH_MAX_BYTES) {
+      memcpy(buf + len, udpFrame, simFrameLength);
+      len += simFrameLength;
+      count++;
+    }
+    buf[0] = (UDP_BATCH_FLAG | count) >> 8;
+    buf[1] = count & 0xff;
+    if (sendto(sock, buf, len, 0, (struct sockaddr *)dest, sizeof(*dest)) < 0) {
+      perror("sim sendto");
+    }
+    udpSent += count;
+    n -= count;
+  }
+}
+
+// Send up to n frames from IFS through the shared memory ring, as many as
+// fit.
+static void simSendRing(int n) {
+  volatile struct shmringSlot *slot;
+  while (n-- > 0 && udpSent < udpTotal && (slot = shmringReserve(shm.out)) != NULL) {
+    memcpy((uint8_t *)slot->data, udpFrame, simFrameLength);
+    slot->length = simFrameLength;
+    if (shmringPublish(shm.out)) {
+      shmringRing(shm.bellOut);
+    }
+    udpSent++;
+  }
+}
+
+// IFS takes the frames from the Alto out of the shared memory ring.
+static int simRecvRing() {
+  volatile struct shmringSlot *slot;
+  int busy = 0;
+  while ((slot = shmringPeek(shm.in)) != NULL) {
+    // The gateway passes the UDP format: length in words, frame less its CRC
+    if (slot->length != simFrameLength || slot->data[0] != udpFrame[0] || slot->data[1] != udpFrame[1] ||
+        memcmp((uint8_t *)slot->data + 2, frame, simFrameLength - 2) != 0) {
+      shmBad++;
+    }
+    shmFrames++;
+    shmringRelease(shm.in);
+    busy = 1;
+  }
+  return busy;
+}
+
+// Nonzero when the ARM has handed back every receive descriptor
+static int simRecvIdle() {
+  int i;
+  for (i = 0; i < RX_RING_SIZE; i++) {
+    if (rxIface->r_desc[i].owner != OWNER_PRU) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+// Reload the firmware: clear each PRU's data RAM, where the ARM will set
+// up the interface again, and start the rings from the beginning. Frames
+// still in the transmit ring are lost, and so is a reply on the wire.
+static void simReload() {
+  int i;
+  for (i = 0; i < TX_RING_SIZE; i++) {
+    if (txIface->w_desc[i].owner == OWNER_PRU && txIface->w_desc[i].length != 0) {
+      txLost++;
+    }
+  }
+  memset((uint8_t *)ram, 0, pruDual ? PRU1_RAM * 2 : PRU1_RAM);
+  rHead = wHead = 0;
+  rPos = 0;
+  wBusyUntil = 0;
+  replyDurationsLen = 0;
+  wedged = 0;
+  restarts++;
+}
+
+static void *simThread(void *arg) {
+  int sock = socket(AF_INET, SOCK_DGRAM, 0);
+  struct sockaddr_in dest;
+  memset(&dest, '\0', sizeof(dest));
+  dest.sin_family = AF_INET;
+  dest.sin_port = htons(UDP_RECV_PORT);
+  dest.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  // Time on the wire for one frame: sync bit, data and trailing 1
+  uint64_t frameNs = (simFrameLength * 8 + 2) * 2 * HALF_BIT_NS + SIM_GAP_NS;
+  uint64_t nextFrame = 0;
+  ifsSock = sock;
+  ifsDest = dest;
+  if (simBoot) {
+    // Where the gateway sends IFS the frames from the Alto
+    struct sockaddr_in addr;
+    memset(&addr, '\0', sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(UDP_SEND_PORT);
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+      perror("sim bind");
+    }
+  }
+
+  while (1) {
+    int busy = 0;
+
+    if (restartWanted) {
+      simReload();
+      restartWanted = 0;
+    }
+    if (simStall && rxSent >= simStall && !wedged && restarts == 0) {
+      wedged = 1;
+    }
+    // The firmware answers the interface version when it starts
+    if (txIface->version == IFACE_VERSION) {
+      txIface->version = IFACE_VERSION_OK;
+    }
+    if (rxIface->version == IFACE_VERSION) {
+      rxIface->version = IFACE_VERSION_OK;
+    }
+    if (!wedged) {
+      rxIface->heartbeat++;
+      txIface->heartbeat++;
+    }
+
+    // Receive side: at full rate, hand the ARM a frame as soon as there is
+    // room for it. At wire rate, frames arrive on schedule whether or not
+    // there is room. Replayed frames keep the spacing they were captured
+    // with.
+    if (!wedged && replyDurationsLen > 0 && (simWireRate ? nowNs() >= replyAt : rxRoomFor(replyDurationsLen))) {
+      // At wire rate the reply arrives whether or not there is room for it
+      simReceive(replyDurations, replyDurationsLen, STATUS_INPUT_COMPLETE);
+      replyDurationsLen = 0;
+      wBusyUntil = replyAt + txIface->w_gap;
+      rxSent++;
+      busy = 1;
+    }
+    if (simBoot && !wedged && replyDurationsLen == 0 && simStarted() && simBootAsk(nowNs())) {
+      busy = 1;
+    }
+    if (simStarted() && rxSent < rxTotal) {
+      if (simWireRate) {
+        uint64_t now = nowNs();
+        if (nextFrame == 0) {
+          nextFrame = now;
+        }
+        if (now >= nextFrame) {
+          uint64_t gap = frameNs;
+          if (wedged) {
+            rxSent++;
+            rxMissed++;
+          } else {
+            rxNext();
+          }
+          if (replay && rxSent < rxTotal) {
+            gap = replay[rxSent].timeNs - replay[rxSent - 1].timeNs;
+          }
+          // If this thread fell behind, don't catch up with a burst
+          // faster than the wire could carry.
+          nextFrame = (now - nextFrame > gap ? now : nextFrame) + gap;
+          busy = 1;
+        }
+      } else if (wedged) {
+        // The Alto waits
+      } else if (simBurst) {
+        // Wait for the ARM to catch up, then fill every free descriptor
+        if (simRecvIdle()) {
+          while (rxSent < rxTotal && rxRoom()) {
+            rxNext();
+          }
+          busy = 1;
+        }
+      } else if (rxRoom()) {
+        rxNext();
+        busy = 1;
+      }
+    }
+
+    // Transmit side: "send" the write descriptors in order and check they
+    // arrived intact. At wire rate, each one takes its time on the wire
+    // plus the inter-frame gap. With simCollide, some sends collide and,
+    // as in the firmware, the ring waits for the ARM to retry or skip them.
+    volatile struct tx_desc *wdesc = &txIface->w_desc[wHead];
+    if (!wedged && wdesc->owner == OWNER_PRU && (!simWireRate || nowNs() >= wBusyUntil) && replyDurationsLen == 0) {
+      __sync_synchronize();
+      int len = wdesc->length;
+      if (len == 0) {
+        txSkipped++;
+        wdesc->status = STATUS_OUTPUT_COMPLETE;
+        wHead = (wHead + 1) % TX_RING_SIZE;
+      } else if (simCollide && ++txAttempts % simCollide == 0) {
+        txCollisions++;
+        wdesc->status = STATUS_BIT_COLLISION;
+      } else {
+        uint8_t *buf = (uint8_t *)ram + wdesc->buf;
+        int halves = len * 16 + 3; // Sync bit, data and trailing 1
+        uint64_t now = nowNs();
+        if (txIface->w_mode == TX_MODE_HALF_BITS) {
+          halves = len;
+        }
+        if (simEcho) {
+          if (!simEchoReply(buf, len, now + halves * HALF_BIT_NS)) {
+            txBad++;
+          }
+        } else if (simBoot) {
+          if (!simBootReply(buf, len, now + halves * HALF_BIT_NS)) {
+            txBad++;
+          }
+        } else if (txIface->w_mode == TX_MODE_HALF_BITS) {
+          if (len != halfBitsLen || memcmp(buf, halfBits, (len + 7) / 8) != 0) {
+            txBad++;
+          }
+        } else if (len != simFrameLength || memcmp(buf, ifsFrame, len) != 0) {
+          txBad++;
+        }
+        txFrames++;
+        wdesc->start = simIep(now);
+        wdesc->end = simIep(now + halves * HALF_BIT_NS);
+        if (simWireRate) {
+          wBusyUntil = now + halves * HALF_BIT_NS + txIface->w_gap;
+        }
+        wdesc->status = STATUS_OUTPUT_COMPLETE;
+        wHead = (wHead + 1) % TX_RING_SIZE;
+      }
+      __sync_synchronize();
+      wdesc->owner = OWNER_ARM;
+      simSignal(PRU_EVENT_TX);
+      busy = 1;
+    }
+
+    // IFS side: keep a few frames queued at the gateway's UDP socket. In
+    // burst mode, send a window's worth at once after the last one is done.
+    int txGone = txFrames + txSkipped + txLost;
+    if (simStarted() && udpSent < udpTotal && (simBurst ? udpSent == txGone : udpSent - txGone < SIM_UDP_WINDOW)) {
+      int n = simBurst ? SIM_UDP_WINDOW : 1;
+      if (simShm) {
+        simSendRing(n);
+      } else if (simBatch) {
+        simSendBatch(sock, &dest, n);
+      }
+      while (!simShm && !simBatch && n-- > 0 && udpSent < udpTotal) {
+        if (sendto(sock, udpFrame, simFrameLength, 0, (struct sockaddr *)&dest, sizeof(dest)) < 0) {
+          perror("sim sendto");
+        }
+        udpSent++;
+      }
+      busy = 1;
+    }
+
+    if (simShm && simRecvRing()) {
+      busy = 1;
+    }
+    if (simBoot && simIfsBoot()) {
+      busy = 1;
+    }
+    if (simBoot && bootsDone == simBoot && replyDurationsLen == 0 && simRecvIdle() && !simIfsSending()) {
+      break;
+    }
+
+    if (!simEcho && !simBoot && rxSent == rxTotal && simRecvIdle() && txGone == udpTotal) {
+      break;
+    }
+    if (!busy) {
+      sched_yield();
+    }
+  }
+  close(sock);
+  done = 1;
+  simSignal(PRU_EVENT_TX);
+  return NULL;
+}
+
+// Load the frames from the Alto in the capture to replay.
+static int loadReplay() {
+  struct captureRecord *records;
+  int count = captureLoad(simReplay, &records);
+  int i;
+  if (count < 0) {
+    return -1;
+  }
+  replay = records;
+  rxTotal = 0;
+  for (i = 0; i < count; i++) {
+    if (records[i].header.direction == CAPTURE_FROM_ALTO && records[i].header.durationsLen > 0) {
+      replay[rxTotal++] = records[i];
+    }
+  }
+  udpTotal = 0;
+  printf("Replaying %d frames from %s\n", rxTotal, simReplay);
+  return 0;
+}
+
+static int simOpen() {
+  if (simFrameLength & 1 || simFrameLength < 6 || simFrameLength > MAX_PUP_LENGTH - 2) {
+    fprintf(stderr, "Bad simulated frame length %d\n", simFrameLength);
+    return -1;
+  }
+  int i;
+  ram = calloc(1, PRU_RAM_SIZE);
+  txIface = (volatile struct iface *)ram;
+  rxIface = (volatile struct iface *)(ram + (pruDual ? PRU1_RAM : 0));
+  for (i = 0; i < PRU_EVENTS; i++) {
+    eventFds[i] = eventfd(0, 0);
+    if (eventFds[i] < 0) {
+      perror("eventfd");
+      return -1;
+    }
+  }
+  buildFrame();
+  if (simShm) {
+    if (shmringOpen(simShm, 0, &shm) < 0) {
+      return -1;
+    }
+    shm.file->attached = getpid();
+  }
+  rxTotal = udpTotal = simEcho || simBoot ? 0 : simFrames;
+  if (simBoot) {
+    struct bootDir *dir = bootOpen(simBootDir);
+    if (dir == NULL) {
+      return -1;
+    }
+    if ((bootFile = bootLoad(dir, simBootFile)) == NULL) {
+      fprintf(stderr, "No boot file %#o in %s\n", simBootFile, simBootDir);
+      return -1;
+    }
+    bootServerInit(&ifsBoot, dir, SIM_IFS_SOCKET, simIfsSend);
+  }
+  if (simReplay && loadReplay() < 0) {
+    return -1;
+  }
+  if (pthread_create(&thread, NULL, simThread, NULL) != 0) {
+    fprintf(stderr, "Can't start simulation thread\n");
+    return -1;
+  }
+  return 0;
+}
+
+static volatile uint8_t *simDataram() {
+  return ram;
+}
+
+static int simEventFd(int event) {
+  return eventFds[event];
+}
+
+static void simWaitEvent(int event) {
+  uint64_t count;
+  if (read(eventFds[event], &count, sizeof(count)) < 0) {
+    perror("eventfd read");
+  }
+}
+
+static void simClearEvent(int event) {
+}
+
+static int simFinished() {
+  return done;
+}
+
+static uint32_t simIepNow() {
+  return simIep(nowNs());
+}
+
+// Have the simulation thread reload the firmware, and wait until it has.
+// Sleep rather than yield: in real-time mode, this thread would otherwise
+// keep the simulation from running.
+static int simRestart() {
+  struct timespec ts = { 0, 10000 };
+  restartWanted = 1;
+  while (restartWanted) {
+    nanosleep(&ts, NULL);
+  }
+  return 0;
+}
+
+void simReport() {
+  int i;
+  printf("Simulated PRU: %d frames to ARM, %d frames from ARM (%d bad), %d UDP frames sent\n",
+      rxSent, txFrames, txBad, udpSent);
+  printf("Receive ring: %u dropped, %u overrun\n", rxIface->r_dropped, rxIface->r_overrun);
+  if (simCollide) {
+    printf("Collisions: %d, %d frames skipped\n", txCollisions, txSkipped);
+  }
+  if (simEcho) {
+    printf("Simulated Alto answered %d echoes\n", echoAnswered);
+  }
+  if (simStall) {
+    printf("PRU wedged after %d frames: %d restarts, %d frames from the Alto missed, %d to it lost\n",
+        simStall, restarts, rxMissed, txLost);
+  }
+  if (simBoot) {
+    uint64_t total = 0, last = 0;
+    for (i = 0; i < simBoot; i++) {
+      uint64_t ns = altos[i].doneNs - bootStartNs;
+      total += ns;
+      last = ns > last ? ns : last;
+    }
+    printf("%d Altos booted %s (%ld bytes) in %.1f ms, %.1f ms on average; IFS sent %ld of them\n",
+        simBoot, bootFile->name, bootFile->bytes, last / 1e6, total / 1e6 / simBoot, ifsBoot.served);
+  }
+  if (simShm) {
+    // Frames the gateway's pipeline was still passing on when the
+    // simulated PRU finished
+    simRecvRing();
+    printf("Shared memory: IFS got %d frames from the Alto (%d bad)\n", shmFrames, shmBad);
+  }
+}
+
+struct pruBackend simBackend = {
+  "sim",
+  simOpen,
+  simDataram,
+  simEventFd,
+  simWaitEvent,
+  simClearEvent,
+  simFinished,
+  simIepNow,
+  simRestart,
+};
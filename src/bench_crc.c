@@ -0,0 +1,126 @@
+// Equivalence check and throughput benchmark for the table-driven CRC.
+// The original bit-at-a-time crc() is kept here as the reference.
+//
+// Usage:
+// $ ./bench_crc [iterations]
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "crc.h"
+#include "gateway.h"
+
+// Shift one byte into the CRC a bit at a time, as the original crc() did.
+static uint16_t crcBitwiseByte(uint16_t crc, uint8_t byte) {
+  uint16_t data = byte << 8;
+  int i;
+  for (i = 0; i < 8; i++) {
+    uint16_t xorFeedback = (crc ^ data) & 0x8000; // Test upper bit
+    crc = crc << 1;
+    data = data << 1;
+    if (xorFeedback) {
+      crc ^= 0x8005; // CRC-16 polynomial constant
+    }
+  }
+  return crc;
+}
+
+static uint16_t crcBitwise(uint8_t *buf, int len) {
+  uint16_t crc = 0x8005; // Due to the sync bit
+  int n;
+  for (n = 0; n < 2 * len; n++) {
+    crc = crcBitwiseByte(crc, buf[n]);
+  }
+  return crc;
+}
+
+// Byte-at-a-time table version, for comparison with slice-by-2
+static uint16_t crcBytewise(uint8_t *buf, int len) {
+  uint16_t crc = CRC_SEED;
+  int n;
+  for (n = 0; n < 2 * len; n++) {
+    crc = crcByte(crc, buf[n]);
+  }
+  return crc;
+}
+
+static int checkEquivalence() {
+  int errors = 0;
+  uint32_t state, x;
+  int b, len, n;
+
+  // Every register state with every input byte
+  for (state = 0; state < 0x10000; state++) {
+    for (b = 0; b < 256; b++) {
+      if (crcByte(state, b) != crcBitwiseByte(state, b)) {
+        errors++;
+      }
+    }
+  }
+
+  // A whole word: the result only depends on state ^ word, so all 64K
+  // values cover every state and word.
+  for (x = 0; x < 0x10000; x++) {
+    uint8_t word[2] = { x >> 8, x & 0xff };
+    if (crcUpdate(0, word, 2) != crcBitwiseByte(crcBitwiseByte(0, word[0]), word[1])) {
+      errors++;
+    }
+  }
+
+  // Random frames of every length, whole and split at every point
+  uint8_t buf[MAX_PUP_LENGTH];
+  for (len = 0; len <= MAX_PUP_LENGTH / 2; len++) {
+    for (n = 0; n < 2 * len; n++) {
+      buf[n] = rand();
+    }
+    uint16_t expected = crcBitwise(buf, len);
+    if (crc(buf, len) != expected) {
+      errors++;
+    }
+    for (n = 0; n <= 2 * len; n++) {
+      if (crcUpdate(crcUpdate(CRC_SEED, buf, n), buf + n, 2 * len - n) != expected) {
+        errors++;
+      }
+    }
+  }
+  return errors;
+}
+
+static double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void timeCrc(const char *name, uint16_t (*fn)(uint8_t *, int), uint8_t *buf, int len, int iterations) {
+  volatile uint16_t sink = 0;
+  int n;
+  double start = now();
+  for (n = 0; n < iterations; n++) {
+    buf[0] = n;
+    sink ^= fn(buf, len);
+  }
+  double elapsed = now() - start;
+  printf("%-10s %8.0f ns/frame %8.1f MB/s\n", name, elapsed * 1e9 / iterations,
+      2.0 * len * iterations / elapsed / 1e6);
+}
+
+int main(int argc, char **argv) {
+  int iterations = argc > 1 ? atoi(argv[1]) : 100000;
+  int errors = checkEquivalence();
+  if (errors) {
+    printf("Table CRC disagrees with the bitwise CRC in %d cases\n", errors);
+    return 1;
+  }
+  printf("Table CRC matches the bitwise CRC\n");
+
+  uint8_t buf[MAX_PUP_LENGTH];
+  int len = (MAX_PUP_LENGTH - 4) / 2; // Words covered by the CRC in a max-length frame
+  int n;
+  for (n = 0; n < 2 * len; n++) {
+    buf[n] = rand();
+  }
+  timeCrc("bitwise", crcBitwise, buf, len, iterations / 10);
+  timeCrc("bytewise", crcBytewise, buf, len, iterations);
+  timeCrc("slice-by-2", crc, buf, len, iterations);
+  return 0;
+}
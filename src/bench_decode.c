@@ -0,0 +1,164 @@
+// Micro-benchmark for decode().
+// Compares the single-pass decoder against the original three-buffer
+// decoder on max-length frames, and checks that both accept and reject
+// the same traces.
+//
+// Usage:
+// $ ./bench_decode [iterations]
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "crc.h"
+#include "gateway.h"
+#include "manchester.h"
+
+// Largest frame decode() accepts: it rejects a 564th byte
+#define FRAME_LENGTH (MAX_PUP_LENGTH - 2)
+#define FRAMES 16
+
+static uint8_t bitBuf[16 * MAX_PUP_LENGTH + 2];
+
+// The original decode(), kept as the reference. The stderr prints are removed.
+static int decodeReference(const uint8_t *durationBuf, int len, uint8_t *byteBuf, int byteBufLen) {
+  int offset1;
+  int offset2 = 0;
+  int value = 1;
+  for (offset1 = 0; offset1 < len; offset1++) {
+    int width = durationBuf[offset1] * RECV_WIDTH;
+    if (width < 120) {
+      return -1;
+    } else if (width < 230) {
+      value = !value;
+      bitBuf[offset2++] = value;
+    } else if (width < 280) {
+      return -1;
+    } else if (width < 400) {
+      value = !value;
+      bitBuf[offset2++] = value;
+      bitBuf[offset2++] = value;
+    } else {
+      return -1;
+    }
+  }
+
+  uint8_t byte = 0;
+  int byteCount = 0;
+  int i;
+  if ((offset2 % 2) == 0) {
+    bitBuf[offset2] = 1;
+    offset2 += 1;
+  }
+  for (i = 1; i < offset2; i += 2) {
+    if (bitBuf[i] == bitBuf[i+1]) {
+      byte = byte << 1;
+    } else {
+      byte = (byte << 1) | bitBuf[i];
+    }
+    if ((i % 16) == 15) {
+      byteBuf[byteCount++] = byte;
+      if (byteCount >= byteBufLen) {
+        return -1;
+      }
+      byte = 0;
+    }
+  }
+  if ((offset2 % 16) != 1) {
+    return -1;
+  }
+  if (byteCount < 2) {
+    return -1; // The original read stale bytes before byteBuf here
+  }
+
+  uint16_t crcVal = crc(byteBuf, (byteCount - 2) / 2);
+  uint16_t readCrcVal = (byteBuf[byteCount - 2] << 8) | byteBuf[byteCount - 1];
+  if (crcVal != readCrcVal) {
+    return -1;
+  }
+  return byteCount;
+}
+
+static double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static uint8_t traces[FRAMES][16 * FRAME_LENGTH];
+static int traceLens[FRAMES];
+
+// Time one decoder over all the traces. Returns ns per frame.
+static double timeDecoder(int (*fn)(const uint8_t *, int, uint8_t *, int), int iterations) {
+  uint8_t bytes[MAX_PUP_LENGTH];
+  int n, f;
+  int accepted = 0;
+  double start = now();
+  for (n = 0; n < iterations; n++) {
+    for (f = 0; f < FRAMES; f++) {
+      accepted += fn(traces[f], traceLens[f], bytes, MAX_PUP_LENGTH) > 0;
+    }
+  }
+  double elapsed = now() - start;
+  if (accepted != iterations * FRAMES) {
+    fprintf(stderr, "Only %d of %d frames decoded\n", accepted, iterations * FRAMES);
+    exit(1);
+  }
+  return elapsed * 1e9 / (iterations * FRAMES);
+}
+
+// Check that both decoders agree on good traces and on damaged ones.
+static int checkEquivalence() {
+  uint8_t trace[16 * FRAME_LENGTH];
+  uint8_t bytes1[MAX_PUP_LENGTH], bytes2[MAX_PUP_LENGTH];
+  int mismatches = 0;
+  int n;
+  for (n = 0; n < 200000; n++) {
+    int f = n % FRAMES;
+    int len = traceLens[f];
+    memcpy(trace, traces[f], len);
+    if (n >= FRAMES) {
+      // Damage a few widths, or cut the trace short
+      int k;
+      for (k = 0; k < 1 + n % 3; k++) {
+        trace[rand() % len] = rand() % 256;
+      }
+      if (n % 7 == 0) {
+        len = rand() % len;
+      }
+    }
+    int len1 = decodeReference(trace, len, bytes1, MAX_PUP_LENGTH);
+    int len2 = decode(trace, len, bytes2, MAX_PUP_LENGTH);
+    if (len1 != len2 || (len1 > 0 && memcmp(bytes1, bytes2, len1) != 0)) {
+      mismatches++;
+    }
+  }
+  return mismatches;
+}
+
+int main(int argc, char **argv) {
+  int iterations = argc > 1 ? atoi(argv[1]) : 2000;
+  int f, i;
+  for (f = 0; f < FRAMES; f++) {
+    uint8_t frame[FRAME_LENGTH];
+    for (i = 0; i < FRAME_LENGTH - 2; i++) {
+      frame[i] = rand();
+    }
+    uint16_t crcVal = crc(frame, (FRAME_LENGTH - 2) / 2);
+    frame[FRAME_LENGTH - 2] = crcVal >> 8;
+    frame[FRAME_LENGTH - 1] = crcVal & 0xff;
+    traceLens[f] = encodeDurations(frame, FRAME_LENGTH, traces[f], sizeof(traces[f]));
+  }
+
+  int mismatches = checkEquivalence();
+  if (mismatches) {
+    printf("decode() disagrees with the reference on %d traces\n", mismatches);
+    return 1;
+  }
+
+  double ref = timeDecoder(decodeReference, iterations);
+  double fast = timeDecoder(decode, iterations);
+  printf("%d-byte frames, %d iterations\n", FRAME_LENGTH, iterations * FRAMES);
+  printf("reference decode: %8.0f ns/packet\n", ref);
+  printf("decode:           %8.0f ns/packet (%.1fx)\n", fast, ref / fast);
+  return 0;
+}
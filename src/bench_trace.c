@@ -0,0 +1,130 @@
+// Decoder benchmark on synthetic traces.
+// Runs frames of mixed sizes through decode() and decodeAdaptive() with
+// increasing jitter on the line, and reports throughput and how many
+// frames each accepts.
+// Fails if a clean line loses any frame, or if a damaged frame is ever
+// accepted with the wrong contents.
+//
+// Usage:
+// $ ./bench_trace [-n frames] [-j max jitter ns] [-s skew ns] [-g glitches per pulse] [-r rate error]
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "gateway.h"
+#include "manchester.h"
+#include "tracegen.h"
+
+#define MIN_FRAME 26 // Ethernet header, PUP header and CRC
+#define MAX_FRAME (MAX_PUP_LENGTH - 2) // Largest frame decode() accepts
+#define MAX_TRACE (16 * MAX_FRAME + 2)
+#define JITTER_STEP 5 // ns
+#define REPEATS 5 // Decode each trace this many times for the timing
+
+struct decoder {
+  const char *name;
+  int (*fn)(const uint8_t *, int, uint8_t *, int);
+};
+
+static struct decoder decoders[] = {
+  { "fixed", decode },
+  { "adaptive", decodeAdaptive },
+};
+#define DECODERS (sizeof(decoders) / sizeof(decoders[0]))
+
+static double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char **argv) {
+  int frames = 2000;
+  double maxJitter = 40;
+  struct traceParams params = { 0, 0, 0, 30, 0 };
+  int i;
+  for (i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+      frames = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+      maxJitter = atof(argv[++i]);
+    } else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) {
+      params.skewNs = atof(argv[++i]);
+    } else if (strcmp(argv[i], "-g") == 0 && i + 1 < argc) {
+      params.glitchRate = atof(argv[++i]);
+    } else if (strcmp(argv[i], "-r") == 0 && i + 1 < argc) {
+      params.rateError = atof(argv[++i]);
+    } else {
+      fprintf(stderr, "Usage: bench_trace [-n frames] [-j max jitter ns] [-s skew ns] [-g glitches per pulse] [-r rate error]\n");
+      return 1;
+    }
+  }
+
+  uint8_t (*frameBufs)[MAX_FRAME] = malloc(frames * sizeof(*frameBufs));
+  int *frameLens = malloc(frames * sizeof(int));
+  uint8_t (*traces)[MAX_TRACE] = malloc(frames * sizeof(*traces));
+  int *traceLens = malloc(frames * sizeof(int));
+  long totalBytes = 0;
+  traceSeed(1);
+  for (i = 0; i < frames; i++) {
+    frameLens[i] = traceFrame(frameBufs[i], MIN_FRAME + 2 * (rand() % ((MAX_FRAME - MIN_FRAME) / 2 + 1)));
+    totalBytes += frameLens[i];
+  }
+
+  printf("%d frames, average %ld bytes, skew %.0f ns, glitch rate %g, rate error %g\n",
+      frames, totalBytes / frames, params.skewNs, params.glitchRate, params.rateError);
+  printf("           ");
+  unsigned k;
+  for (k = 0; k < DECODERS; k++) {
+    printf("| %-32s", decoders[k].name);
+  }
+  printf("|\njitter ns  ");
+  for (k = 0; k < DECODERS; k++) {
+    printf("| accepted   packets/s    ns/byte ");
+  }
+  printf("|     gain\n");
+  int failed = 0;
+  for (params.jitterNs = 0; params.jitterNs <= maxJitter; params.jitterNs += JITTER_STEP) {
+    for (i = 0; i < frames; i++) {
+      traceLens[i] = traceGenerate(frameBufs[i], frameLens[i], &params, traces[i], MAX_TRACE);
+    }
+
+    printf("%9.0f  ", params.jitterNs);
+    double rate[DECODERS];
+    for (k = 0; k < DECODERS; k++) {
+      // Check the results once, then time the decoder alone
+      uint8_t bytes[MAX_PUP_LENGTH];
+      int accepted = 0, wrong = 0;
+      for (i = 0; i < frames; i++) {
+        int len = decoders[k].fn(traces[i], traceLens[i], bytes, MAX_PUP_LENGTH);
+        if (len > 0) {
+          accepted++;
+          if (len != frameLens[i] || memcmp(bytes, frameBufs[i], len) != 0) {
+            wrong++;
+          }
+        }
+      }
+      int r;
+      double start = now();
+      for (r = 0; r < REPEATS; r++) {
+        for (i = 0; i < frames; i++) {
+          decoders[k].fn(traces[i], traceLens[i], bytes, MAX_PUP_LENGTH);
+        }
+      }
+      double elapsed = (now() - start) / REPEATS;
+
+      rate[k] = accepted * 100.0 / frames;
+      printf("| %7.2f%%  %10.0f  %9.2f ", rate[k], frames / elapsed, elapsed * 1e9 / totalBytes);
+      if (wrong) {
+        printf("\n%s: %d frames accepted with the wrong contents\n", decoders[k].name, wrong);
+        failed = 1;
+      }
+      if (params.jitterNs == 0 && params.skewNs == 0 && params.glitchRate == 0 && params.rateError == 0 && accepted != frames) {
+        printf("\n%s: clean line lost %d frames\n", decoders[k].name, frames - accepted);
+        failed = 1;
+      }
+    }
+    printf("| %+7.2f%%\n", rate[DECODERS - 1] - rate[0]);
+  }
+  return failed;
+}
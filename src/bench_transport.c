@@ -0,0 +1,223 @@
+// Loopback benchmark of the two transports between the gateway and an IFS
+// on the same machine: UDP, as the gateway has always used, and the shared
+// memory rings of shmring.h.
+//
+// A child process plays IFS and echoes every frame back. The parent plays
+// the gateway and sends max length frames:
+// - one at a time, waiting for each echo, for the round trip latency;
+// - a window at a time, for the CPU each frame costs the two processes.
+// Both sides block when they have nothing to do, on the socket or on the
+// doorbell FIFO, as the gateway does.
+//
+// Usage:
+// $ ./bench_transport [round trips]
+#define _GNU_SOURCE
+#include <poll.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include "gateway.h"
+#include "shmring.h"
+
+#define FRAME_BYTES (MAX_PUP_LENGTH - 2) // Length word and frame, without the CRC
+#define STREAM_FRAMES 100000
+#define WINDOW 32 // Frames in flight when streaming
+
+// One transport, from one side
+struct transport {
+  const char *name;
+  void (*send)(const uint8_t *buf, int len);
+  int (*recv)(uint8_t *buf); // Blocks; returns the length
+  void (*child)(); // Set up the IFS side after fork()
+};
+
+static int udpSock[2]; // 0 for the gateway, 1 for IFS
+static struct sockaddr_in udpAddr[2];
+static int side; // 0 in the parent, 1 in the child
+static char shmPath[64];
+static struct shmringHandle shm;
+
+static uint64_t nowNs(clockid_t clock) {
+  struct timespec ts;
+  clock_gettime(clock, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void udpSend(const uint8_t *buf, int len) {
+  if (sendto(udpSock[side], buf, len, 0, (struct sockaddr *)&udpAddr[!side], sizeof(udpAddr[0])) < 0) {
+    perror("sendto");
+    exit(1);
+  }
+}
+
+static int udpRecv(uint8_t *buf) {
+  int n = recv(udpSock[side], buf, FRAME_BYTES, 0);
+  if (n < 0) {
+    perror("recv");
+    exit(1);
+  }
+  return n;
+}
+
+static void udpChild() {
+}
+
+static void shmSend(const uint8_t *buf, int len) {
+  volatile struct shmringSlot *slot;
+  while ((slot = shmringReserve(shm.out)) == NULL) {
+    sched_yield();
+  }
+  memcpy((uint8_t *)slot->data, buf, len);
+  slot->length = len;
+  if (shmringPublish(shm.out)) {
+    shmringRing(shm.bellOut);
+  }
+}
+
+static int shmRecv(uint8_t *buf) {
+  volatile struct shmringSlot *slot;
+  while ((slot = shmringPeek(shm.in)) == NULL) {
+    if (shmringSleep(shm.in)) {
+      struct pollfd pfd = { shm.bellIn, POLLIN, 0 };
+      poll(&pfd, 1, -1);
+      shmringDrain(shm.bellIn);
+    }
+  }
+  int len = slot->length;
+  memcpy(buf, (uint8_t *)slot->data, len);
+  shmringRelease(shm.in);
+  return len;
+}
+
+static void shmChild() {
+  if (shmringOpen(shmPath, 0, &shm) < 0) {
+    exit(1);
+  }
+}
+
+static struct transport transports[] = {
+  { "udp", udpSend, udpRecv, udpChild },
+  { "shm", shmSend, shmRecv, shmChild },
+};
+
+// IFS: echo frames until an empty one.
+static void echo(struct transport *t) {
+  uint8_t buf[FRAME_BYTES];
+  side = 1;
+  t->child();
+  while (1) {
+    int len = t->recv(buf);
+    if (len == 0) {
+      exit(0);
+    }
+    t->send(buf, len);
+  }
+}
+
+static int compare(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+  return x < y ? -1 : x > y;
+}
+
+static void run(struct transport *t, int roundTrips) {
+  static uint8_t frame[FRAME_BYTES], buf[FRAME_BYTES];
+  uint64_t *rtt = malloc(roundTrips * sizeof(*rtt));
+  int i;
+  frame[0] = ((FRAME_BYTES - 2) / 2) >> 8;
+  frame[1] = ((FRAME_BYTES - 2) / 2) & 0xff;
+  for (i = 2; i < FRAME_BYTES; i++) {
+    frame[i] = i;
+  }
+
+  fflush(stdout);
+  pid_t pid = fork();
+  if (pid == 0) {
+    echo(t);
+  }
+  side = 0;
+
+  for (i = 0; i < roundTrips; i++) {
+    uint64_t start = nowNs(CLOCK_MONOTONIC);
+    t->send(frame, FRAME_BYTES);
+    t->recv(buf);
+    rtt[i] = nowNs(CLOCK_MONOTONIC) - start;
+  }
+  qsort(rtt, roundTrips, sizeof(*rtt), compare);
+
+  uint64_t cpuStart = nowNs(CLOCK_PROCESS_CPUTIME_ID);
+  uint64_t wallStart = nowNs(CLOCK_MONOTONIC);
+  int sent = 0, received = 0;
+  while (received < STREAM_FRAMES) {
+    while (sent < STREAM_FRAMES && sent - received < WINDOW) {
+      t->send(frame, FRAME_BYTES);
+      sent++;
+    }
+    t->recv(buf);
+    received++;
+  }
+  double wall = (nowNs(CLOCK_MONOTONIC) - wallStart) / 1e9;
+  double cpu = (nowNs(CLOCK_PROCESS_CPUTIME_ID) - cpuStart) / 1e3;
+  t->send(frame, 0);
+  int status;
+  struct rusage usage;
+  wait4(pid, &status, 0, &usage);
+  // The child's CPU includes the round trips, so take its share of them
+  // off in proportion to frames.
+  double childCpu = usage.ru_utime.tv_sec * 1e6 + usage.ru_utime.tv_usec +
+    usage.ru_stime.tv_sec * 1e6 + usage.ru_stime.tv_usec;
+  childCpu *= (double)STREAM_FRAMES / (STREAM_FRAMES + roundTrips);
+
+  printf("%-9s | %6.1f %6.1f %7.1f | %7.2f %6.2f %6.2f %9.0f\n", t->name,
+      rtt[roundTrips / 2] / 1e3, rtt[roundTrips * 99 / 100] / 1e3, rtt[roundTrips - 1] / 1e3,
+      cpu / STREAM_FRAMES, childCpu / STREAM_FRAMES, (cpu + childCpu) / STREAM_FRAMES,
+      STREAM_FRAMES / wall);
+  free(rtt);
+}
+
+int main(int argc, char **argv) {
+  int roundTrips = argc > 1 ? atoi(argv[1]) : 20000;
+  int i;
+  if (roundTrips < 1) {
+    fprintf(stderr, "Bad round trip count\n");
+    return 1;
+  }
+
+  for (i = 0; i < 2; i++) {
+    socklen_t len = sizeof(udpAddr[i]);
+    udpSock[i] = socket(AF_INET, SOCK_DGRAM, 0);
+    udpAddr[i].sin_family = AF_INET;
+    udpAddr[i].sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (bind(udpSock[i], (struct sockaddr *)&udpAddr[i], sizeof(udpAddr[i])) < 0 ||
+        getsockname(udpSock[i], (struct sockaddr *)&udpAddr[i], &len) < 0) {
+      perror("udp");
+      return 1;
+    }
+  }
+  snprintf(shmPath, sizeof(shmPath), "/dev/shm/alto-bench.%d", getpid());
+  if (shmringOpen(shmPath, 1, &shm) < 0) {
+    return 1;
+  }
+
+  printf("%d byte frames, %d round trips, %d streamed %d at a time\n", FRAME_BYTES, roundTrips, STREAM_FRAMES, WINDOW);
+  printf("          | round trip us         | streaming: CPU us/frame\n");
+  printf("transport |    p50    p99     max | gateway    ifs  total  frames/s\n");
+  for (i = 0; i < 2; i++) {
+    run(&transports[i], roundTrips);
+  }
+
+  char name[80];
+  unlink(shmPath);
+  snprintf(name, sizeof(name), "%s.to-ifs", shmPath);
+  unlink(name);
+  snprintf(name, sizeof(name), "%s.to-gateway", shmPath);
+  unlink(name);
+  return 0;
+}
@@ -0,0 +1,9 @@
+-b
+-image
+
+ROMS {
+                PAGE 0:
+                text: o = 0x0, l = 0x2000, files={receivetext.bin}
+                PAGE 1:
+                data: o = 0x0, l = 0x2000, files={receivedata.bin}
+}
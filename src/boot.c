@@ -0,0 +1,333 @@
+// Boot server fast path; see boot.h.
+#include <fcntl.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "boot.h"
+#include "crc.h"
+
+// Skip the byte order mark IFS's configuration files start with.
+static char *skipBom(char *line) {
+  return strncmp(line, "\xef\xbb\xbf", 3) == 0 ? line + 3 : line;
+}
+
+// Free a bootDir that bootOpen() couldn't finish, before any file is loaded.
+static struct bootDir *freeDir(struct bootDir *dir) {
+  int i;
+  for (i = 0; i < dir->count; i++) {
+    free(dir->files[i].name);
+  }
+  free(dir->files);
+  free(dir->root);
+  free(dir);
+  return NULL;
+}
+
+// Read IFS's configuration and boot directory under ifsDir. Returns NULL if
+// they can't be read. The files themselves are only read when asked for.
+struct bootDir *bootOpen(const char *ifsDir) {
+  char path[PATH_MAX], line[PATH_MAX], key[64], value[PATH_MAX];
+  struct bootDir *dir = calloc(1, sizeof(*dir));
+  int number;
+  FILE *f;
+  snprintf(path, sizeof(path), "%s/Conf/ifs.cfg", ifsDir);
+  if (dir == NULL) {
+    perror("bootOpen");
+    return NULL;
+  }
+  if ((f = fopen(path, "r")) == NULL) {
+    perror(path);
+    return freeDir(dir);
+  }
+  while (fgets(line, sizeof(line), f)) {
+    if (sscanf(skipBom(line), " %63[A-Za-z] = %s", key, value) != 2) {
+      continue;
+    }
+    if (strcmp(key, "BootRoot") == 0) {
+      free(dir->root);
+      dir->root = strdup(value);
+    } else if (strcmp(key, "ServerNetwork") == 0) {
+      dir->net = atoi(value);
+    } else if (strcmp(key, "ServerHost") == 0) {
+      dir->host = atoi(value);
+    }
+  }
+  fclose(f);
+  if (dir->root == NULL) {
+    snprintf(path, sizeof(path), "%s/boot", ifsDir);
+    dir->root = strdup(path);
+  }
+  if (dir->host <= 0 || dir->host > 0377) {
+    fprintf(stderr, "No ServerHost in %s/Conf/ifs.cfg\n", ifsDir);
+    return freeDir(dir);
+  }
+
+  // Lines of an octal number and a file name; the rest are comments
+  snprintf(path, sizeof(path), "%s/Conf/bootdirectory.txt", ifsDir);
+  if ((f = fopen(path, "r")) == NULL) {
+    perror(path);
+    return freeDir(dir);
+  }
+  while (fgets(line, sizeof(line), f)) {
+    if (sscanf(skipBom(line), "%o %s", &number, value) != 2) {
+      continue;
+    }
+    dir->files = realloc(dir->files, (dir->count + 1) * sizeof(dir->files[0]));
+    memset(&dir->files[dir->count], 0, sizeof(dir->files[0]));
+    dir->files[dir->count].number = number;
+    dir->files[dir->count].name = strdup(value);
+    dir->count++;
+  }
+  fclose(f);
+  return dir;
+}
+
+// Build one frame of a file: an EFTP Data PUP of n bytes, or the End if n
+// is 0, numbered id. The jump table only depends on the length, so it is
+// copied from the frame before, prev, if that is the same length.
+static void buildFrame(struct bootDir *dir, struct bootFrame *f, const struct bootFrame *prev, int type, int id,
+    const uint8_t *data, int n) {
+  static const uint8_t zeros[EFTP_DATA_BYTES + 2];
+  uint8_t *frame = f->data;
+  uint8_t *pup = frame + 4;
+  int pupLength = PUP_HEADER_BYTES + n + 2;
+  int dataAt = 4 + PUP_HEADER_BYTES;
+  int i;
+  memset(frame, 0, sizeof(f->data));
+  frame[1] = dir->host;
+  pupSetWord(frame + 2, PUP_ETHER_TYPE);
+  pupSetWord(pup + PUP_LENGTH, pupLength);
+  pup[PUP_TYPE] = type;
+  pupSetLong(pup + PUP_ID, id);
+  pup[PUP_SOURCE] = dir->net;
+  pup[PUP_SOURCE + 1] = dir->host;
+  memcpy(frame + dataAt, data, n);
+  f->length = pupFinishFrame(frame);
+  f->checksumAt = 4 + 2 * ((pupLength - 1) / 2);
+  f->dataSum = pupChecksum(frame + dataAt, pupLength - PUP_HEADER_BYTES);
+  f->dataCrc = crcUpdate(0, frame + dataAt, f->checksumAt - dataAt);
+  if (prev && prev->checksumAt == f->checksumAt) {
+    memcpy(f->jump, prev->jump, sizeof(f->jump));
+    return;
+  }
+  for (i = 0; i < 16; i++) {
+    f->jump[i] = crcUpdate(1 << i, zeros, f->checksumAt - dataAt);
+  }
+}
+
+// Build the frames of a file into its cache, which is read-only once done.
+static void loadFile(struct bootDir *dir, struct bootFile *file) {
+  char path[PATH_MAX];
+  struct stat st;
+  int fd, i;
+  snprintf(path, sizeof(path), "%s/%s", dir->root, file->name);
+  file->count = -1;
+  if ((fd = open(path, O_RDONLY)) < 0 || fstat(fd, &st) < 0 || st.st_size == 0) {
+    perror(path);
+    if (fd >= 0) {
+      close(fd);
+    }
+    return;
+  }
+  int count = (st.st_size + EFTP_DATA_BYTES - 1) / EFTP_DATA_BYTES + 1;
+  size_t cacheBytes = count * sizeof(struct bootFrame);
+  const uint8_t *bytes = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  struct bootFrame *frames = mmap(NULL, cacheBytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  close(fd);
+  if (bytes == MAP_FAILED || frames == MAP_FAILED) {
+    perror("mmap");
+    return;
+  }
+  for (i = 0; i < count - 1; i++) {
+    long n = st.st_size - (long)i * EFTP_DATA_BYTES;
+    buildFrame(dir, &frames[i], i ? &frames[i - 1] : NULL, PUP_EFTP_DATA, i, bytes + i * EFTP_DATA_BYTES,
+        n < EFTP_DATA_BYTES ? n : EFTP_DATA_BYTES);
+  }
+  buildFrame(dir, &frames[i], NULL, PUP_EFTP_END, i, NULL, 0);
+  munmap((void *)bytes, st.st_size);
+  mprotect(frames, cacheBytes, PROT_READ);
+  file->frames = frames;
+  file->count = count;
+  file->bytes = st.st_size;
+}
+
+// The boot file with the given number, loaded into the cache if need be,
+// or NULL if there is none or it can't be read
+struct bootFile *bootLoad(struct bootDir *dir, int number) {
+  int i;
+  for (i = 0; i < dir->count; i++) {
+    struct bootFile *file = &dir->files[i];
+    if (file->number == number) {
+      if (file->count == 0) {
+        loadFile(dir, file);
+      }
+      return file->count > 0 ? file : NULL;
+    }
+  }
+  return NULL;
+}
+
+void bootServerInit(struct bootServer *s, struct bootDir *dir, uint32_t socket,
+    int (*send)(const uint8_t *, int, uint64_t)) {
+  memset(s, 0, sizeof(*s));
+  s->dir = dir;
+  s->socket = socket;
+  s->send = send;
+}
+
+// Send session n's current frame: the cached one with the Alto's port and
+// the session's socket filled in. The checksum is the header's words,
+// cycled on past the data's, plus the data's. The CRC is the header's,
+// carried through the data by the jump table, plus the data's, then on
+// through the checksum.
+static void sendFrame(struct bootServer *s, int n, uint64_t now) {
+  struct bootSession *b = &s->sessions[n];
+  const struct bootFrame *f = &b->file->frames[b->seq];
+  int dataAt = 4 + PUP_HEADER_BYTES;
+  uint8_t frame[sizeof(f->data)];
+  uint8_t *pup = frame + 4;
+  int i;
+  memcpy(frame, f->data, f->length);
+  frame[0] = b->client[1];
+  memcpy(pup + PUP_DEST, b->client, 6);
+  pupSetLong(pup + PUP_SOURCE + 2, s->socket + n);
+
+  int shift = (f->checksumAt - dataAt) / 2 % 16;
+  uint32_t sum = pupChecksum(pup, PUP_HEADER_BYTES + 2);
+  sum = ((sum << shift) | (sum >> (16 - shift))) & 0xffff;
+  sum += f->dataSum;
+  sum = (sum + (sum >> 16)) & 0xffff;
+  pupSetWord(frame + f->checksumAt, sum == 0xffff ? 0 : sum);
+
+  uint16_t header = crcUpdate(CRC_SEED, frame, dataAt);
+  uint16_t crcVal = f->dataCrc;
+  for (i = 0; i < 16; i++) {
+    if (header & (1 << i)) {
+      crcVal ^= f->jump[i];
+    }
+  }
+  pupSetWord(frame + f->checksumAt + 2, crcUpdate(crcVal, frame + f->checksumAt, 2));
+
+  if (!s->send(frame, f->length, now)) {
+    b->sentNs = 0;
+    return;
+  }
+  b->sentNs = now;
+  if (++b->tries > 1) {
+    s->resent++;
+  }
+}
+
+// The session for a request from the port client: the one it already has,
+// if it is asking again, or a free one. Returns -1 if they are all busy.
+static int findSession(struct bootServer *s, const uint8_t *client) {
+  int i, idle = -1;
+  for (i = 0; i < BOOT_SESSIONS; i++) {
+    if (s->sessions[i].file == NULL) {
+      if (idle < 0) {
+        idle = i;
+      }
+    } else if (memcmp(s->sessions[i].client, client, 6) == 0) {
+      return i;
+    }
+  }
+  return idle;
+}
+
+// Handle a frame from the wire, len bytes not counting the CRC. Returns
+// nonzero if it was a boot file request this server takes, or part of one
+// of its transfers; anything else is left for IFS.
+int bootReceive(struct bootServer *s, const uint8_t *frame, int len, uint64_t now) {
+  const uint8_t *pup = frame + 4;
+  struct bootSession *b;
+  struct bootFile *file;
+  uint32_t n;
+  if (s->dir == NULL || len < 4 + PUP_HEADER_BYTES + 2 || pupWord(frame + 2) != PUP_ETHER_TYPE) {
+    return 0;
+  }
+  switch (pup[PUP_TYPE]) {
+  case PUP_BOOT_FILE_REQUEST:
+    if ((frame[0] != 0 && frame[0] != s->dir->host) || pupLong(pup + PUP_DEST + 2) != PUP_MISC_SOCKET ||
+        pupFind(frame, len, PUP_BOOT_FILE_REQUEST) == NULL) {
+      return 0;
+    }
+    file = bootLoad(s->dir, pupWord(pup + PUP_ID + 2));
+    if (file == NULL || (n = findSession(s, pup + PUP_SOURCE)) == (uint32_t)-1) {
+      return 0;
+    }
+    b = &s->sessions[n];
+    b->file = file;
+    memcpy(b->client, pup + PUP_SOURCE, 6);
+    b->seq = 0;
+    b->tries = 0;
+    b->startNs = now;
+    sendFrame(s, n, now);
+    return 1;
+
+  case PUP_EFTP_ACK:
+  case PUP_EFTP_ABORT:
+    n = pupLong(pup + PUP_DEST + 2) - s->socket;
+    if (frame[0] != s->dir->host || n >= BOOT_SESSIONS) {
+      return 0;
+    }
+    b = &s->sessions[n];
+    if (b->file == NULL || memcmp(pup + PUP_SOURCE, b->client, 6) != 0 || pupFind(frame, len, pup[PUP_TYPE]) == NULL) {
+      return 1; // For a finished transfer, or damaged
+    }
+    if (pup[PUP_TYPE] == PUP_EFTP_ABORT) {
+      s->failed++;
+      b->file = NULL;
+      return 1;
+    }
+    if (pupLong(pup + PUP_ID) != (uint32_t)b->seq) {
+      return 1; // A duplicate
+    }
+    if (++b->seq == b->file->count) {
+      // The End is acknowledged
+      s->served++;
+      s->bootNs += now - b->startNs;
+      if (now - b->startNs > s->maxBootNs) {
+        s->maxBootNs = now - b->startNs;
+      }
+      b->file = NULL;
+      return 1;
+    }
+    b->tries = 0;
+    sendFrame(s, n, now);
+    return 1;
+  }
+  return 0;
+}
+
+// Send again the frames not acknowledged within BOOT_RETRY_NS, and those
+// that couldn't be queued, giving up on an Alto after BOOT_TRIES.
+void bootTick(struct bootServer *s, uint64_t now) {
+  int i;
+  for (i = 0; i < BOOT_SESSIONS; i++) {
+    struct bootSession *b = &s->sessions[i];
+    if (b->file == NULL || (b->sentNs != 0 && now - b->sentNs < BOOT_RETRY_NS)) {
+      continue;
+    }
+    if (b->tries >= BOOT_TRIES) {
+      s->failed++;
+      b->file = NULL;
+      continue;
+    }
+    sendFrame(s, i, now);
+  }
+}
+
+void bootReport(struct bootServer *s, FILE *f) {
+  if (s->dir == NULL || s->served + s->failed == 0) {
+    return;
+  }
+  fprintf(f, "Boot server: %ld files sent, %ld given up on, %ld frames sent again", s->served, s->failed, s->resent);
+  if (s->served > 0) {
+    fprintf(f, "; %.1f ms from request to End on average, %.1f ms at most", s->bootNs / 1e6 / s->served,
+        s->maxBootNs / 1e6);
+  }
+  fprintf(f, "\n");
+}
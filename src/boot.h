@@ -0,0 +1,103 @@
+/*
+ * boot.h
+ *
+ * Boot server fast path. An Alto boots from the network by broadcasting a
+ * BootFileRequest PUP to the miscellaneous services socket, with the boot
+ * file's number in the low word of the PUP ID. The server sends the file
+ * back to the requesting port by EFTP: Data PUPs of up to EFTP_DATA_BYTES,
+ * numbered from 0 in the PUP ID, each acknowledged before the next is
+ * sent, then an End once the last is acknowledged.
+ *
+ * The gateway can serve the files in IFS's boot directory itself instead of
+ * passing the requests over UDP to IFS. It reads IFS's configuration for
+ * the directory and the server's address, so an Alto sees the same server
+ * either way. The first time a file is asked for, its frames are built in
+ * an mmap'd cache, complete with the PUP checksum and the CRC, for a client
+ * port of all zeros. Sending one copies it, sets the addresses and adjusts
+ * the two sums for them, without going over the data again: the checksum
+ * is a sum, and the CRC register is linear, so each only needs the part
+ * for the data kept with the frame. Requests for a file IFS's directory
+ * lists but can't be read, and everything else, still go to IFS.
+ *
+ * A bootServer is the sending side; the simulated IFS has one of its own.
+ */
+
+#ifndef BOOT_H_
+#define BOOT_H_
+#include <stdint.h>
+#include <stdio.h>
+#include "gateway.h"
+#include "pup.h"
+
+#define PUP_MISC_SOCKET 4
+#define PUP_BOOT_FILE_REQUEST 0244
+#define PUP_EFTP_DATA 030
+#define PUP_EFTP_ACK 031
+#define PUP_EFTP_END 032
+#define PUP_EFTP_ABORT 033
+
+#define EFTP_DATA_BYTES 512
+#define BOOT_SESSIONS 16 // Altos booting at once; more go to IFS
+#define BOOT_RETRY_NS 250000000 // Unacknowledged frames are sent again after this
+#define BOOT_TRIES 10 // Sends of a frame before giving up on the Alto
+#define BOOT_SOCKET 0x80000000 // The gateway's session n sends from this plus n, well clear of IFS's
+
+// A frame of a boot file, as built for the client port 0#0#0 from socket
+// 0. The checksum and CRC are what they would be with the PUP header all
+// zeros up to the data, so the header's part is all that is added when it
+// is sent.
+struct bootFrame {
+  uint16_t length; // Bytes, with the CRC
+  uint16_t checksumAt; // Offset of the PUP checksum in data
+  uint16_t dataSum; // PUP checksum of the words from the data on
+  uint16_t dataCrc; // CRC of the bytes from the data up to the checksum, from 0
+  uint16_t jump[16]; // CRC register from 1 << bit, after the same bytes
+  uint8_t data[4 + PUP_HEADER_BYTES + EFTP_DATA_BYTES + 2 + 2];
+};
+
+struct bootFile {
+  int number;
+  char *name;
+  struct bootFrame *frames; // Data frames then the End, NULL until loaded
+  int count; // Frames, or -1 if the file can't be loaded
+  long bytes;
+};
+
+// IFS's boot directory and address, from its Conf/ifs.cfg and
+// Conf/bootdirectory.txt
+struct bootDir {
+  char *root; // BootRoot
+  int net, host; // ServerNetwork and ServerHost
+  int count;
+  struct bootFile *files;
+};
+
+struct bootSession {
+  struct bootFile *file; // NULL if the session is free
+  uint8_t client[6]; // The Alto's port: net, host and socket
+  int seq; // Frame being sent
+  int tries; // Times it has been sent
+  uint64_t sentNs; // When it was last sent, 0 to send it now
+  uint64_t startNs; // When the request came
+};
+
+struct bootServer {
+  struct bootDir *dir;
+  uint32_t socket; // Session n sends from this plus n
+  // Queue a frame of len bytes, with its CRC, for the wire. Returns 0 if
+  // it can't be taken now, and it is sent again later.
+  int (*send)(const uint8_t *frame, int len, uint64_t now);
+  struct bootSession sessions[BOOT_SESSIONS];
+  long served, failed, resent; // Files sent in full, given up on, and frames sent again
+  uint64_t bootNs, maxBootNs; // Total and longest time from request to End
+};
+
+struct bootDir *bootOpen(const char *ifsDir);
+struct bootFile *bootLoad(struct bootDir *dir, int number);
+void bootServerInit(struct bootServer *s, struct bootDir *dir, uint32_t socket,
+    int (*send)(const uint8_t *, int, uint64_t));
+int bootReceive(struct bootServer *s, const uint8_t *frame, int len, uint64_t now);
+void bootTick(struct bootServer *s, uint64_t now);
+void bootReport(struct bootServer *s, FILE *f);
+
+#endif /* BOOT_H_ */
@@ -0,0 +1,234 @@
+// Binary capture of the frames passing through the gateway.
+// The main loop copies each record into a buffer, and a background
+// thread writes the buffer to the file, so the main loop never waits on
+// the disk. If the buffer fills up, records are dropped and counted.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/stat.h>
+#include "capture.h"
+
+#define CAPTURE_BUF_SIZE (4 << 20)
+#define CAPTURE_FLUSH (64 << 10) // Wake the writer when this much is waiting
+#define CAPTURE_FLUSH_S 1 // Or after this long
+
+#define PCAP_MAGIC_NS 0xa1b23c4d
+
+struct pcapHeader {
+  uint32_t magic;
+  uint16_t versionMajor;
+  uint16_t versionMinor;
+  int32_t thiszone;
+  uint32_t sigfigs;
+  uint32_t snaplen;
+  uint32_t network;
+};
+
+struct pcapRecord {
+  uint32_t tsSec;
+  uint32_t tsNsec;
+  uint32_t inclLen;
+  uint32_t origLen;
+};
+
+uint64_t captureDropped;
+
+static int fd = -1;
+static uint8_t *buf;
+static uint64_t head, tail; // Bytes ever added to and written from buf
+static int closing;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+static pthread_t thread;
+
+static void writeAll(const uint8_t *data, size_t len) {
+  while (len > 0) {
+    ssize_t n = write(fd, data, len);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      perror("capture write");
+      return;
+    }
+    data += n;
+    len -= n;
+  }
+}
+
+static void *writerThread(void *arg) {
+  pthread_mutex_lock(&lock);
+  while (1) {
+    while (!closing && head - tail < CAPTURE_FLUSH) {
+      struct timespec until;
+      clock_gettime(CLOCK_REALTIME, &until);
+      until.tv_sec += CAPTURE_FLUSH_S;
+      if (pthread_cond_timedwait(&cond, &lock, &until) == ETIMEDOUT) {
+        break;
+      }
+    }
+    uint64_t end = head;
+    int done = closing;
+    pthread_mutex_unlock(&lock);
+
+    // Only the main loop adds to buf, and only past head, so this part
+    // can be written without the lock.
+    while (tail != end) {
+      size_t offset = tail % CAPTURE_BUF_SIZE;
+      size_t len = end - tail;
+      if (len > CAPTURE_BUF_SIZE - offset) {
+        len = CAPTURE_BUF_SIZE - offset;
+      }
+      writeAll(buf + offset, len);
+      pthread_mutex_lock(&lock);
+      tail += len;
+      pthread_mutex_unlock(&lock);
+    }
+    if (done) {
+      return NULL;
+    }
+    pthread_mutex_lock(&lock);
+  }
+}
+
+// Start capturing to path. Returns -1 for error.
+int captureOpen(const char *path) {
+  fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    perror(path);
+    return -1;
+  }
+  struct pcapHeader header = { PCAP_MAGIC_NS, 2, 4, 0, 0, 65535, CAPTURE_LINKTYPE };
+  writeAll((uint8_t *)&header, sizeof(header));
+  buf = malloc(CAPTURE_BUF_SIZE);
+  if (buf == NULL || pthread_create(&thread, NULL, writerThread, NULL) != 0) {
+    fprintf(stderr, "Can't start capture writer\n");
+    return -1;
+  }
+  return 0;
+}
+
+// Copy len bytes to buf at head. The caller has checked there is room.
+static void put(const void *data, size_t len) {
+  while (len > 0) {
+    size_t offset = head % CAPTURE_BUF_SIZE;
+    size_t n = len;
+    if (n > CAPTURE_BUF_SIZE - offset) {
+      n = CAPTURE_BUF_SIZE - offset;
+    }
+    memcpy(buf + offset, data, n);
+    head += n;
+    data = (const uint8_t *)data + n;
+    len -= n;
+  }
+}
+
+// Add one record. The durations are given in two parts, since they may
+// wrap around the end of the PRU's receive buffer.
+void captureRecord(int direction, int flags, int status, uint32_t pruTimestamp,
+    const uint8_t *d1, int len1, const uint8_t *d2, int len2,
+    const uint8_t *bytes, int bytesLen) {
+  if (fd < 0) {
+    return;
+  }
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  struct captureHeader header = { direction, flags, status, pruTimestamp, len1 + len2, bytesLen };
+  uint32_t len = sizeof(header) + len1 + len2 + bytesLen;
+  struct pcapRecord record = { ts.tv_sec, ts.tv_nsec, len, len };
+
+  pthread_mutex_lock(&lock);
+  if (CAPTURE_BUF_SIZE - (head - tail) < sizeof(record) + len) {
+    captureDropped++;
+    pthread_mutex_unlock(&lock);
+    return;
+  }
+  put(&record, sizeof(record));
+  put(&header, sizeof(header));
+  put(d1, len1);
+  put(d2, len2);
+  put(bytes, bytesLen);
+  if (head - tail >= CAPTURE_FLUSH) {
+    pthread_cond_signal(&cond);
+  }
+  pthread_mutex_unlock(&lock);
+}
+
+// Write out everything buffered and close the file.
+void captureClose() {
+  if (fd < 0) {
+    return;
+  }
+  pthread_mutex_lock(&lock);
+  closing = 1;
+  pthread_cond_signal(&cond);
+  pthread_mutex_unlock(&lock);
+  pthread_join(thread, NULL);
+  close(fd);
+  fd = -1;
+  if (captureDropped) {
+    fprintf(stderr, "Capture dropped %llu records\n", (unsigned long long)captureDropped);
+  }
+}
+
+// Read a whole capture into memory. Sets *records to an array of the
+// records, which point into the file data. Returns the number of records,
+// or -1 for error.
+int captureLoad(const char *path, struct captureRecord **records) {
+  FILE *f = fopen(path, "rb");
+  if (f == NULL) {
+    perror(path);
+    return -1;
+  }
+  struct stat st;
+  if (fstat(fileno(f), &st) < 0) {
+    perror(path);
+    fclose(f);
+    return -1;
+  }
+  uint8_t *data = malloc(st.st_size);
+  if (data == NULL || fread(data, 1, st.st_size, f) != (size_t)st.st_size) {
+    fprintf(stderr, "Can't read %s\n", path);
+    fclose(f);
+    return -1;
+  }
+  fclose(f);
+
+  struct pcapHeader *header = (struct pcapHeader *)data;
+  if (st.st_size < sizeof(*header) || header->magic != PCAP_MAGIC_NS || header->network != CAPTURE_LINKTYPE) {
+    fprintf(stderr, "%s is not a gateway capture\n", path);
+    return -1;
+  }
+
+  int count = 0, allocated = 1024;
+  *records = malloc(allocated * sizeof(**records));
+  size_t pos = sizeof(*header);
+  while (pos + sizeof(struct pcapRecord) <= st.st_size) {
+    struct pcapRecord *record = (struct pcapRecord *)(data + pos);
+    pos += sizeof(*record);
+    if (pos + record->inclLen > st.st_size || record->inclLen < sizeof(struct captureHeader)) {
+      fprintf(stderr, "%s: truncated after %d records\n", path, count);
+      break;
+    }
+    struct captureRecord *r = &(*records)[count];
+    memcpy(&r->header, data + pos, sizeof(r->header));
+    if (sizeof(r->header) + r->header.durationsLen + r->header.bytesLen > record->inclLen) {
+      fprintf(stderr, "%s: bad record %d\n", path, count);
+      break;
+    }
+    r->timeNs = record->tsSec * 1000000000ULL + record->tsNsec;
+    r->durations = data + pos + sizeof(r->header);
+    r->bytes = r->durations + r->header.durationsLen;
+    pos += record->inclLen;
+    if (++count == allocated) {
+      allocated *= 2;
+      *records = realloc(*records, allocated * sizeof(**records));
+    }
+  }
+  return count;
+}
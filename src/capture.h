@@ -0,0 +1,50 @@
+/*
+ * capture.h
+ *
+ * Binary capture of the frames passing through the gateway, for replaying
+ * field failures and benchmarking on real traffic.
+ *
+ * The file is pcap with nanosecond timestamps and link type
+ * LINKTYPE_USER0, so standard tools can split and merge it. Each packet
+ * is a struct captureHeader, then the raw PRU durations, then the frame
+ * bytes. All fields are little-endian.
+ */
+
+#ifndef CAPTURE_H_
+#define CAPTURE_H_
+#include <stdint.h>
+
+#define CAPTURE_LINKTYPE 147 // LINKTYPE_USER0
+
+#define CAPTURE_FROM_ALTO 0 // Received by the PRU
+#define CAPTURE_TO_ALTO 1 // Received over UDP, to be sent by the PRU
+
+#define CAPTURE_BAD_FRAME 1 // Flag: durations did not decode
+
+struct captureHeader {
+  uint8_t direction;
+  uint8_t flags;
+  uint16_t status; // PRU status, 0 if not known yet
+  uint32_t pruTimestamp; // IEP timer at the sync edge, from the rx descriptor
+  uint16_t durationsLen;
+  uint16_t bytesLen;
+};
+
+// A record read back from a capture
+struct captureRecord {
+  uint64_t timeNs; // CLOCK_REALTIME when it was captured
+  struct captureHeader header;
+  const uint8_t *durations;
+  const uint8_t *bytes;
+};
+
+int captureOpen(const char *path);
+void captureRecord(int direction, int flags, int status, uint32_t pruTimestamp,
+    const uint8_t *d1, int len1, const uint8_t *d2, int len2,
+    const uint8_t *bytes, int bytesLen);
+void captureClose();
+extern uint64_t captureDropped; // Records lost because the writer fell behind
+
+int captureLoad(const char *path, struct captureRecord **records);
+
+#endif /* CAPTURE_H_ */
@@ -0,0 +1,23 @@
+/*
+ * crc.h
+ *
+ * CRC-16 used by the Alto Ethernet.
+ */
+
+#ifndef CRC_H_
+#define CRC_H_
+#include <stdint.h>
+
+#define CRC_SEED 0x8005 // Due to the sync bit
+
+extern const uint16_t crcTable[256];
+
+// Add one byte to a running CRC
+static inline uint16_t crcByte(uint16_t crc, uint8_t byte) {
+  return (crc << 8) ^ crcTable[(crc >> 8) ^ byte];
+}
+
+uint16_t crcUpdate(uint16_t crc, const uint8_t *buf, int nbytes);
+uint16_t crc(uint8_t *buf, int len);
+
+#endif /* CRC_H_ */
@@ -0,0 +1,173 @@
+// PUP echo responder and load generator; see echo.h.
+#include <string.h>
+#include "echo.h"
+#include "latency.h"
+#include "manchester.h"
+#include "pup.h"
+#include "txqueue.h"
+
+int echoHost = 0;
+int echoDest = 0;
+int echoRate = 0;
+int echoDataBytes = PUP_MAX_DATA;
+int echoCount = 0;
+
+// Requests in flight, by PUP ID modulo ECHO_WINDOW. IDs from oldestId to
+// nextId - 1 are in the window, answered or not.
+static struct {
+  uint64_t sentNs;
+  int pending; // Not answered yet
+} window[ECHO_WINDOW];
+static uint32_t nextId, oldestId;
+static uint64_t startNs; // First request
+static uint64_t wireNs; // Time the requests and replies took on the wire
+static long sent, received, lost, late, bad, answered;
+
+// Time a frame of len bytes, with its CRC, takes on the wire
+static uint64_t frameWireNs(int len) {
+  return (2 + 16 * len + 1) * HALF_BIT_NS;
+}
+
+// Build the reply to an EchoMe in a frame of len bytes, not counting the
+// CRC: the same PUP back to the sender as ImAnEcho, from the host it was
+// sent to. Returns the reply's length with the CRC, or -1 if the frame
+// isn't an EchoMe.
+int echoAnswer(const uint8_t *request, int len, uint8_t *reply) {
+  const uint8_t *pup = pupFind(request, len, PUP_ECHO_ME);
+  if (pup == NULL) {
+    return -1;
+  }
+  int pupLength = pupWord(pup + PUP_LENGTH);
+  reply[0] = request[1];
+  reply[1] = request[0];
+  memcpy(reply + 2, request + 2, 2 + 2 * ((pupLength + 1) / 2));
+  uint8_t *out = reply + 4;
+  out[PUP_TRANSPORT] = 0;
+  out[PUP_TYPE] = PUP_IM_AN_ECHO;
+  memcpy(out + PUP_DEST, pup + PUP_SOURCE, 6); // Destination port is the source's
+  memcpy(out + PUP_SOURCE, pup + PUP_DEST, 6);
+  return pupFinishFrame(reply);
+}
+
+// Handle a frame from the wire addressed to echoHost, len bytes not
+// counting the CRC: answer an EchoMe, or match an ImAnEcho to its request.
+// Anything else is ignored.
+void echoReceive(const uint8_t *frame, int len, uint64_t now) {
+  uint8_t reply[MAX_PUP_LENGTH];
+  int replyLen = echoAnswer(frame, len, reply);
+  if (replyLen > 0) {
+    if (txQueueAdd(reply, replyLen, now)) {
+      answered++;
+    }
+    return;
+  }
+  const uint8_t *pup = pupFind(frame, len, PUP_IM_AN_ECHO);
+  if (pup == NULL || echoDest == 0) {
+    return;
+  }
+  uint32_t id = pupLong(pup + PUP_ID);
+  int dataBytes = pupWord(pup + PUP_LENGTH) - PUP_HEADER_BYTES - 2;
+  int i;
+  if (id - oldestId >= nextId - oldestId || !window[id % ECHO_WINDOW].pending) {
+    late++; // Already counted as lost, or a duplicate
+    return;
+  }
+  for (i = 0; i < dataBytes; i++) {
+    if (pup[PUP_HEADER_BYTES + i] != ((id + i) & 0xff)) {
+      break;
+    }
+  }
+  window[id % ECHO_WINDOW].pending = 0;
+  if (dataBytes != echoDataBytes || i < dataBytes) {
+    bad++;
+    return;
+  }
+  received++;
+  wireNs += frameWireNs(len + 2);
+  latencyRecord(&latEchoRtt, window[id % ECHO_WINDOW].sentNs, now);
+}
+
+// Give up on requests that have waited ECHO_TIMEOUT_NS, and move the
+// window past answered ones.
+static void expire(uint64_t now) {
+  while (oldestId != nextId) {
+    int slot = oldestId % ECHO_WINDOW;
+    if (window[slot].pending) {
+      if (now - window[slot].sentNs < ECHO_TIMEOUT_NS) {
+        break;
+      }
+      window[slot].pending = 0;
+      lost++;
+    }
+    oldestId++;
+  }
+}
+
+// Queue the requests that are due. At echoRate, they are due on a fixed
+// schedule from the first; with no rate, whenever the transmit queue is
+// empty, which keeps the PRU's ring full without queueing up behind it.
+void echoGenerate(uint64_t now) {
+  uint8_t frame[MAX_PUP_LENGTH];
+  uint8_t *pup = frame + 4;
+  int pupLength = PUP_HEADER_BYTES + echoDataBytes + 2;
+  int i;
+  expire(now);
+  if (startNs == 0) {
+    startNs = now;
+  }
+  while ((echoCount == 0 || nextId < (uint32_t)echoCount) && nextId - oldestId < ECHO_WINDOW &&
+      (echoRate ? nextId <= (now - startNs) * echoRate / 1000000000 : txQueueDepth == 0)) {
+    uint32_t id = nextId;
+    memset(frame, 0, 4 + pupLength + 1);
+    frame[0] = echoDest;
+    frame[1] = echoHost;
+    pupSetWord(frame + 2, PUP_ETHER_TYPE);
+    pupSetWord(pup + PUP_LENGTH, pupLength);
+    pup[PUP_TYPE] = PUP_ECHO_ME;
+    pupSetLong(pup + PUP_ID, id);
+    pup[PUP_DEST + 1] = echoDest;
+    pupSetLong(pup + PUP_DEST + 2, PUP_ECHO_SOCKET);
+    pup[PUP_SOURCE + 1] = echoHost;
+    pupSetLong(pup + PUP_SOURCE + 2, PUP_ECHO_SOCKET);
+    for (i = 0; i < echoDataBytes; i++) {
+      pup[PUP_HEADER_BYTES + i] = (id + i) & 0xff;
+    }
+    int len = pupFinishFrame(frame);
+    if (!txQueueAdd(frame, len, now)) {
+      return;
+    }
+    window[id % ECHO_WINDOW].sentNs = now;
+    window[id % ECHO_WINDOW].pending = 1;
+    nextId++;
+    sent++;
+    wireNs += frameWireNs(len);
+  }
+}
+
+// Nonzero once echoCount requests have been sent and each answered or
+// given up on
+int echoFinished(uint64_t now) {
+  if (echoDest == 0 || echoCount == 0 || nextId < (uint32_t)echoCount) {
+    return 0;
+  }
+  expire(now);
+  return oldestId == nextId;
+}
+
+// Print the requests' fate, the round trips per second and the share of
+// the wire's time the requests and replies took; against the simulated
+// PRU at full rate, that can be well over 100%. The round trip times are
+// in the latency report.
+void echoReport(FILE *f, uint64_t now) {
+  if (answered > 0) {
+    fprintf(f, "Echo: answered %ld requests\n", answered);
+  }
+  if (echoDest == 0 || sent == 0) {
+    return;
+  }
+  double secs = (now - startNs) / 1e9;
+  fprintf(f, "Echo to host %#o: %ld sent, %ld received, %ld lost, %ld late, %ld bad, %ld waiting\n",
+      echoDest, sent, received, lost, late, bad, sent - received - lost - bad);
+  fprintf(f, "%.0f round trips/s of %d data bytes, %.1f%% of the 3 Mb/s wire\n",
+      received / secs, echoDataBytes, wireNs * 100 / (secs * 1e9));
+}
@@ -0,0 +1,39 @@
+/*
+ * echo.h
+ *
+ * PUP echo, for measuring the link against its 3 Mb/s budget without IFS.
+ * With a host number of its own, the gateway answers EchoMe PUPs that
+ * Altos on the wire send to it. As a load generator, it sends EchoMe PUPs
+ * to a host on the wire at a set rate and size, and matches the replies by
+ * PUP ID for the round trip time, which is a latency stage. A request not
+ * answered within ECHO_TIMEOUT_NS is lost.
+ *
+ * Frames here are Alto Ethernet frames, as in pup.h.
+ */
+
+#ifndef ECHO_H_
+#define ECHO_H_
+#include <stdint.h>
+#include <stdio.h>
+#include "pup.h"
+
+#define PUP_ECHO_SOCKET 5
+#define PUP_ECHO_ME 1
+#define PUP_IM_AN_ECHO 2
+
+#define ECHO_WINDOW 256 // Requests outstanding at most
+#define ECHO_TIMEOUT_NS 1000000000
+
+extern int echoHost; // The gateway's own host number, 0 for none
+extern int echoDest; // Host to send requests to, 0 for none
+extern int echoRate; // Requests per second, 0 for as fast as the wire takes them
+extern int echoDataBytes; // PUP data bytes per request
+extern int echoCount; // Requests to send, 0 for no end
+
+int echoAnswer(const uint8_t *request, int len, uint8_t *reply);
+void echoReceive(const uint8_t *frame, int len, uint64_t now);
+void echoGenerate(uint64_t now);
+int echoFinished(uint64_t now);
+void echoReport(FILE *f, uint64_t now);
+
+#endif /* ECHO_H_ */
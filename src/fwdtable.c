@@ -0,0 +1,50 @@
+// Forwarding table: which side of the gateway each Alto host is on.
+#include <string.h>
+#include <netinet/in.h>
+#include "fwdtable.h"
+#include "gateway.h"
+
+static struct fwdEntry table[256];
+
+// A host sent a frame on the wire.
+void fwdLearnWire(uint8_t host, uint64_t now) {
+  if (host == FWD_BROADCAST) {
+    return;
+  }
+  table[host].side = FWD_WIRE;
+  table[host].seenNs = now;
+}
+
+// A host sent a datagram from address from, batched or not. Its frames go
+// back to the same address, on the port the UDP side listens on. Once it
+// has sent a batched datagram it is taken to understand them until it
+// moves.
+void fwdLearnUdp(uint8_t host, const struct sockaddr_in *from, int batch, uint64_t now) {
+  if (host == FWD_BROADCAST) {
+    return;
+  }
+  struct fwdEntry *e = &table[host];
+  if (e->side != FWD_UDP || e->addr.sin_addr.s_addr != from->sin_addr.s_addr) {
+    e->batch = 0;
+  }
+  e->side = FWD_UDP;
+  e->seenNs = now;
+  e->addr = *from;
+  e->addr.sin_port = htons(UDP_SEND_PORT);
+  e->batch |= batch;
+}
+
+// Returns the side host was last heard on, or FWD_UNKNOWN if it hasn't
+// been heard from in FWD_AGE_S. *entry gets its entry.
+int fwdLookup(uint8_t host, uint64_t now, struct fwdEntry **entry) {
+  struct fwdEntry *e = &table[host];
+  if (host == FWD_BROADCAST || e->side == FWD_UNKNOWN) {
+    return FWD_UNKNOWN;
+  }
+  if (now - e->seenNs > FWD_AGE_S * 1000000000ULL) {
+    e->side = FWD_UNKNOWN;
+    return FWD_UNKNOWN;
+  }
+  *entry = e;
+  return e->side;
+}
@@ -0,0 +1,35 @@
+/*
+ * fwdtable.h
+ *
+ * Forwarding table: which side of the gateway each Alto Ethernet host is
+ * on, keyed by its 8-bit host number. Hosts on the wire are learned from
+ * the source byte of frames the PRU receives, and hosts on the UDP side
+ * from the source byte and address of datagrams. Entries not refreshed
+ * for FWD_AGE_S are forgotten, so a host that moves or goes away is
+ * flooded to again.
+ */
+
+#ifndef FWDTABLE_H_
+#define FWDTABLE_H_
+#include <stdint.h>
+#include <netinet/in.h>
+
+#define FWD_AGE_S 300
+#define FWD_BROADCAST 0 // Host number that every host receives
+
+#define FWD_UNKNOWN 0
+#define FWD_WIRE 1
+#define FWD_UDP 2
+
+struct fwdEntry {
+  int side; // FWD_WIRE or FWD_UDP, FWD_UNKNOWN if never heard from
+  uint64_t seenNs; // When the host was last heard from
+  struct sockaddr_in addr; // FWD_UDP: where to send the host's frames
+  int batch; // FWD_UDP: the host has sent batched datagrams, so takes them
+};
+
+void fwdLearnWire(uint8_t host, uint64_t now);
+void fwdLearnUdp(uint8_t host, const struct sockaddr_in *from, int batch, uint64_t now);
+int fwdLookup(uint8_t host, uint64_t now, struct fwdEntry **entry);
+
+#endif /* FWDTABLE_H_ */
@@ -0,0 +1,315 @@
+// Host test bench for the PRU firmware.
+// Builds main.c against the emulated peripherals in pru_host.c (PRU_HOST),
+// and runs its send and receive routines on a virtual clock:
+// - send_packet() and send_half_bits() send a frame, and the waveform on
+//   WRITE_PIN is checked: every pulse should be a whole number of 170 ns
+//   half-bits, and the frame should decode, and the start and end times
+//   the routine stamps in the descriptor should match the waveform. Then
+//   the timer is sped up to find the fastest tick each can keep up with.
+// - receive_packet() and receive_bytes() are fed a frame at a range of bit
+//   rates, to find the fastest at which they still record every pulse to
+//   within a poll of its true width.
+// - Both send routines are checked to wait for a frame from the Alto to
+//   end before they start, and to stop and signal a collision when the
+//   Alto starts sending in the middle of theirs.
+// Only register and memory accesses are charged cycles (see pru_host.h),
+// so the rates found are an upper bound for the real firmware.
+//
+// Usage:
+// $ ./fwsim [frame length]
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "crc.h"
+#include "gateway.h"
+#include "manchester.h"
+
+// The firmware, with its main() renamed so it doesn't clash
+#define main pruMain
+#include "main.c"
+#undef main
+
+#define W_BUF 0x400
+#define R_BUF_START 0x10000
+#define R_BUF_END 0x13000
+#define MAX_DURATIONS (16 * MAX_PUP_LENGTH + 2)
+
+// Time allowed for one routine to finish
+#define LIMIT_NS 100000000
+
+static uint8_t frame[MAX_PUP_LENGTH];
+static int frameLen;
+static uint8_t durations[MAX_DURATIONS];
+static int durationsLen;
+static uint64_t edges[MAX_DURATIONS + 1];
+static int stampErr; // From the last transmitAt(), ns
+
+// Reset the emulated PRU and run the firmware's start-up code.
+static void startFirmware() {
+  pruHostReset();
+  *PRU_CTRL |= 8;
+  __R30 = (HIGH << COLL_PIN) | (HIGH << WRITE_PIN);
+  init_pwm();
+  init_iep_timer();
+  reset_iep_timer();
+  w_head = 0;
+  r_pos = 0;
+  pruHostInput(READ_PIN, NULL, 0); // Idle line
+  pruHostLimitNs = pruHostNs + LIMIT_NS;
+}
+
+// Send the frame in mode with the ECAP timer ticking every halfNs. Return
+// nonzero if every pulse on WRITE_PIN is within half a tick of a whole
+// number of ticks and the waveform decodes to the frame. *maxErr and
+// *rmsErr get the pulse width errors.
+static int transmitAt(int mode, int halfNs, int *maxErr, double *rmsErr, uint64_t *elapsed) {
+  startFirmware();
+  *ECAP_APRD = halfNs / PRU_HOST_CYCLE_NS - 1;
+  volatile struct tx_desc *desc = &IFACE->w_desc[0];
+  desc->buf = W_BUF;
+  if (mode == TX_MODE_HALF_BITS) {
+    desc->length = encodeHalfBits(frame, frameLen, pruHostRam + W_BUF, PRU_HOST_RAM_SIZE - W_BUF);
+  } else {
+    memcpy(pruHostRam + W_BUF, frame, frameLen);
+    desc->length = frameLen;
+  }
+  uint64_t start = pruHostNs;
+  uint16_t status = mode == TX_MODE_HALF_BITS ? send_half_bits(desc) : send_packet(desc);
+  *elapsed = pruHostNs - start;
+  pruHostFlush();
+
+  // Pulses on WRITE_PIN, from the middle of the sync bit, in nominal
+  // 170 ns units for decode()
+  int level = HIGH, collision = 0, count = 0, i;
+  uint64_t first = 0, last = 0;
+  double sumSq = 0;
+  *maxErr = 0;
+  for (i = 0; i < pruHostOutputCount; i++) {
+    uint32_t r30 = pruHostOutput[i].r30;
+    if (((r30 >> COLL_PIN) & 1) == LOW) {
+      collision = 1;
+    }
+    if (((r30 >> WRITE_PIN) & 1) == level) {
+      continue;
+    }
+    level = !level;
+    if (last != 0) {
+      int width = pruHostOutput[i].ns - last;
+      int halves = (width + halfNs / 2) / halfNs;
+      int err = abs(width - halves * halfNs);
+      sumSq += (double)err * err;
+      if (err > *maxErr) {
+        *maxErr = err;
+      }
+      if (count < MAX_DURATIONS) {
+        durations[count++] = width * HALF_BIT_NS / halfNs / RECV_WIDTH;
+      }
+    } else {
+      first = pruHostOutput[i].ns;
+    }
+    last = pruHostOutput[i].ns;
+  }
+  // The stamps bracket the waveform: the sync bit's first half doesn't
+  // change the idle level, and the trailing 1 may not either.
+  stampErr = abs((int)(desc->end - desc->start) - (int)(last - first));
+  *rmsErr = count ? sqrt(sumSq / count) : 0;
+  uint8_t bytes[MAX_PUP_LENGTH];
+  int len = decode(durations, count, bytes, MAX_PUP_LENGTH);
+  return status == STATUS_OUTPUT_COMPLETE && !collision && len == frameLen &&
+    memcmp(bytes, frame, frameLen) == 0 && *maxErr * 2 < halfNs;
+}
+
+// Check both send routines at 170 ns, and find the fastest tick each can
+// keep up with. Return nonzero on failure.
+static int checkTransmit() {
+  static const int modes[] = { TX_MODE_BYTES, TX_MODE_HALF_BITS };
+  int failed = 0;
+  int m;
+  printf("Sending %d bytes\n", frameLen);
+  printf("               | at 170 ns                                      | fastest tick\n");
+  printf("               | ok  time us  err rms ns  worst ns  stamps ns |   ns   Mb/s\n");
+  for (m = 0; m < 2; m++) {
+    int maxErr, unused, halfNs, fastest = 0;
+    double rmsErr, unusedRms;
+    uint64_t elapsed, unusedElapsed;
+    int ok = transmitAt(modes[m], HALF_BIT_NS, &maxErr, &rmsErr, &elapsed) && maxErr <= HALF_BIT_NS / 10;
+    int stamp = stampErr;
+    int stamped = stamp <= 2 * HALF_BIT_NS + 10 * PRU_HOST_CYCLE_NS;
+    for (halfNs = HALF_BIT_NS; halfNs >= 2 * PRU_HOST_CYCLE_NS; halfNs -= PRU_HOST_CYCLE_NS) {
+      if (!transmitAt(modes[m], halfNs, &unused, &unusedRms, &unusedElapsed)) {
+        break;
+      }
+      fastest = halfNs;
+    }
+    printf("%-14s | %-3s %7.1f %11.2f %9d %10d | %4d %6.2f\n",
+        modes[m] == TX_MODE_HALF_BITS ? "send_half_bits" : "send_packet", ok && stamped ? "yes" : "NO",
+        elapsed / 1000.0, rmsErr, maxErr, stamp, fastest, fastest ? 1000.0 / (2 * fastest) : 0);
+    failed |= !ok || !stamped;
+  }
+  return failed;
+}
+
+// Load the frame into write descriptor 0 for mode, and send it.
+static uint16_t sendFrame(int mode) {
+  volatile struct tx_desc *desc = &IFACE->w_desc[0];
+  desc->buf = W_BUF;
+  if (mode == TX_MODE_HALF_BITS) {
+    desc->length = encodeHalfBits(frame, frameLen, pruHostRam + W_BUF, PRU_HOST_RAM_SIZE - W_BUF);
+  } else {
+    memcpy(pruHostRam + W_BUF, frame, frameLen);
+    desc->length = frameLen;
+  }
+  uint16_t status = mode == TX_MODE_HALF_BITS ? send_half_bits(desc) : send_packet(desc);
+  pruHostFlush();
+  return status;
+}
+
+// Time of the first output change with pin at level, or 0
+static uint64_t firstOutput(int pin, int level) {
+  int i;
+  for (i = 0; i < pruHostOutputCount; i++) {
+    if (((pruHostOutput[i].r30 >> pin) & 1) == level) {
+      return pruHostOutput[i].ns;
+    }
+  }
+  return 0;
+}
+
+// Check carrier sense and collision detection for both send routines.
+// Return nonzero on failure.
+static int checkCollisions() {
+  static const int modes[] = { TX_MODE_BYTES, TX_MODE_HALF_BITS };
+  static uint64_t busy[64]; // A frame from the Alto, under way
+  static uint64_t collide[2]; // The Alto starting 100 us in
+  static uint64_t stuck[1]; // The line held low
+  int failed = 0;
+  int m, i;
+  printf("\nCarrier sense and collisions\n");
+  printf("               | defers  start ns | collision  detect ns | stuck line\n");
+  for (m = 0; m < 2; m++) {
+    // Send during a frame from the Alto: it should start after.
+    startFirmware();
+    for (i = 0; i < 64; i++) {
+      busy[i] = pruHostNs + i * HALF_BIT_NS;
+    }
+    pruHostInput(READ_PIN, busy, 64);
+    uint16_t status = sendFrame(modes[m]);
+    uint64_t start = firstOutput(WRITE_PIN, LOW);
+    int defers = status == STATUS_OUTPUT_COMPLETE && start > busy[63];
+
+    // The Alto starts sending part way through ours.
+    startFirmware();
+    collide[0] = pruHostNs + 100000;
+    collide[1] = collide[0] + 10000;
+    pruHostInput(READ_PIN, collide, 2);
+    status = sendFrame(modes[m]);
+    uint64_t detect = firstOutput(COLL_PIN, LOW);
+    int detects = status == STATUS_BIT_COLLISION && detect > collide[0] &&
+      detect - collide[0] <= 2 * HALF_BIT_NS + 100;
+
+    // The line never goes idle: give up without sending.
+    startFirmware();
+    stuck[0] = pruHostNs;
+    pruHostInput(READ_PIN, stuck, 1);
+    status = sendFrame(modes[m]);
+    int givesUp = status == STATUS_BIT_COLLISION && firstOutput(WRITE_PIN, LOW) == 0;
+
+    printf("%-14s | %-6s %9llu | %-9s %11llu | %s\n",
+        modes[m] == TX_MODE_HALF_BITS ? "send_half_bits" : "send_packet",
+        defers ? "yes" : "NO", (unsigned long long)(start - busy[63]),
+        detects ? "yes" : "NO", (unsigned long long)(detect ? detect - collide[0] : 0),
+        givesUp ? "gives up" : "HANGS");
+    failed |= !defers || !detects || !givesUp;
+  }
+  return failed;
+}
+
+// Feed the frame to the receive routine for mode, with a half-bit of
+// halfNs. Return nonzero if it received the frame correctly; *maxErr gets
+// the worst recorded pulse width error in raw mode.
+static int receiveAt(int halfNs, int mode, int *maxErr, uint64_t *latency) {
+  int i;
+  startFirmware();
+  IFACE->r_buf_start = R_BUF_START;
+  IFACE->r_buf_end = R_BUF_END;
+  IFACE->r_max_length = mode == RECV_MODE_BYTES ? MAX_PUP_LENGTH - 1 : MAX_DURATIONS;
+  IFACE->r_mode = mode;
+  volatile struct rx_desc *desc = &IFACE->r_desc[0];
+
+  // The line drops in the middle of the sync bit, then each pulse flips it.
+  edges[0] = pruHostNs + 1000;
+  for (i = 0; i < durationsLen; i++) {
+    edges[i + 1] = edges[i] + durations[i] * RECV_WIDTH * halfNs / HALF_BIT_NS;
+  }
+  pruHostInput(READ_PIN, edges, durationsLen + 1);
+
+  uint16_t status = mode == RECV_MODE_BYTES ? receive_bytes(desc) : receive_packet(desc);
+  *latency = pruHostMaxLatencyNs;
+  *maxErr = 0;
+  if (status != STATUS_INPUT_COMPLETE) {
+    return 0;
+  }
+  uint8_t *buf = pruHostRam + desc->offset;
+  if (mode == RECV_MODE_BYTES) {
+    return desc->length == frameLen && memcmp(buf, frame, frameLen) == 0;
+  }
+  if (desc->length != durationsLen) {
+    return 0;
+  }
+  for (i = 0; i < durationsLen; i++) {
+    int err = abs((int)(buf[i] * RECV_WIDTH) - (int)(edges[i + 1] - edges[i]));
+    if (err > *maxErr) {
+      *maxErr = err;
+    }
+  }
+  return *maxErr <= PRU_HOST_R31_CYCLES * PRU_HOST_CYCLE_NS + RECV_WIDTH;
+}
+
+int main(int argc, char **argv) {
+  int i;
+  frameLen = argc > 1 ? atoi(argv[1]) : 128;
+  if (frameLen < 4 || frameLen > MAX_PUP_LENGTH - 2 || frameLen & 1) {
+    fprintf(stderr, "Bad frame length %d\n", frameLen);
+    return 1;
+  }
+  for (i = 0; i < frameLen - 2; i++) {
+    frame[i] = rand();
+  }
+  uint16_t crcVal = crc(frame, (frameLen - 2) / 2);
+  frame[frameLen - 2] = crcVal >> 8;
+  frame[frameLen - 1] = crcVal & 0xff;
+
+  int failed = checkTransmit();
+  failed |= checkCollisions();
+
+  durationsLen = encodeDurations(frame, frameLen, durations, MAX_DURATIONS);
+  printf("\nReceiving %d bytes, %d pulses\n", frameLen, durationsLen);
+  printf("half-bit ns  Mb/s | receive_packet          | receive_bytes\n");
+  printf("                  | ok  worst ns  latency ns | ok  latency ns\n");
+  int fastestRaw = 0, fastestBytes = 0, rawOk = 1, bytesOk = 1;
+  int halfNs;
+  for (halfNs = HALF_BIT_NS; halfNs >= 20; halfNs -= 10) {
+    int maxErr, unused;
+    uint64_t rawLatency, bytesLatency;
+    int raw = receiveAt(halfNs, RECV_MODE_DURATIONS, &maxErr, &rawLatency);
+    int bytes = receiveAt(halfNs, RECV_MODE_BYTES, &unused, &bytesLatency);
+    printf("%11d %5.2f | %-3s %8d %11llu | %-3s %10llu\n", halfNs, 1000.0 / (2 * halfNs),
+        raw ? "yes" : "no", maxErr, (unsigned long long)rawLatency,
+        bytes ? "yes" : "no", (unsigned long long)bytesLatency);
+    if (halfNs == HALF_BIT_NS && (!raw || !bytes)) {
+      failed = 1;
+    }
+    rawOk &= raw;
+    bytesOk &= bytes;
+    if (rawOk) {
+      fastestRaw = halfNs;
+    }
+    if (bytesOk) {
+      fastestBytes = halfNs;
+    }
+  }
+  printf("Fastest input: receive_packet %.2f Mb/s, receive_bytes %.2f Mb/s (limited by its width windows)\n",
+      1000.0 / (2 * fastestRaw), 1000.0 / (2 * fastestBytes));
+  return failed;
+}
@@ -4,92 +4,311 @@
 // Receives UDP packets on port 42425 and send over Alto Ethernet
 //
 // Usage:
-// $ ./gateway [-l] [-v] [-d]
+// $ ./gateway [-l] [-v] [-d] [-A] [-p] [-M] [-D] [-F] [-P] [-B usec] [-S path] [-R usec] [-H host] [-E host[,rate[,bytes[,count]]]] [-I dir] [-a addr] [-m file] [-c file] [-s frames] [-w] [-b] [-C n] [-r file] [-K n] [-N altos,file,dir]
+// The options are described under "Gateway options" in README.md, and the
+// simulated PRU's (-s, -w, -b, -C, -r, -K, -N) under "Running without a
+// BeagleBone".
 //
 // Compile with:
-// gcc -o ether ether.c -lprussdrv
+// make gateway
 //
+#define _GNU_SOURCE // recvmmsg, sendmmsg
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/select.h>
+#include <time.h>
+#include <sched.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/timerfd.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <netinet/ip.h>
+#include <arpa/inet.h>
 #include <errno.h>
-#include <prussdrv.h>
-#include <pruss_intc_mapping.h>
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
+#include "boot.h"
+#include "capture.h"
+#include "crc.h"
+#include "echo.h"
+#include "fwdtable.h"
+#include "gateway.h"
 #include "iface.h"
+#include "latency.h"
+#include "leds.h"
+#include "manchester.h"
+#include "metrics.h"
+#include "notify.h"
+#include "pipeline.h"
+#include "pru_backend.h"
+#include "shmring.h"
+#include "txqueue.h"
+
+// Times a frame from the Alto passed through, kept until it is sent for
+// the latency of the last stages. sync is 0 if the IEP timer isn't mapped.
+struct rxTimes {
+  uint64_t sync; // Sync edge
+  uint64_t wake; // The gateway woke up to take it
+  uint64_t decoded;
+};
 
 void enableRecv();
+int ifaceHandshake(volatile struct iface *iface, int pru);
+void initIface();
+void checkPru(uint64_t now);
+void restartPru(uint64_t now, int pru);
+void firstFrame();
 void sendToAlto();
-void recvFromAlto();
-uint16_t crc(uint8_t *buf, int len);
-int decode(int len);
-
-void sendEchoPacket();
+void queueForAlto(uint8_t *udpBuf, int count, const struct sockaddr_in *from, int batch);
+void splitBatch(uint8_t *udpBuf, int count, const struct sockaddr_in *from);
+void batchFrame(const struct sockaddr_in *dest, const uint8_t *udpBuf, int len, const struct rxTimes *times);
+void flushBatch();
+void sendToRing(const uint8_t *udpBuf, int len, const struct rxTimes *times);
+void recordRxSent(const struct rxTimes *times, uint64_t sent);
+void recvFromRing();
+struct sockaddr_in *forwardToUdp(const uint8_t *frame, int *batch);
+int forwardToAlto(const uint8_t *frame, const struct sockaddr_in *from, int batch);
+void fillTxRing();
+void reapTxRing();
+void retryTx();
+void recvFromAlto(volatile struct rx_desc *desc);
+uint64_t rxTimestamps(volatile struct rx_desc *desc, struct rxTimes *times);
+void releaseRxDesc(volatile struct rx_desc *desc, uint64_t handed);
+int decodeFromAlto(const uint8_t *d1, int len1, const uint8_t *d2, int len2, uint32_t *status,
+    uint8_t *bytes, struct rxTimes *times);
+void captureFromAlto(uint32_t status, uint32_t timestamp, const uint8_t *d1, int len1,
+    const uint8_t *d2, int len2, const uint8_t *bytes, int decodedLen);
+void forwardFromAlto(uint8_t *udpBuf, int decodedLen, uint32_t status, const char *error,
+    const struct rxTimes *times);
+void startTx(volatile struct tx_desc *desc, int length, uint64_t queuedNs);
+void pipeStart(int epollFd, int ioEpollFd);
+void pipeStop();
+int pipeTakeRx();
+void pipeFillTxRing();
+int pruSleep();
+void feedCodec();
+void *codecMain(void *arg);
+void *socketMain(void *arg);
+void pipeReport(FILE *f);
+int shmAttached(uint64_t now);
+int checkPruBytes(const uint8_t *b1, int len1, const uint8_t *b2, int len2, uint32_t status, uint8_t *bytes);
+void flushToUdp();
+void updateMetrics();
+void metricsTick(uint64_t now);
+void syncPruClock(uint64_t now);
+int spinForWork();
+void startRealTime();
+void prefaultStack();
 
-int dataram; // Address of the PRU's data ram
+struct pruBackend *backend; // Real or simulated PRU
+volatile uint8_t *dataram; // Address of the PRU's data ram
 // Memory map:
 // 0x 0000: iface     .... 8K PRU0 RAM
-// 0x 0400: write buf
-// 0x 1000: circular buf
-// 0x 2000: end       .... end of 8K PRU0 RAM
-// 0x10000: read buf  .... start of 12K shared RAM
+// 0x 0400: write bufs, one per transmit descriptor
+// 0x 1180: unused
+// 0x 2000: PRU1 iface .... 8K PRU1 RAM, receive interface with -D
+// 0x 4000: end       .... end of 8K PRU1 RAM
+// 0x10000: read buf  .... start of 12K shared RAM, receive ring
 // 0x13000: end       .... end of 12K shared RAM
-volatile struct iface *iface; // Interface block to the PRU code
+volatile struct iface *rxIface; // Interface block to the receiving PRU
+volatile struct iface *txIface; // Interface block to the sending PRU
+
+#define W_BUF_START 0x400
+#define W_BUF_SIZE 0x480 // Per transmit descriptor, holds a max length packet as half-bits
+#define R_BUF_START 0x10000
+#define R_BUF_END 0x13000
 
-volatile uint8_t *w_ptr; // Processor's pointer write buf at 0x0400
-volatile uint8_t *r_ptr; // Processor's pointer to read buf at 0x10000
-#define W_PTR_OFFSET 0x400
-#define R_PTR_OFFSET 0x10000
+// Gap the PRU leaves between packets it sends back to back
+#define TX_GAP_NS 20000
+
+int rxTail = 0; // Next receive descriptor to process
+int txSlot = 0; // Next transmit descriptor to fill
+int txDone = 0; // Oldest transmit descriptor not yet finished with
+int txBusy = 0; // Transmit descriptors filled and not yet finished with
+
+// Collisions. A descriptor that comes back with STATUS_BIT_COLLISION holds
+// the PRU's place in the ring, so its frame is sent again before any later
+// one. Binary exponential backoff, as the Alto does: after the nth
+// collision in a row, the retry waits a random 0 to 2^n - 1 slots. After
+// TX_MAX_ATTEMPTS the frame is dropped.
+#define TX_SLOT_NS 38000 // Backoff unit
+#define TX_BACKOFF_LIMIT 10 // At most 2^10 - 1 slots
+#define TX_MAX_ATTEMPTS 16
+int txAttempts = 0; // Collisions so far of the frame in txDone
+int txRetryFd; // timerfd, fires when the backoff is over
+int txRetrying = 0; // Descriptor txDone is waiting out a backoff
+long txGivenUp = 0; // Frames dropped after TX_MAX_ATTEMPTS
+long txRestartLost = 0; // Frames lost from the ring when the firmware was reloaded
+uint64_t txQueuedNs[TX_RING_SIZE]; // When each descriptor's frame was read from IFS
+uint64_t txHandedNs[TX_RING_SIZE]; // When it was handed to the PRU
+int txBytes[TX_RING_SIZE]; // Its length in bytes
 
 #define DPRINTF if (debug) printf
 
-#define MAX_PUP_LENGTH (554 + 10) // Extra 10 for slop
 // Worst case is 16 transitions per byte. Needs to be under 12K.
+#define MAX_DURATIONS (16 * MAX_PUP_LENGTH + 2)
 
 // Buffer for packet bytes
 const size_t byteBufLen = MAX_PUP_LENGTH;
-uint8_t *udpBuf; // UDP buffer has 2 bytes at beginning for length
-uint8_t *byteBuf; // Packet bytes
-// Buffer for raw transitions from PRU. Could be 2 transitions per bit
-size_t durationBufLen = 12*1024;
-uint8_t *durationBuf;
-// Buffer to hold individual bits.
-size_t bitBufLen = 8 * MAX_PUP_LENGTH;
-uint8_t *bitBuf;
 
-// LED status control
-FILE *led[4];
-void initLeds();
-void setLed(int n, int brightness);
+// UDP datagrams are read with recvmmsg and written with sendmmsg, up to
+// UDP_BATCH at a time. Each buffer has 2 bytes at beginning for length.
+#define UDP_BATCH 16
+struct mmsghdr udpInMsgs[UDP_BATCH];
+struct iovec udpInIov[UDP_BATCH];
+struct sockaddr_in udpInAddrs[UDP_BATCH];
+uint8_t udpInBufs[UDP_BATCH][UDP_BATCH_MAX_BYTES];
+struct mmsghdr udpOutMsgs[UDP_BATCH];
+struct iovec udpOutIov[UDP_BATCH];
+struct sockaddr_in udpOutAddrs[UDP_BATCH];
+uint8_t udpOutBufs[UDP_BATCH][MAX_PUP_LENGTH + 2];
+struct rxTimes udpOutTimes[UDP_BATCH];
+int udpOutCount = 0; // Datagrams waiting for flushToUdp()
+
+// With -B, frames for a peer that takes batched datagrams are packed into
+// batchBuf. The batch is sent when its window closes, when the next frame
+// doesn't fit, or when the next frame is for another peer.
+uint64_t batchWindowNs = 0; // 0 to send one frame per datagram
+uint8_t batchBuf[UDP_BATCH_MAX_BYTES];
+int batchLen = 0; // Bytes, 0 when no batch is open
+int batchFrames = 0;
+struct sockaddr_in batchDest;
+struct rxTimes batchTimes[UDP_BATCH_MAX_BYTES / 2]; // A frame takes at least its length word
+int batchTimerFd; // timerfd, fires when the open batch's window closes
+
+// With -S, the shared memory transport to a local IFS
+const char *shmPath;
+struct shmringHandle shm;
+struct sockaddr_in shmFrom; // Where frames from the ring are learned as coming from
+#define SHM_CHECK_NS 1000000000 // How often to check that the attached IFS is still running
+uint64_t shmCheckedNs; // When it was last checked
+
+// Real-time mode (-R)
+#define RT_PRIORITY 40 // SCHED_FIFO, below the kernel's interrupt threads
+#define RT_STACK_BYTES (256 * 1024) // Stack faulted in for the main loop
+#define RT_POLL_NS 2000 // While spinning, how often to poll the fds
+int realTime = 0;
+uint64_t rtSpinNs = 0; // How long to poll before blocking
+int spinEpollFd; // The fds polled while spinning: all but the PRU events
+
+int echoTimerFd = -1; // timerfd, fires at the -E rate
+
+struct bootServer bootServer; // With -I, sends boot files; dir is NULL otherwise
+
+// Pipelined mode (-P). The main loop is the PRU stage: it copies each
+// frame the PRU hands over into a buffer from rxPool and gives the
+// descriptor straight back, and copies encoded frames into the transmit
+// ring. The codec thread decodes and encodes. The socket thread does the
+// rest: UDP, the shared memory rings, forwarding, echo, boot, capture,
+// logging and the metrics file, with the transmit queue as its own.
+// Frames from the Alto go PRU -> codec -> socket and their buffers back to
+// the PRU; frames to the Alto go socket -> codec -> PRU and back. Each
+// metric and latency stage is only updated by the thread whose work it
+// counts.
+#define PIPE_RX_FRAMES 32 // Four receive rings' worth
+#define PIPE_TX_FRAMES (2 * TX_RING_SIZE) // The next ring's worth encoded while the PRU sends; the rest wait in the transmit queue
+struct rxPipeFrame {
+  int length; // Bytes of raw: durations, or frame bytes with -p
+  uint32_t pruStatus; // The descriptor's
+  uint32_t timestamp; // The descriptor's, for the capture
+  uint32_t status; // After decoding, as forwardFromAlto() takes it
+  int decodedLen; // With the CRC, or -1
+  const char *error; // Why it couldn't be decoded
+  struct rxTimes times;
+  uint8_t raw[MAX_DURATIONS];
+  uint8_t udp[MAX_PUP_LENGTH + 2]; // The UDP length word, then the decoded frame
+};
+struct txPipeFrame {
+  int length; // Bytes, with the CRC
+  int halfBits; // Encoded in TX_MODE_HALF_BITS
+  uint64_t queuedNs; // When the gateway read it from IFS
+  uint8_t data[MAX_PUP_LENGTH];
+  uint8_t encoded[W_BUF_SIZE];
+};
+int pipelined = 0;
+struct rxPipeFrame rxPool[PIPE_RX_FRAMES];
+struct txPipeFrame txPool[PIPE_TX_FRAMES];
+struct pipeRing rxToCodec, rxToSocket, rxFree;
+struct pipeRing txToCodec, txToPru, txFree;
+int pruBell, codecBell, socketBell;
+pthread_t codecThread, socketThread;
+volatile int codecStopping, socketStopping; // Finish what has been passed over, and stop
+volatile int pipeEchoDone; // echoFinished(), from the socket thread
+int socketEpollFd;
+int rxWaiting = 0; // A frame is waiting in the receive ring for a buffer
+long rxStarved = 0; // Times that happened
+double codecCpu, socketCpu; // Each thread's CPU time, s, once it has stopped
+long pipeSyscalls; // Made by the codec and socket threads, once they have stopped
 
-int packetCount = 0, badPacketCount = 0;
+// PRU watchdog
+#define PRU_STALL_NS 20000000 // Longest a heartbeat may stand still: a send defers 2 ms at most, and a frame takes 2 ms
+#define IFACE_WAIT_NS 1000000000 // Longest the firmware may take to answer the interface version
+#define WAIT_MS 10 // Longest the main loop blocks, so the heartbeats are looked at
+#define IDLE_LED_MS 5000 // How long with nothing to do lights LED_IDLE
+uint32_t pruBeats[PRU_EVENTS]; // Each PRU's heartbeat when it last moved
+uint64_t pruBeatNs[PRU_EVENTS]; // When that was, 0 to start again
+// Frames the firmware dropped for want of a receive descriptor. Its count,
+// r_dropped, starts again from 0 when it is reloaded, so the ones before
+// are kept here. Both are updated by the thread that runs checkPru().
+long rxDroppedBefore = 0; // Before the last reload
+long rxDropped = 0; // In all
 
-#define UDP_RECV_PORT 42424 // Defined in ifs.cfg
-#define UDP_SEND_PORT 42425
+// Time to the first frame through after startup or a restart
+uint64_t firstFrameFrom; // Measured from here, 0 once reported
+const char *firstFrameAfter;
+uint64_t gatewayStartNs;
+
+__thread long syscalls = 0; // Made by this thread, to see how well batching works
+
+__thread uint64_t wakeNs; // When this thread's loop last woke up
+const char *metricsPath; // Prometheus text file, or NULL
+uint64_t lastMetricsWrite, lastSummary;
+uint64_t lastClockSync; // When the IEP timer was last mapped
+volatile sig_atomic_t latencyWanted; // SIGUSR1 arrived
+
+// Pulse widths are histogrammed for every bad frame but only one in
+// PULSE_SAMPLE good ones, since it costs a memory access per pulse.
+#define PULSE_SAMPLE 16
+
+// Decoder for frames from the Alto: decodeSplit() or decodeSplitAdaptive()
+int (*decodeFn)(const uint8_t *d1, int len1, const uint8_t *d2, int len2, uint8_t *bytes, int maxBytes) = decodeSplit;
+
+int pruDecode = 0; // Receive in RECV_MODE_BYTES
+int txMode = TX_MODE_BYTES;
+int pruDual = 0;
+int fwdFlood = 0; // Send every frame to both sides, without the forwarding table
+
+int packetCount = 0, badPacketCount = 0, sentCount = 0;
 
 int sendSock;
 int recvSock;
 struct sockaddr_in s_send;
 struct sockaddr_in s_recv;
 
-#define PRUSS_INTC_CUSTOM {   \
-  { PRU0_PRU1_INTERRUPT, PRU1_PRU0_INTERRUPT, PRU0_ARM_INTERRUPT, PRU1_ARM_INTERRUPT, ARM_PRU0_INTERRUPT, ARM_PRU1_INTERRUPT,  15, (char)-1  },  \
-  { {PRU0_PRU1_INTERRUPT,CHANNEL1}, {PRU1_PRU0_INTERRUPT, CHANNEL0}, {PRU0_ARM_INTERRUPT,CHANNEL2}, {PRU1_ARM_INTERRUPT, CHANNEL3}, {ARM_PRU0_INTERRUPT, CHANNEL0}, {ARM_PRU1_INTERRUPT, CHANNEL1}, {15, CHANNEL0}, {-1,-1}},  \
-  {  {CHANNEL0,PRU0}, {CHANNEL1, PRU1}, {CHANNEL2, PRU_EVTOUT0}, {CHANNEL3, PRU_EVTOUT1}, {-1,-1} },  \
-  (PRU0_HOSTEN_MASK | PRU1_HOSTEN_MASK | PRU_EVTOUT0_HOSTEN_MASK | PRU_EVTOUT1_HOSTEN_MASK) /*Enable PRU0, PRU1, PRU_EVTOUT0, PRU_EVTOUT1 */ \
-}
-
 FILE *logFile;
 
 int verbose = 0;
 int logging = 0;
 int debug = 0;
 
+void report(struct timespec *startWall, struct timespec *startCpu);
+uint64_t nowNs();
+
+void wantLatency(int sig) {
+  latencyWanted = 1;
+}
+
 int main(int argc, char **argv) {
   int i;
+  gatewayStartNs = nowNs();
+  in_addr_t sendAddr = htonl(INADDR_BROADCAST);
+#ifdef NO_PRUSSDRV
+  backend = &simBackend;
+#else
+  backend = &prussdrvBackend;
+#endif
   for (i = 1; i < argc; i++) {
     if (strcmp(argv[i], "-l") == 0) {
       logFile = fopen("/tmp/log", "w");
@@ -99,54 +318,92 @@ int main(int argc, char **argv) {
       verbose = 1;
     } else if (strcmp(argv[i], "-d") == 0) {
       debug = 1;
+    } else if (strcmp(argv[i], "-A") == 0) {
+      decodeFn = decodeSplitAdaptive;
+    } else if (strcmp(argv[i], "-p") == 0) {
+      pruDecode = 1;
+    } else if (strcmp(argv[i], "-M") == 0) {
+      txMode = TX_MODE_HALF_BITS;
+    } else if (strcmp(argv[i], "-D") == 0) {
+      pruDual = 1;
+    } else if (strcmp(argv[i], "-F") == 0) {
+      fwdFlood = 1;
+    } else if (strcmp(argv[i], "-P") == 0) {
+      pipelined = 1;
+    } else if (strcmp(argv[i], "-B") == 0 && i + 1 < argc) {
+      batchWindowNs = atoi(argv[++i]) * 1000ULL;
+      simBatch = 1;
+    } else if (strcmp(argv[i], "-S") == 0 && i + 1 < argc) {
+      shmPath = argv[++i];
+      simShm = shmPath;
+    } else if (strcmp(argv[i], "-R") == 0 && i + 1 < argc) {
+      realTime = 1;
+      rtSpinNs = atoi(argv[++i]) * 1000ULL;
+    } else if (strcmp(argv[i], "-H") == 0 && i + 1 < argc) {
+      echoHost = strtol(argv[++i], NULL, 0);
+    } else if (strcmp(argv[i], "-E") == 0 && i + 1 < argc) {
+      sscanf(argv[++i], "%i,%i,%i,%i", &echoDest, &echoRate, &echoDataBytes, &echoCount);
+    } else if (strcmp(argv[i], "-I") == 0 && i + 1 < argc) {
+      const char *ifsDir = argv[++i];
+      struct bootDir *dir = bootOpen(ifsDir);
+      if (dir == NULL) {
+        fprintf(stderr, "Can't serve boot files from %s; boot requests will go to IFS\n", ifsDir);
+      } else {
+        bootServerInit(&bootServer, dir, BOOT_SOCKET, txQueueAdd);
+      }
+    } else if (strcmp(argv[i], "-a") == 0 && i + 1 < argc) {
+      sendAddr = inet_addr(argv[++i]);
+    } else if (strcmp(argv[i], "-m") == 0 && i + 1 < argc) {
+      metricsPath = argv[++i];
+    } else if (strcmp(argv[i], "-c") == 0 && i + 1 < argc) {
+      if (captureOpen(argv[++i]) < 0) {
+        exit(-1);
+      }
+    } else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) {
+      backend = &simBackend;
+      simFrames = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "-w") == 0) {
+      simWireRate = 1;
+    } else if (strcmp(argv[i], "-b") == 0) {
+      simBurst = 1;
+    } else if (strcmp(argv[i], "-C") == 0 && i + 1 < argc) {
+      simCollide = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "-r") == 0 && i + 1 < argc) {
+      backend = &simBackend;
+      simReplay = argv[++i];
+    } else if (strcmp(argv[i], "-K") == 0 && i + 1 < argc) {
+      simStall = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "-N") == 0 && i + 1 < argc) {
+      int n = 0;
+      backend = &simBackend;
+      sscanf(argv[++i], "%i,%i,%n", &simBoot, &simBootFile, &n);
+      simBootDir = n > 0 ? argv[i] + n : NULL;
     } else {
-      fprintf(stderr, "Usage: gateway [-l] [-v] [-d]\n");
+      fprintf(stderr, "Usage: gateway [-l] [-v] [-d] [-A] [-p] [-M] [-D] [-F] [-P] [-B usec] [-S path] [-R usec] [-H host] [-E host[,rate[,bytes[,count]]]] [-I dir] [-a addr] [-m file] [-c file] [-s frames] [-w] [-b] [-C n] [-r file] [-K n] [-N altos,file,dir]\n");
       exit(0);
     }
   }
-  initLeds();
-  prussdrv_init();
-  if (prussdrv_open(PRU_EVTOUT_0) == -1) {
-    fprintf(stderr, "prussdrv_open() failed. Run:\n");
-    fprintf(stderr, "echo PRU-ETHER-ALTO > /sys/devices/bone_capemgr.?/slots\n");
-    exit(-1);
-  }
-
-  tpruss_intc_initdata pruss_intc_initdata = PRUSS_INTC_CUSTOM;
-  prussdrv_pruintc_init(&pruss_intc_initdata);
-
-  // Start PRU
-  if (prussdrv_load_datafile(0 /* PRU0 */, "etherdata.bin") < 0) {
-    fprintf(stderr, "Error loading etherdata.bin\n");
-    exit(-1);
+  if (echoDest != 0) {
+    if (echoHost <= 0 || echoHost > 0377 || echoDest <= 0 || echoDest > 0377 ||
+        echoRate < 0 || echoDataBytes < 0 || echoDataBytes > PUP_MAX_DATA || echoCount < 0) {
+      fprintf(stderr, "-E needs -H, host numbers 1 to 0377, and at most %d data bytes\n", PUP_MAX_DATA);
+      exit(-1);
+    }
+    if (backend == &simBackend) {
+      simEcho = 1;
+      if (echoCount == 0) {
+        echoCount = simFrames;
+      }
+    }
   }
-  if (prussdrv_exec_program(0 /* PRU0 */, "ethertext.bin") < 0) {
-    fprintf(stderr, "Error loading ethertext.bin\n");
+  if (simBoot && (simBoot > SIM_BOOT_ALTOS || simBoot < 0 || simBootDir == NULL)) {
+    fprintf(stderr, "-N needs 1 to %d Altos, a boot file number and an IFS directory\n", SIM_BOOT_ALTOS);
     exit(-1);
   }
-  DPRINTF("started PRU\n");
-  if (prussdrv_map_prumem(PRUSS0_PRU0_DATARAM, (void *)&dataram) < 0) {
-    fprintf(stderr, "map_prumem failed");
-    exit(-1);
+  if (backend != &simBackend) {
+    ledsStart();
   }
 
-  udpBuf = malloc(byteBufLen + 2); // UDP buffer has 2 bytes at beginning for length
-  byteBuf = udpBuf + 2; // Packet bytes
-  durationBuf = malloc(durationBufLen);
-  bitBuf = malloc(bitBufLen); // Buffer to hold individual bits.
-
-  iface = (struct iface *)dataram;
-  w_ptr = (uint8_t *)(dataram + W_PTR_OFFSET);
-  r_ptr = (uint8_t *)(dataram + R_PTR_OFFSET);
-
-  iface->r_owner = OWNER_PRU; // PRU can read into buffer
-  iface->r_buf = R_PTR_OFFSET;
-  iface->r_max_length = durationBufLen;
-  iface->r_truncated = 0;
-
-  iface->w_owner = OWNER_ARM; // ARM can use write buffer
-  iface->w_buf = W_PTR_OFFSET;
-
   // Init sockets
   sendSock = socket(AF_INET, SOCK_DGRAM, 0);
   int broadcastEnable = 1;
@@ -154,7 +411,7 @@ int main(int argc, char **argv) {
   memset(&s_send, '\0', sizeof(s_send));
   s_send.sin_family = AF_INET;
   s_send.sin_port = htons(UDP_SEND_PORT);
-  s_send.sin_addr.s_addr = htonl(INADDR_BROADCAST);
+  s_send.sin_addr.s_addr = sendAddr;
 
   recvSock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
   broadcastEnable = 1;
@@ -168,93 +425,687 @@ int main(int argc, char **argv) {
     exit(-1);
   }
 
-  int pruFd = prussdrv_pru_event_fd(PRU_EVTOUT_0);
-  fd_set rfds;
+  if (shmPath) {
+    if (shmringOpen(shmPath, 1, &shm) < 0) {
+      exit(-1);
+    }
+    shmFrom.sin_family = AF_INET;
+    shmFrom.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  }
 
-  while (1) {
-    // fprintf(stderr, "Waiting on recv %x %x\n", iface->r_buf, iface->r_max_length);
-    FD_ZERO(&rfds);
-    FD_SET(pruFd, &rfds);
-    int maxfd = pruFd;
-    // Only wait on socket data if the write buffer is available.
-    // I.e. if there is a write in progress, don't start a new one.
-    if (iface->w_owner == OWNER_ARM) {
-      FD_SET(recvSock, &rfds);
-      if (recvSock > maxfd) {
-        maxfd = recvSock;
+  // Start PRU
+  if (backend->open() < 0) {
+    exit(-1);
+  }
+  DPRINTF("started PRU (%s)\n", backend->name);
+  dataram = backend->dataram();
+
+  for (i = 0; i < UDP_BATCH; i++) {
+    udpInIov[i].iov_base = udpInBufs[i];
+    udpInIov[i].iov_len = sizeof(udpInBufs[i]);
+    udpInMsgs[i].msg_hdr.msg_iov = &udpInIov[i];
+    udpInMsgs[i].msg_hdr.msg_iovlen = 1;
+    udpInMsgs[i].msg_hdr.msg_name = &udpInAddrs[i];
+    udpOutIov[i].iov_base = udpOutBufs[i];
+    udpOutMsgs[i].msg_hdr.msg_iov = &udpOutIov[i];
+    udpOutMsgs[i].msg_hdr.msg_iovlen = 1;
+    udpOutMsgs[i].msg_hdr.msg_name = &udpOutAddrs[i];
+    udpOutMsgs[i].msg_hdr.msg_namelen = sizeof(udpOutAddrs[i]);
+  }
+
+  txIface = (volatile struct iface *)dataram;
+  rxIface = (volatile struct iface *)(dataram + (pruDual ? PRU1_RAM : 0));
+  initIface();
+
+  // The PRU events and the socket are registered once. In pipelined mode,
+  // the sockets and their timers are the socket thread's.
+  int pruFds[PRU_EVENTS];
+  int events = pruDual ? PRU_EVENTS : 1;
+  int epollFd = epoll_create1(0);
+  int ioEpollFd = pipelined ? epoll_create1(0) : epollFd;
+  struct epoll_event ev;
+  memset(&ev, 0, sizeof(ev));
+  ev.events = EPOLLIN;
+  if (epollFd < 0 || ioEpollFd < 0) {
+    perror("epoll");
+    exit(-1);
+  }
+  for (i = 0; i < events; i++) {
+    pruFds[i] = backend->eventFd(i);
+    ev.data.fd = pruFds[i];
+    if (epoll_ctl(epollFd, EPOLL_CTL_ADD, pruFds[i], &ev) < 0) {
+      perror("epoll");
+      exit(-1);
+    }
+  }
+  ev.data.fd = recvSock;
+  if (epoll_ctl(ioEpollFd, EPOLL_CTL_ADD, recvSock, &ev) < 0) {
+    perror("epoll");
+    exit(-1);
+  }
+  // Each gateway draws its own backoffs, so two that collide with each
+  // other don't keep retrying in step.
+  srand(getpid() ^ nowNs());
+  txRetryFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+  ev.data.fd = txRetryFd;
+  if (txRetryFd < 0 || epoll_ctl(epollFd, EPOLL_CTL_ADD, txRetryFd, &ev) < 0) {
+    perror("timerfd");
+    exit(-1);
+  }
+  batchTimerFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+  ev.data.fd = batchTimerFd;
+  if (batchTimerFd < 0 || epoll_ctl(ioEpollFd, EPOLL_CTL_ADD, batchTimerFd, &ev) < 0) {
+    perror("timerfd");
+    exit(-1);
+  }
+  if (shmPath) {
+    ev.data.fd = shm.bellIn;
+    if (epoll_ctl(ioEpollFd, EPOLL_CTL_ADD, shm.bellIn, &ev) < 0) {
+      perror("epoll");
+      exit(-1);
+    }
+  }
+  if (echoDest && echoRate > 0) {
+    uint64_t period = 1000000000 / echoRate;
+    struct itimerspec its;
+    its.it_value.tv_sec = its.it_interval.tv_sec = period / 1000000000;
+    its.it_value.tv_nsec = its.it_interval.tv_nsec = period % 1000000000;
+    echoTimerFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+    ev.data.fd = echoTimerFd;
+    if (echoTimerFd < 0 || timerfd_settime(echoTimerFd, 0, &its, NULL) < 0 ||
+        epoll_ctl(ioEpollFd, EPOLL_CTL_ADD, echoTimerFd, &ev) < 0) {
+      perror("timerfd");
+      exit(-1);
+    }
+  }
+  // Before real-time mode, which the threads would inherit
+  if (pipelined) {
+    pipeStart(epollFd, ioEpollFd);
+  }
+  if (realTime) {
+    int spinFds[] = { txRetryFd, recvSock, batchTimerFd, echoTimerFd, shmPath ? shm.bellIn : -1 };
+    if (pipelined) {
+      spinFds[1] = pruBell;
+      spinFds[2] = spinFds[3] = spinFds[4] = -1;
+    }
+    spinEpollFd = epoll_create1(0);
+    for (i = 0; i < 5; i++) {
+      if (spinFds[i] < 0) {
+        continue;
+      }
+      ev.data.fd = spinFds[i];
+      if (spinEpollFd < 0 || epoll_ctl(spinEpollFd, EPOLL_CTL_ADD, spinFds[i], &ev) < 0) {
+        perror("epoll");
+        exit(-1);
       }
-      DPRINTF("Waiting on PRU or socket: r_owner %d w_owner %d\n", iface->r_owner, iface->w_owner);
-    } else {
-      DPRINTF("Waiting on PRU: r_owner %d w_owner %d\n", iface->r_owner, iface->w_owner);
-    }
-    setLed(3, 0);
-    struct timeval timeout;
-    timeout.tv_sec = 5;
-    timeout.tv_usec = 0;
-    int retval = select(maxfd + 1, &rfds, NULL /* wfds */, NULL /* exceptfds */, &timeout);
-    setLed(3, 1);
-    if (retval == 0) {
-      setLed(2, 1);
-      DPRINTF("Select timeout\n");
-      setLed(2, 0);
-      continue;
     }
+    startRealTime();
+  }
+
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = wantLatency;
+  sigaction(SIGUSR1, &sa, NULL);
 
-    // If interrupt received from the PRU, clear it.
-    if (FD_ISSET(pruFd, &rfds)) {
-      DPRINTF("Clearing PRU interrupt: r_owner %d w_owner %d\n", iface->r_owner, iface->w_owner);
-      prussdrv_pru_wait_event(PRU_EVTOUT_0);
-      prussdrv_pru_clear_event(PRU_EVTOUT_0, PRU0_ARM_INTERRUPT);
-      DPRINTF("Cleared PRU interrupt: r_owner %d w_owner %d\n", iface->r_owner, iface->w_owner);
+  uint64_t now = nowNs();
+  fprintf(stderr, "Ready %.3f s after boot, %.1f ms after starting\n", now / 1e9, (now - gatewayStartNs) / 1e6);
+  if (notifyOpen()) {
+    notifySend("READY=1");
+  }
+  firstFrameFrom = gatewayStartNs;
+  firstFrameAfter = "starting";
+  int idleWaits = 0;
+
+  struct timespec startWall, startCpu;
+  clock_gettime(CLOCK_MONOTONIC, &startWall);
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &startCpu);
+  if (echoDest && !pipelined) {
+    // Nothing else wakes the loop up to send the first requests
+    echoGenerate(nowNs());
+    fillTxRing();
+  }
+
+  while (!backend->finished() && !(pipelined ? pipeEchoDone : echoFinished(wakeNs))) {
+    // Always take socket data: if the PRU is busy sending, it waits in
+    // the transmit queue.
+    DPRINTF("Waiting on PRU or socket: r_desc %d owner %d, w_desc %d owner %d, tx queue %d\n",
+        rxTail, rxIface->r_desc[rxTail].owner, txSlot, txIface->w_desc[txSlot].owner, txQueueDepth);
+    // Only wait on the ring's doorbell if it is empty, and there is room
+    // to take frames from it.
+    int timeout = WAIT_MS;
+    int waitFd = epollFd;
+    if (rtSpinNs > 0 && spinForWork()) {
+      // Take what else is ready without blocking. The PRU events are left
+      // until the loop next blocks.
+      waitFd = spinEpollFd;
+      timeout = 0;
+    } else if (pipelined ? !pruSleep() : shmPath && txQueueTail() != NULL && !shmringSleep(shm.in)) {
+      timeout = 0;
+    }
+    struct epoll_event ready[PRU_EVENTS + 5];
+    int retval = epoll_wait(waitFd, ready, PRU_EVENTS + 5, timeout);
+    syscalls++;
+    wakeNs = nowNs();
+    if (!pipelined) {
+      metricsTick(wakeNs);
+    }
+    syncPruClock(wakeNs);
+    notifyTick(wakeNs);
+    if (latencyWanted) {
+      latencyWanted = 0;
+      latencyReport(stderr);
+      echoReport(stderr, wakeNs);
+      bootReport(&bootServer, stderr);
+      pipeReport(stderr);
+    }
+    if (retval == 0 && timeout != 0) {
+      if (++idleWaits == IDLE_LED_MS / WAIT_MS) {
+        ledActivity(LED_IDLE);
+        DPRINTF("Wait timeout\n");
+        idleWaits = 0;
+      }
+      checkPru(wakeNs);
+      if (echoDest && !pipelined) {
+        // Requests lost on the wire, or in a firmware reload, time out
+        // and make room for more, with nothing to wake the loop up.
+        echoGenerate(wakeNs);
+      }
+      // Likewise boot file frames that weren't acknowledged
+      if (!pipelined) {
+        bootTick(&bootServer, wakeNs);
+      }
+      fillTxRing();
+      continue;
+    } else if (retval < 0) {
+      if (errno != EINTR) {
+        perror("epoll_wait");
+      }
+      continue;
+    }
+    ledActivity(LED_BUSY);
+    idleWaits = 0;
+    int udpReady = 0;
+    for (i = 0; i < retval; i++) {
+      if (ready[i].data.fd == recvSock) {
+        udpReady = 1;
+        continue;
+      }
+      if (ready[i].data.fd == txRetryFd) {
+        retryTx();
+        continue;
+      }
+      if (ready[i].data.fd == batchTimerFd) {
+        uint64_t expirations;
+        if (read(batchTimerFd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN) {
+          perror("timerfd read");
+        }
+        flushBatch();
+        continue;
+      }
+      if (ready[i].data.fd == echoTimerFd) {
+        uint64_t expirations;
+        if (read(echoTimerFd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN) {
+          perror("timerfd read");
+        }
+        continue;
+      }
+      if (shmPath && ready[i].data.fd == shm.bellIn) {
+        shmringDrain(shm.bellIn);
+        syscalls++;
+        continue;
+      }
+      if (pipelined && ready[i].data.fd == pruBell) {
+        pipeBellDrain(pruBell);
+        syscalls++;
+        continue;
+      }
+      // If interrupt received from a PRU, clear it.
+      int event = ready[i].data.fd == pruFds[PRU_EVENT_TX] ? PRU_EVENT_TX : PRU_EVENT_RX;
+      DPRINTF("Clearing PRU interrupt %d\n", event);
+      backend->waitEvent(event);
+      syscalls++;
+      backend->clearEvent(event);
     }
 
-    if (iface->r_owner == OWNER_ARM) {
+    if (pipelined) {
+      metricObserve(&rxRingDepth, pipeTakeRx());
+      fillTxRing();
+      checkPru(wakeNs);
+      continue;
+    }
+    int received = 0;
+    while (rxIface->r_desc[rxTail].owner == OWNER_ARM) {
       // PRU gave us a read packet from the Alto. Send over UDP.
-      setLed(1, 1);
-      recvFromAlto();
-      setLed(1, 0);
+      ledActivity(LED_RX);
+      recvFromAlto(&rxIface->r_desc[rxTail]);
+      rxTail = (rxTail + 1) % RX_RING_SIZE;
+      received++;
     }
+    flushToUdp();
+    metricObserve(&rxRingDepth, received);
 
-    if (FD_ISSET(recvSock, &rfds)) {
+    if (udpReady) {
       // Packet received from UDP; send to Alto
-      setLed(0, 1);
+      ledActivity(LED_TX);
       sendToAlto();
-      setLed(0, 0);
     }
+    if (shmPath) {
+      recvFromRing();
+    }
+    if (echoDest) {
+      echoGenerate(wakeNs);
+    }
+    bootTick(&bootServer, wakeNs);
+    fillTxRing();
+    checkPru(wakeNs);
   }
+  if (pipelined) {
+    pipeStop();
+  }
+  flushBatch();
+  updateMetrics();
+  metricsSummary(stderr, (nowNs() - lastSummary) / 1000000000);
+  if (metricsPath) {
+    metricsWrite(metricsPath);
+  }
+  captureClose();
+  report(&startWall, &startCpu);
+  return 0;
 }
 
-#define RECV_WIDTH 2 // Recv values are in units of 2 ns (to fit in byte)
+// Print throughput and CPU cost per frame at the end of a simulated run.
+// CPU time is for the gateway's threads only, so it excludes the simulated
+// PRU.
+void report(struct timespec *startWall, struct timespec *startCpu) {
+  struct timespec endWall, endCpu;
+  clock_gettime(CLOCK_MONOTONIC, &endWall);
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &endCpu);
+  double wall = (endWall.tv_sec - startWall->tv_sec) + (endWall.tv_nsec - startWall->tv_nsec) / 1e9;
+  double cpu = (endCpu.tv_sec - startCpu->tv_sec) + (endCpu.tv_nsec - startCpu->tv_nsec) / 1e9;
+  double pruCpu = cpu;
+  int frames = packetCount + sentCount;
+  cpu += codecCpu + socketCpu;
+  syscalls += pipeSyscalls;
+  if (backend == &simBackend) {
+    simReport();
+  }
+  printf("%d frames from Alto (%d bad), %d frames to Alto in %.3f s\n", packetCount, badPacketCount, sentCount, wall);
+  printf("Transmit queue: %d deep, high water %d, %d dropped\n", txQueueDepth, txQueueHighWater, txQueueDrops);
+  if (txCollisions.counts[0] > 0) {
+    printf("Collisions: %llu, %llu retries\n", (unsigned long long)txCollisions.counts[0],
+        (unsigned long long)txRetries.counts[0]);
+  }
+  if (frames > 0 && wall > 0) {
+    printf("%.2f syscalls/frame\n", (double)syscalls / frames);
+    printf("%.0f frames/s, %.2f us CPU/frame, %.0f%% CPU\n", frames / wall, cpu * 1e6 / frames, cpu * 100 / wall);
+    if (pipelined) {
+      printf("CPU/frame by thread: %.2f us PRU, %.2f us codec, %.2f us socket\n",
+          pruCpu * 1e6 / frames, codecCpu * 1e6 / frames, socketCpu * 1e6 / frames);
+    }
+  }
+  echoReport(stdout, nowNs());
+  bootReport(&bootServer, stdout);
+  pipeReport(stdout);
+  if (backend == &simBackend) {
+    latencyReport(stdout);
+  }
+}
 
-// Receive packet from Alto
-void recvFromAlto() {
-  setLed(0, 1);
-  if (iface->r_truncated) {
-    fprintf(stderr, "Truncated packet received\n");
-    iface->r_truncated = 0;
-  }
-  if (iface->r_status != STATUS_INPUT_COMPLETE) {
-    fprintf(stderr, "Bad status %x\n", iface->r_status);
-    return;
+uint64_t nowNs() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Copy in the counts kept by the PRU and other modules.
+void updateMetrics() {
+  metricSet(&rxErrors, "ring full", rxDropped);
+  rxBadBits.counts[0] = decodeBadBits;
+  metricSet(&txErrors, "queue full", txQueueDrops);
+  if (txGivenUp > 0) {
+    metricSet(&txErrors, "collisions", txGivenUp);
+  }
+  if (txRestartLost > 0) {
+    metricSet(&txErrors, "pru restart", txRestartLost);
+  }
+  txQueueDepthGauge.value = txQueueDepth;
+  txQueueHighWaterGauge.value = txQueueHighWater;
+  if (bootServer.dir) {
+    metricSet(&bootFiles, "sent", bootServer.served);
+    metricSet(&bootFiles, "failed", bootServer.failed);
+    bootResent.counts[0] = bootServer.resent;
+  }
+}
+
+// Set up the interface blocks, at startup and after the firmware is
+// reloaded, and start both rings from the beginning. The firmware waits
+// for the receive descriptors before it takes a frame.
+void initIface() {
+  int i;
+  if (ifaceHandshake(txIface, 0) < 0 || (pruDual && ifaceHandshake(rxIface, 1) < 0)) {
+    exit(-1);
+  }
+  rxIface->r_buf_start = R_BUF_START;
+  rxIface->r_buf_end = R_BUF_END;
+  rxIface->r_max_length = pruDecode ? byteBufLen - 1 : MAX_DURATIONS;
+  rxIface->r_mode = pruDecode ? RECV_MODE_BYTES : RECV_MODE_DURATIONS;
+  rxIface->r_produced = 0;
+  rxIface->r_consumed = 0;
+  rxIface->r_dropped = 0;
+  rxIface->r_overrun = 0;
+  __sync_synchronize();
+  for (i = 0; i < RX_RING_SIZE; i++) {
+    rxIface->r_desc[i].owner = OWNER_PRU; // PRU can read into buffer
+  }
+
+  if (pruDual) {
+    txIface->r_mode = RECV_MODE_OFF; // PRU1 receives
+  }
+  txIface->w_gap = TX_GAP_NS;
+  txIface->w_mode = txMode;
+  for (i = 0; i < TX_RING_SIZE; i++) {
+    txIface->w_desc[i].owner = OWNER_ARM; // ARM can use write buffer
+    txIface->w_desc[i].buf = W_BUF_START + i * W_BUF_SIZE;
+  }
+  rxTail = txSlot = txDone = txBusy = 0;
+  txAttempts = txRetrying = 0;
+}
+
+// Give the firmware the interface version and wait for it to answer, so
+// a gateway and firmware built from different versions of iface.h stop
+// here rather than corrupt each other's RAM. Sleep rather than spin: in
+// real-time mode, the simulated PRU shares the core. Returns -1 if the
+// firmware doesn't answer.
+int ifaceHandshake(volatile struct iface *iface, int pru) {
+  struct timespec ts = { 0, 10000 };
+  uint64_t start = nowNs();
+  iface->version = IFACE_VERSION;
+  __sync_synchronize();
+  while (iface->version != IFACE_VERSION_OK) {
+    if (nowNs() - start > IFACE_WAIT_NS) {
+      fprintf(stderr, "PRU%d firmware doesn't answer interface version %#x; "
+          "build and install the gateway and the firmware together\n", pru, IFACE_VERSION);
+      return -1;
+    }
+    nanosleep(&ts, NULL);
+  }
+  return 0;
+}
+
+// Reload the firmware if a PRU's heartbeat has stood still for
+// PRU_STALL_NS. Called every time the main loop wakes up, which is at
+// least every WAIT_MS.
+void checkPru(uint64_t now) {
+  volatile struct iface *ifaces[PRU_EVENTS] = { txIface, rxIface };
+  int i;
+  rxDropped = rxDroppedBefore + rxIface->r_dropped;
+  for (i = 0; i < (pruDual ? PRU_EVENTS : 1); i++) {
+    uint32_t beat = ifaces[i]->heartbeat;
+    if (beat != pruBeats[i] || pruBeatNs[i] == 0) {
+      pruBeats[i] = beat;
+      pruBeatNs[i] = now;
+    } else if (now - pruBeatNs[i] >= PRU_STALL_NS) {
+      restartPru(now, i);
+      return;
+    }
   }
-  int r_length = iface->r_received_length;
-  if (r_length > durationBufLen) {
-    fprintf(stderr, "Received data too long %d vs %d\n", r_length, durationBufLen);
+}
+
+// Reload both PRUs' firmware and set up the interface again, keeping the
+// transmit queue. The frames in the transmit ring are lost, and so is
+// whatever the Alto sends meanwhile. If the reload fails, the gateway
+// exits for systemd to restart it.
+void restartPru(uint64_t now, int pru) {
+  uint64_t stalled = pruBeatNs[pru];
+  fprintf(stderr, "PRU%d stalled: no heartbeat for %.1f ms; reloading the firmware\n", pru, (now - stalled) / 1e6);
+  notifySend("STATUS=Reloading the stalled PRU firmware");
+  metricCount(&pruRestarts);
+  txRestartLost += txBusy;
+  rxDroppedBefore = rxDropped = rxDroppedBefore + rxIface->r_dropped;
+  if (backend->restart() < 0) {
+    exit(-1);
+  }
+  initIface();
+  memset(pruBeatNs, 0, sizeof(pruBeatNs));
+  lastClockSync = 0; // PRU0 restarted the IEP timer
+  fprintf(stderr, "PRU firmware reloaded in %.1f ms\n", (nowNs() - now) / 1e6);
+  notifySend("STATUS=Running");
+  firstFrameFrom = stalled;
+  firstFrameAfter = "the PRU stalled";
+  fillTxRing();
+}
+
+// A frame has gone through, one way or the other. Report how long the
+// first one after starting, or after a restart, took.
+void firstFrame() {
+  uint64_t now = nowNs();
+  fprintf(stderr, "First frame %.1f ms after %s", (now - firstFrameFrom) / 1e6, firstFrameAfter);
+  if (firstFrameFrom == gatewayStartNs) {
+    fprintf(stderr, ", %.3f s after boot", now / 1e9);
+  }
+  fprintf(stderr, "\n");
+  firstFrameFrom = 0;
+}
+
+// Real-time mode: poll for work for up to rtSpinNs before the main loop
+// blocks. The descriptors and the shared memory ring, or in pipelined
+// mode the rings from the other threads, are read every time round, and
+// the socket and timers, which take a syscall, every RT_POLL_NS through
+// spinEpollFd. The PRU's interrupts aren't taken while spinning: prussdrv
+// leaves the host interrupt masked after the first until the loop blocks
+// and clears it, so a stream of frames costs one interrupt instead of one
+// each. Returns nonzero as soon as there is something to do.
+int spinForWork() {
+  struct epoll_event ev;
+  uint64_t start = nowNs(), now = start, lastPoll = 0;
+  do {
+    if ((rxIface->r_desc[rxTail].owner == OWNER_ARM && (!pipelined || pipePeek(&rxFree) != NULL)) ||
+        (txBusy > 0 && !txRetrying && txIface->w_desc[txDone].owner == OWNER_ARM) ||
+        (pipelined && txBusy < TX_RING_SIZE && pipePeek(&txToPru) != NULL) ||
+        (!pipelined && shmPath && txQueueTail() != NULL && shmringPeek(shm.in) != NULL)) {
+      return 1;
+    }
+    if (now - lastPoll >= RT_POLL_NS) {
+      syscalls++;
+      if (epoll_wait(spinEpollFd, &ev, 1, 0) > 0) {
+        return 1;
+      }
+      lastPoll = now;
+    }
+    now = nowNs();
+  } while (now - start < rtSpinNs);
+  return 0;
+}
+
+// Real-time mode: run the main loop at SCHED_FIFO priority, so IFS or
+// anything else at normal priority, e.g. its garbage collector, can't hold
+// a frame up, with its memory locked and faulted in so paging can't either.
+// Only this thread is made real-time. Failures are reported, and the
+// gateway carries on without.
+void startRealTime() {
+  struct sched_param param;
+  memset(&param, 0, sizeof(param));
+  param.sched_priority = RT_PRIORITY;
+  if (sched_setscheduler(0, SCHED_FIFO, &param) < 0) {
+    perror("sched_setscheduler");
+  }
+  // Locking faults in everything mapped so far, such as the static
+  // buffers, and anything mapped later as it is mapped.
+  if (mlockall(MCL_CURRENT | MCL_FUTURE) < 0) {
+    perror("mlockall");
+  }
+  prefaultStack();
+}
+
+// Grow the stack as deep as the main loop might take it, so it is locked
+// in now instead of faulted in later.
+void prefaultStack() {
+  uint8_t stack[RT_STACK_BYTES];
+  memset(stack, 0, sizeof(stack));
+  __asm__ volatile("" : : "r"(stack) : "memory"); // Keep the memset
+}
+
+// Map the PRU's IEP timer to CLOCK_MONOTONIC for the stage latencies, when
+// it is due. A read of the timer that was held up, e.g. by preemption, is
+// tried again at the next wakeup.
+void syncPruClock(uint64_t now) {
+  if (now - lastClockSync < LATENCY_SYNC_NS) {
     return;
   }
-  memcpy(durationBuf, (uint8_t *) r_ptr, r_length);
+  uint64_t before = nowNs();
+  uint32_t iep = backend->iepNow();
+  if (latencyClockSync(iep, before, nowNs())) {
+    lastClockSync = now;
+  }
+}
+
+// Write the metrics file and summarize errors on stderr when they are due.
+void metricsTick(uint64_t now) {
+  if (lastSummary == 0) {
+    lastSummary = lastMetricsWrite = now;
+  }
+  if (now - lastSummary >= METRICS_SUMMARY_S * 1000000000ULL) {
+    updateMetrics();
+    metricsSummary(stderr, (now - lastSummary) / 1000000000);
+    lastSummary = now;
+  }
+  if (metricsPath && now - lastMetricsWrite >= METRICS_WRITE_S * 1000000000ULL) {
+    updateMetrics();
+    metricsWrite(metricsPath);
+    lastMetricsWrite = now;
+  }
+}
+
+// Receive packet from Alto
+// The packet is decoded in place in the PRU's receive buffer, then the
+// descriptor and its part of the buffer are handed back to the PRU.
+// The UDP datagram is sent by the next flushToUdp().
+void recvFromAlto(volatile struct rx_desc *desc) {
+  uint8_t *udpBuf = udpOutBufs[udpOutCount];
+  uint8_t *byteBuf = udpBuf + 2; // Packet bytes
+  int r_length = desc->length;
+  uint32_t status = desc->status;
+  struct rxTimes times;
+  uint64_t handed = rxTimestamps(desc, &times);
+  // Durations may wrap around the end of the receive buffer
+  uint8_t *start = (uint8_t *)dataram + R_BUF_START;
+  uint8_t *durations = (uint8_t *)dataram + desc->offset;
+  int len1 = R_BUF_END - desc->offset;
+  if (len1 > r_length) {
+    len1 = r_length;
+  }
+  int decodedLen = decodeFromAlto(durations, len1, start, r_length - len1, &status, byteBuf, &times);
+  captureFromAlto(desc->status, desc->timestamp, durations, len1, start, r_length - len1, byteBuf, decodedLen);
 
   // Ready for next packet
-  iface->r_owner = OWNER_PRU;
+  releaseRxDesc(desc, handed);
+  forwardFromAlto(udpBuf, decodedLen, status, decodeError, &times);
+}
 
+// Start a frame's times from its descriptor, and record how long it took
+// on the wire and to wake the gateway. Returns when the PRU handed it
+// over, or 0 if the IEP timer isn't mapped.
+uint64_t rxTimestamps(volatile struct rx_desc *desc, struct rxTimes *times) {
+  uint64_t endNs = 0;
+  times->sync = times->decoded = 0;
+  times->wake = wakeNs;
+  if (latencyPruNs(desc->timestamp, wakeNs, &times->sync)) {
+    latencyPruNs(desc->end, wakeNs, &endNs);
+    latencyRecord(&latRxWire, times->sync, endNs);
+    latencyRecord(&latRxWake, endNs, wakeNs);
+  }
+  return endNs;
+}
+
+// Hand a receive descriptor and its part of the buffer back to the PRU.
+// handed is when the PRU handed it over, or 0 if that isn't known.
+void releaseRxDesc(volatile struct rx_desc *desc, uint64_t handed) {
+  rxIface->r_consumed += desc->length;
+  __sync_synchronize();
+  desc->owner = OWNER_PRU;
+  if (handed) {
+    latencyRecord(&latRxRelease, handed, nowNs());
+  }
+}
+
+// Decode a frame from the Alto into bytes: its durations, or with
+// pruDecode the bytes the PRU decoded, split in two where they wrap.
+// *status is the descriptor's; with pruDecode it becomes
+// STATUS_INPUT_COMPLETE, as the PRU's errors are counted by reason too.
+// Returns the length in bytes or -1, with the reason in decodeError.
+int decodeFromAlto(const uint8_t *d1, int len1, const uint8_t *d2, int len2, uint32_t *status,
+    uint8_t *bytes, struct rxTimes *times) {
+  static int sample; // Good frames since the pulse widths were last counted
+  int decodedLen = -1;
+  if (pruDecode && (*status & ~0xff) == STATUS_INPUT_COMPLETE) {
+    uint64_t decodeStart = nowNs();
+    decodedLen = checkPruBytes(d1, len1, d2, len2, *status, bytes);
+    times->decoded = nowNs();
+    metricObserve(&decodeNs, times->decoded - decodeStart);
+    *status = STATUS_INPUT_COMPLETE; // Errors are counted by reason
+  } else if (*status == STATUS_INPUT_COMPLETE) {
+    uint64_t decodeStart = nowNs();
+    decodedLen = decodeFn(d1, len1, d2, len2, bytes, byteBufLen);
+    times->decoded = nowNs();
+    metricObserve(&decodeNs, times->decoded - decodeStart);
+    if (decodedLen < 0 || sample++ % PULSE_SAMPLE == 0) {
+      metricPulseWidths(d1, len1);
+      metricPulseWidths(d2, len2);
+    }
+  }
+  if (times->decoded) {
+    latencyRecord(&latRxDecode, times->wake, times->decoded);
+  }
+  return decodedLen;
+}
+
+// Capture a frame from the Alto, with its durations unless the PRU
+// decoded it.
+void captureFromAlto(uint32_t status, uint32_t timestamp, const uint8_t *d1, int len1,
+    const uint8_t *d2, int len2, const uint8_t *bytes, int decodedLen) {
+  int flags = decodedLen < 0 ? CAPTURE_BAD_FRAME : 0;
+  if (pruDecode) {
+    captureRecord(CAPTURE_FROM_ALTO, flags, status, timestamp, NULL, 0, NULL, 0, bytes, decodedLen < 0 ? 0 : decodedLen);
+  } else if (len1 + len2 > 0) {
+    captureRecord(CAPTURE_FROM_ALTO, flags, status, timestamp, d1, len1, d2, len2, bytes, decodedLen < 0 ? 0 : decodedLen);
+  }
+}
+
+// Count a decoded frame from the Alto, or the reason it was lost, and pass
+// it on: to the echo responder or the boot server if it is theirs,
+// otherwise over UDP or the shared memory ring. udpBuf has room for the
+// UDP length word before the frame.
+void forwardFromAlto(uint8_t *udpBuf, int decodedLen, uint32_t status, const char *error,
+    const struct rxTimes *times) {
+  uint8_t *byteBuf = udpBuf + 2; // Packet bytes
+  if (status != STATUS_INPUT_COMPLETE) {
+    metricAdd(&rxErrors, status == STATUS_INPUT_OVERRUN ? "overrun" : "bad status", 1);
+    return;
+  }
   packetCount++;
-  int decodedLen = decode(r_length);
   if (decodedLen < 0) {
     badPacketCount++;
-    fprintf(stderr, "Received bad data %d:\n", iface->r_received_length);
-    fprintf(stderr, "%d packets, %d bad\n", packetCount, badPacketCount);
+    metricAdd(&rxErrors, error, 1);
+    DPRINTF("Received bad data: %s\n", error);
+    return;
+  }
+  if (firstFrameFrom && !pipelined) {
+    firstFrame();
+  }
+  if (echoHost && byteBuf[0] == echoHost) {
+    echoReceive(byteBuf, decodedLen - 2, wakeNs);
+    return;
+  }
+  if (bootReceive(&bootServer, byteBuf, decodedLen - 2, wakeNs)) {
+    return;
+  }
+  int batch;
+  struct sockaddr_in *dest = forwardToUdp(byteBuf, &batch);
+  if (dest == NULL) {
     return;
   }
+  metricCount(&rxFrames);
+  metricObserve(&rxFrameBytes, decodedLen);
   if (logging) {
     fprintf(logFile, "recvFromAlto: %d bytes\n", decodedLen);
     int i;
@@ -271,173 +1122,734 @@ void recvFromAlto() {
   int wordLength = (decodedLen + 1) / 2 - 1; // Subtract 1 for Ether CRC
   udpBuf[0] = wordLength >> 8;
   udpBuf[1] = wordLength & 0xff;
-  if (sendto(sendSock, udpBuf, decodedLen + 2, 0, (struct sockaddr *)&s_send, sizeof(struct sockaddr_in)) < 0) {
-    perror("send");
+  if (shmPath && shmAttached(wakeNs)) {
+    sendToRing(udpBuf, wordLength * 2 + 2, times);
+    return;
+  }
+  if (batch && batchWindowNs > 0) {
+    batchFrame(dest, udpBuf, wordLength * 2 + 2, times);
+    return;
+  }
+  if (udpBuf != udpOutBufs[udpOutCount]) {
+    memcpy(udpOutBufs[udpOutCount], udpBuf, decodedLen + 2);
+  }
+  udpOutIov[udpOutCount].iov_len = decodedLen + 2;
+  udpOutAddrs[udpOutCount] = *dest;
+  udpOutTimes[udpOutCount] = *times;
+  if (++udpOutCount == UDP_BATCH) {
+    flushToUdp();
   }
 }
 
-// Send packet to Alto
-// This delivers the packet to the PRU, which will start sending.
-void sendToAlto() {
-  if (iface->w_owner != OWNER_ARM) {
-    // Shouldn't happen
-    fprintf(stderr, "sendToAlto called while not ready.\n");
+// Nonzero if IFS is attached to the shared memory transport. An IFS that
+// died without detaching would leave frames from the Alto filling a ring
+// nobody reads, so at most every SHM_CHECK_NS, check that its pid is still
+// running, and detach it if not.
+int shmAttached(uint64_t now) {
+  uint32_t pid = shm.file->attached;
+  if (pid != 0 && now - shmCheckedNs >= SHM_CHECK_NS) {
+    shmCheckedNs = now;
+    if (kill(pid, 0) < 0 && errno == ESRCH) {
+      fprintf(stderr, "IFS (pid %u) exited without detaching from %s; sending frames from the Alto over UDP\n",
+          pid, shmPath);
+      // Unless another IFS has attached meanwhile
+      __sync_bool_compare_and_swap(&shm.file->attached, pid, 0);
+      return 0;
+    }
+  }
+  return pid != 0;
+}
+
+// Learn where a frame from the wire came from, and find where to send it:
+// the destination host's UDP address if it is known, or the flood address
+// (s_send) for broadcasts and unknown hosts. Returns NULL for a host on
+// the wire, which has had the frame already.
+// *batch is set if the destination takes batched datagrams.
+struct sockaddr_in *forwardToUdp(const uint8_t *frame, int *batch) {
+  struct fwdEntry *entry;
+  *batch = 0;
+  if (fwdFlood) {
+    return &s_send;
+  }
+  fwdLearnWire(frame[1], wakeNs);
+  if (frame[0] == FWD_BROADCAST) {
+    metricAdd(&fwdLookups, "broadcast", 1);
+    return &s_send;
+  }
+  switch (fwdLookup(frame[0], wakeNs, &entry)) {
+  case FWD_UDP:
+    metricAdd(&fwdLookups, "known", 1);
+    *batch = entry->batch;
+    return &entry->addr;
+  case FWD_WIRE:
+    metricAdd(&fwdLookups, "known", 1);
+    metricAdd(&fwdFiltered, "to udp", 1);
+    return NULL;
+  default:
+    metricAdd(&fwdLookups, "unknown", 1);
+    return &s_send;
+  }
+}
+
+// Learn where a datagram came from, and decide whether its frame goes on
+// the wire: not if the destination host is on the UDP side.
+int forwardToAlto(const uint8_t *frame, const struct sockaddr_in *from, int batch) {
+  struct fwdEntry *entry;
+  if (fwdFlood) {
+    return 1;
+  }
+  fwdLearnUdp(frame[1], from, batch, wakeNs);
+  if (frame[0] == FWD_BROADCAST) {
+    metricAdd(&fwdLookups, "broadcast", 1);
+    return 1;
+  }
+  switch (fwdLookup(frame[0], wakeNs, &entry)) {
+  case FWD_UDP:
+    metricAdd(&fwdLookups, "known", 1);
+    metricAdd(&fwdFiltered, "to alto", 1);
+    return 0;
+  case FWD_WIRE:
+    metricAdd(&fwdLookups, "known", 1);
+    return 1;
+  default:
+    metricAdd(&fwdLookups, "unknown", 1);
+    return 1;
+  }
+}
+
+// Copy a frame the PRU decoded in RECV_MODE_BYTES out of the receive ring,
+// and check what the PRU doesn't: the length and the CRC. The bytes may be
+// split in two where they wrap, like durations.
+// Return length in bytes or -1 for error, with the reason in decodeError.
+int checkPruBytes(const uint8_t *b1, int len1, const uint8_t *b2, int len2, uint32_t status, uint8_t *bytes) {
+  int len = len1 + len2;
+  if (status & STATUS_TIMING_ERROR) {
+    decodeError = "bad width";
+    return -1;
+  }
+  if (status & STATUS_BIT_INCOMPLETE) {
+    decodeError = "bad offset2";
+    return -1;
+  }
+  if (len < 2) {
+    decodeError = "short frame";
+    return -1;
+  }
+  memcpy(bytes, b1, len1);
+  memcpy(bytes + len1, b2, len2);
+  uint16_t crcVal = crc(bytes, (len - 2) / 2);
+  uint16_t readCrcVal = (bytes[len - 2] << 8) | bytes[len - 1];
+  if (crcVal != readCrcVal) {
+    decodeError = "bad CRC";
+    return -1;
+  }
+  return len;
+}
+
+// Send the datagrams from recvFromAlto() in as few syscalls as possible.
+void flushToUdp() {
+  int sent = 0;
+  while (sent < udpOutCount) {
+    int n = sendmmsg(sendSock, udpOutMsgs + sent, udpOutCount - sent, 0);
+    syscalls++;
+    if (n < 0) {
+      perror("send");
+      metricAdd(&rxErrors, "udp send", udpOutCount - sent);
+      break;
+    }
+    sent += n;
+  }
+  if (sent > 0) {
+    uint64_t now = nowNs();
+    int i;
+    for (i = 0; i < sent; i++) {
+      metricObserve(&rxLatencyNs, now - udpOutTimes[i].wake);
+      recordRxSent(&udpOutTimes[i], now);
+    }
+  }
+  udpOutCount = 0;
+}
+
+// Record the last stages of a frame from the Alto, sent to IFS at sent.
+void recordRxSent(const struct rxTimes *times, uint64_t sent) {
+  latencyRecord(&latRxSend, times->decoded, sent);
+  if (times->sync) {
+    latencyRecord(&latRxTotal, times->sync, sent);
+  }
+}
+
+// Add a frame, in the single-frame format, to the batch for dest, first
+// sending the open batch if the frame is for another peer or won't fit.
+// A new batch is sent after batchWindowNs at the latest.
+void batchFrame(const struct sockaddr_in *dest, const uint8_t *udpBuf, int len, const struct rxTimes *times) {
+  if (batchLen > 0 && (batchDest.sin_addr.s_addr != dest->sin_addr.s_addr ||
+      batchDest.sin_port != dest->sin_port || batchLen + len > UDP_BATCH_MAX_BYTES)) {
+    flushBatch();
+  }
+  if (batchLen == 0) {
+    struct itimerspec its;
+    memset(&its, 0, sizeof(its));
+    its.it_value.tv_sec = batchWindowNs / 1000000000;
+    its.it_value.tv_nsec = batchWindowNs % 1000000000;
+    if (timerfd_settime(batchTimerFd, 0, &its, NULL) < 0) {
+      perror("timerfd_settime");
+    }
+    syscalls++;
+    batchDest = *dest;
+    batchLen = 2;
+    batchFrames = 0;
+  }
+  memcpy(batchBuf + batchLen, udpBuf, len);
+  batchLen += len;
+  batchTimes[batchFrames++] = *times;
+}
+
+// Send the open batch, if any.
+void flushBatch() {
+  if (batchLen == 0) {
     return;
   }
+  batchBuf[0] = (UDP_BATCH_FLAG | batchFrames) >> 8;
+  batchBuf[1] = batchFrames & 0xff;
+  if (sendto(sendSock, batchBuf, batchLen, 0, (struct sockaddr *)&batchDest, sizeof(batchDest)) < 0) {
+    perror("send");
+    metricAdd(&rxErrors, "udp send", batchFrames);
+  } else {
+    uint64_t now = nowNs();
+    int i;
+    metricAdd(&udpBatches, "to udp", 1);
+    for (i = 0; i < batchFrames; i++) {
+      recordRxSent(&batchTimes[i], now);
+    }
+  }
+  syscalls++;
+  batchLen = 0;
+}
 
-  // Read data from socket
-  struct sockaddr_storage src_addr;
-  socklen_t src_addr_len = sizeof(src_addr);
-  ssize_t count = recvfrom(recvSock, udpBuf, byteBufLen + 2, 0 /* flags */, (struct sockaddr *)&src_addr, &src_addr_len);
-  if (count == -1) {
-    perror("recvfrom");
+// Pass a frame from the Alto, in the UDP format, to the local IFS.
+void sendToRing(const uint8_t *udpBuf, int len, const struct rxTimes *times) {
+  volatile struct shmringSlot *slot = shmringReserve(shm.out);
+  if (slot == NULL) {
+    metricAdd(&rxErrors, "shm ring full", 1);
     return;
-  } 
+  }
+  memcpy((uint8_t *)slot->data, udpBuf, len);
+  slot->length = len;
+  if (shmringPublish(shm.out)) {
+    shmringRing(shm.bellOut);
+    syscalls++;
+  }
+  recordRxSent(times, nowNs());
+}
 
-  int wordLength = (udpBuf[0] << 8) | udpBuf[1];
-  uint16_t crcVal = crc(byteBuf, wordLength);
-  byteBuf[wordLength * 2] = crcVal >> 8;
-  byteBuf[wordLength * 2 + 1] = crcVal & 0xff;
+// Queue the frames the local IFS has put in the ring, as many as the
+// transmit queue has room for. The rest wait in the ring, which holds IFS
+// back instead of dropping them.
+void recvFromRing() {
+  volatile struct shmringSlot *slot;
+  while (txQueueTail() != NULL && (slot = shmringPeek(shm.in)) != NULL) {
+    int len = slot->length;
+    if (len > SHMRING_FRAME_BYTES) {
+      len = 0; // Counted as a bad length
+    }
+    queueForAlto((uint8_t *)slot->data, len, &shmFrom, 0);
+    shmringRelease(shm.in);
+  }
+}
+
+// Send packets to Alto
+// Reads every datagram waiting on the UDP socket, a batch at a time, and
+// queues them. fillTxRing(), or in pipelined mode feedCodec(), passes them
+// on to the PRU.
+void sendToAlto() {
+  int n, i;
+  do {
+    for (i = 0; i < UDP_BATCH; i++) {
+      udpInMsgs[i].msg_hdr.msg_namelen = sizeof(udpInAddrs[i]);
+    }
+    n = recvmmsg(recvSock, udpInMsgs, UDP_BATCH, MSG_DONTWAIT, NULL);
+    syscalls++;
+    if (n < 0) {
+      if (errno != EAGAIN && errno != EWOULDBLOCK) {
+        perror("recvmmsg");
+      }
+      return;
+    }
+    for (i = 0; i < n; i++) {
+      if (udpInMsgs[i].msg_len >= 2 && udpInBufs[i][0] & (UDP_BATCH_FLAG >> 8)) {
+        splitBatch(udpInBufs[i], udpInMsgs[i].msg_len, &udpInAddrs[i]);
+      } else {
+        queueForAlto(udpInBufs[i], udpInMsgs[i].msg_len, &udpInAddrs[i], 0);
+      }
+    }
+    if (pipelined) {
+      feedCodec();
+    } else {
+      fillTxRing();
+    }
+  } while (n == UDP_BATCH);
+}
+
+// Queue each frame of a batched datagram.
+void splitBatch(uint8_t *udpBuf, int count, const struct sockaddr_in *from) {
+  int frames = ((udpBuf[0] << 8) | udpBuf[1]) & ~UDP_BATCH_FLAG;
+  int pos = 2;
+  metricAdd(&udpBatches, "from udp", 1);
+  while (frames-- > 0) {
+    int len = pos + 2 <= count ? 2 + 2 * ((udpBuf[pos] << 8) | udpBuf[pos + 1]) : 0;
+    if (len == 0 || pos + len > count) {
+      metricAdd(&txErrors, "bad length", 1);
+      DPRINTF("Bad batched UDP packet: %d bytes, frame at %d\n", count, pos);
+      return;
+    }
+    queueForAlto(udpBuf + pos, len, from, 1);
+    pos += len;
+  }
+}
+
+// Add the CRC to a packet from UDP and put it on the transmit queue.
+// batch is set if it came in a batched datagram.
+void queueForAlto(uint8_t *udpBuf, int count, const struct sockaddr_in *from, int batch) {
+  uint8_t *byteBuf = udpBuf + 2; // Packet bytes
+  struct txFrame *frame = txQueueTail();
+  if (frame == NULL) {
+    txQueueDrops++;
+    return;
+  }
+  // The datagram must hold as many words as it says, or the rest would
+  // come from whatever the buffer held before.
+  int wordLength = count < 2 ? 0 : (udpBuf[0] << 8) | udpBuf[1];
+  if (count < 2 || count < wordLength * 2 + 2 || wordLength * 2 + 2 > MAX_PUP_LENGTH) {
+    metricAdd(&txErrors, "bad length", 1);
+    DPRINTF("Bad UDP packet: %d bytes, length %d words\n", count, wordLength);
+    return;
+  }
+  if (wordLength > 0 && !forwardToAlto(byteBuf, from, batch)) {
+    return;
+  }
+  // The CRC goes after the copy: in a batched datagram, the next frame
+  // follows this one.
+  memcpy(frame->data, byteBuf, wordLength * 2);
+  uint16_t crcVal = crc(frame->data, wordLength);
+  frame->data[wordLength * 2] = crcVal >> 8;
+  frame->data[wordLength * 2 + 1] = crcVal & 0xff;
   wordLength += 1;
-  memcpy((uint8_t *) w_ptr, byteBuf, wordLength * 2);
-  iface->w_length = wordLength * 2;
+  frame->length = wordLength * 2;
+  frame->queuedNs = wakeNs;
+  txQueuePush();
+  captureRecord(CAPTURE_TO_ALTO, 0, 0, 0, NULL, 0, NULL, 0, frame->data, frame->length);
   if (logging) {
     fprintf(logFile, "sendToAlto: %d words\n", wordLength);
     int i;
     for (i = 0; i < wordLength*2; i++) {
-      fprintf(logFile, "%02x ", w_ptr[i]);
+      fprintf(logFile, "%02x ", frame->data[i]);
     }
     fprintf(logFile, "\n");
   }
   if (verbose || debug) {
-    printf("Sending to Alto: len %d\n", wordLength);
+    printf("Sending to Alto: len %d, queue %d\n", wordLength, txQueueDepth);
   }
-  // Signal PRU to send the data in the write buffer.
-  iface->w_owner = OWNER_PRU;
-}
-
-// Decode timings from PRU into bytes.
-// Return length in bytes or -1 for error
-int decode(int len) {
-  // Convert timings in durationBuf into high/low vector in bitBuf
-  // bitBuf holds values like 1, 0, 0, 1, 0, 1, indicating if the input
-  // was high or low during that time interval.
-  // A Manchester-encoded data bit consists of two values in bitBuf.
-  int offset1; // Offset into timing vector
-  int offset2 = 0; // Offset into bit vector
-  int value = 1; // Current high/low value
-  for (offset1 = 0; offset1 < len; offset1++) {
-    int width = durationBuf[offset1] * RECV_WIDTH;
-    if (width < 120) {
-      fprintf(stderr, "Bad width %d at %d of %d\n", width, offset1, len);
-      return -1;
-    } else if (width < 230) {
-      value = !value;
-      bitBuf[offset2++] = value;
-    } else if (width < 280) {
-      fprintf(stderr, "Bad width %d at %d of %d\n", width, offset1, len);
-      return -1;
-    } else if (width < 400) {
-      value = !value;
-      bitBuf[offset2++] = value;
-      bitBuf[offset2++] = value;
+}
+
+// Move queued packets into free transmit descriptors. The PRU sends them
+// in order, so the descriptors are filled in order too. In pipelined mode
+// they come from the codec thread, already encoded.
+void fillTxRing() {
+  struct txFrame *frame;
+  reapTxRing();
+  if (pipelined) {
+    pipeFillTxRing();
+    return;
+  }
+  while ((frame = txQueueHead()) != NULL && txBusy < TX_RING_SIZE) {
+    volatile struct tx_desc *desc = &txIface->w_desc[txSlot];
+    if (txMode == TX_MODE_HALF_BITS) {
+      desc->length = encodeHalfBits(frame->data, frame->length, (uint8_t *)dataram + desc->buf, W_BUF_SIZE);
     } else {
-      fprintf(stderr, "Bad width %d at %d of %d\n", width, offset1, len);
-      return -1;
+      memcpy((uint8_t *)dataram + desc->buf, frame->data, frame->length);
+      desc->length = frame->length;
     }
+    startTx(desc, frame->length, frame->queuedNs);
+    txQueuePop();
   }
+}
 
-  // Convert bit pairs in bitBuf to bytes in byteBuf
-  uint8_t byte = 0;
-  int byteCount = 0;
-  int i;
-  if ((offset2 % 2) == 0) {
-    // For a 0 bit, the last 1 signal gets combined with the no-signal state and lost.
-    // So add it back.
-    bitBuf[offset2] = 1;
-    offset2 += 1;
-  }
-  // Start at 1 to skip sync
-  for (i = 1; i < offset2; i += 2) {
-    if (bitBuf[i] == bitBuf[i+1]) {
-      fprintf(stderr, "Bad bit sequence at %d of %d: %d %d\n", i, offset2, bitBuf[i], bitBuf[i+1]);
-      byte = byte << 1;
-    } else {
-      byte = (byte << 1) | bitBuf[i];
+// Pass the frame just put in the next transmit descriptor, of length
+// bytes, to the PRU.
+void startTx(volatile struct tx_desc *desc, int length, uint64_t queuedNs) {
+  txQueuedNs[txSlot] = queuedNs;
+  txHandedNs[txSlot] = nowNs();
+  latencyRecord(&latTxQueue, txQueuedNs[txSlot], txHandedNs[txSlot]);
+  txBytes[txSlot] = length;
+  // Signal PRU to send the data in the write buffer.
+  __sync_synchronize();
+  desc->owner = OWNER_PRU;
+  txSlot = (txSlot + 1) % TX_RING_SIZE;
+  txBusy++;
+}
+
+// Free the descriptors the PRU has finished with, in order, counting the
+// frames that went out. On a collision, start the backoff before the
+// frame is sent again.
+void reapTxRing() {
+  while (txBusy > 0 && !txRetrying && txIface->w_desc[txDone].owner == OWNER_ARM) {
+    volatile struct tx_desc *desc = &txIface->w_desc[txDone];
+    __sync_synchronize();
+    if (desc->status & STATUS_BIT_COLLISION) {
+      metricCount(&txCollisions);
+      if (++txAttempts < TX_MAX_ATTEMPTS) {
+        int shift = txAttempts < TX_BACKOFF_LIMIT ? txAttempts : TX_BACKOFF_LIMIT;
+        uint64_t backoff = (uint64_t)(rand() & ((1 << shift) - 1)) * TX_SLOT_NS;
+        DPRINTF("Collision %d, retry in %llu ns\n", txAttempts, (unsigned long long)backoff);
+        struct itimerspec its;
+        memset(&its, 0, sizeof(its));
+        its.it_value.tv_sec = backoff / 1000000000;
+        its.it_value.tv_nsec = backoff % 1000000000 + 1; // 0 would disarm it
+        txRetrying = 1;
+        if (timerfd_settime(txRetryFd, 0, &its, NULL) < 0) {
+          perror("timerfd_settime");
+          retryTx();
+        }
+        return;
+      }
+      // Give up: the PRU passes over a descriptor with no length.
+      txGivenUp++;
+      txAttempts = 0;
+      desc->length = 0;
+      __sync_synchronize();
+      desc->owner = OWNER_PRU;
+      return;
+    }
+    uint64_t startNs, endNs;
+    if (desc->length != 0) {
+      sentCount++;
+      metricCount(&txFrames);
+      metricObserve(&txFrameBytes, txBytes[txDone]);
+    }
+    if (firstFrameFrom && desc->length != 0) {
+      firstFrame();
     }
-    if ((i % 16) == 15) {
-      byteBuf[byteCount++] = byte;
-      if (byteCount >= byteBufLen) {
-        fprintf(stderr, "Buffer overflow\n");
-	return -1;
+    if (desc->length != 0 && latencyPruNs(desc->start, wakeNs, &startNs)) {
+      latencyPruNs(desc->end, wakeNs, &endNs);
+      latencyRecord(&latTxDefer, txHandedNs[txDone], startNs);
+      latencyRecord(&latTxWire, startNs, endNs);
+      latencyRecord(&latTxTotal, txQueuedNs[txDone], endNs);
+    }
+    txAttempts = 0;
+    txDone = (txDone + 1) % TX_RING_SIZE;
+    txBusy--;
+  }
+}
+
+// The backoff is over: pass the collided frame back to the PRU.
+void retryTx() {
+  uint64_t expirations;
+  if (read(txRetryFd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN) {
+    perror("timerfd read");
+  }
+  if (!txRetrying) {
+    return;
+  }
+  txRetrying = 0;
+  metricCount(&txRetries);
+  __sync_synchronize();
+  txIface->w_desc[txDone].owner = OWNER_PRU;
+}
+
+// Pipelined mode: set up the rings, put the pools' buffers in the free
+// ones, and start the codec and socket threads. The PRU stage's doorbell
+// goes in the main loop's epoll set, and the socket thread's in its own,
+// ioEpollFd, with the sockets.
+void pipeStart(int epollFd, int ioEpollFd) {
+  struct epoll_event ev;
+  int i;
+  pruBell = pipeBellOpen();
+  codecBell = pipeBellOpen();
+  socketBell = pipeBellOpen();
+  if (pruBell < 0 || codecBell < 0 || socketBell < 0) {
+    exit(-1);
+  }
+  pipeRingInit(&rxToCodec, codecBell);
+  pipeRingInit(&rxToSocket, socketBell);
+  pipeRingInit(&rxFree, pruBell);
+  pipeRingInit(&txToCodec, codecBell);
+  pipeRingInit(&txToPru, pruBell);
+  pipeRingInit(&txFree, socketBell);
+  for (i = 0; i < PIPE_RX_FRAMES; i++) {
+    pipePush(&rxFree, &rxPool[i]);
+  }
+  for (i = 0; i < PIPE_TX_FRAMES; i++) {
+    pipePush(&txFree, &txPool[i]);
+  }
+  memset(&ev, 0, sizeof(ev));
+  ev.events = EPOLLIN;
+  ev.data.fd = pruBell;
+  if (epoll_ctl(epollFd, EPOLL_CTL_ADD, pruBell, &ev) < 0) {
+    perror("epoll");
+    exit(-1);
+  }
+  ev.data.fd = socketBell;
+  if (epoll_ctl(ioEpollFd, EPOLL_CTL_ADD, socketBell, &ev) < 0) {
+    perror("epoll");
+    exit(-1);
+  }
+  socketEpollFd = ioEpollFd;
+  if (pthread_create(&codecThread, NULL, codecMain, NULL) != 0 ||
+      pthread_create(&socketThread, NULL, socketMain, NULL) != 0) {
+    fprintf(stderr, "Can't start pipeline threads\n");
+    exit(-1);
+  }
+}
+
+// Once the main loop is done, have the threads finish the frames passed
+// over to them, in pipeline order, and wait for them.
+void pipeStop() {
+  codecStopping = 1;
+  __sync_synchronize();
+  pipeBellRing(codecBell);
+  pthread_join(codecThread, NULL);
+  socketStopping = 1;
+  __sync_synchronize();
+  pipeBellRing(socketBell);
+  pthread_join(socketThread, NULL);
+}
+
+// PRU stage: copy each frame the PRU has handed over into a buffer from
+// the pool, give the descriptor straight back, and pass the frame to the
+// codec thread. If no buffer is free, the rest wait in the receive ring
+// until the socket thread gives one back. Returns the frames taken.
+int pipeTakeRx() {
+  int taken = 0;
+  while (rxIface->r_desc[rxTail].owner == OWNER_ARM) {
+    volatile struct rx_desc *desc = &rxIface->r_desc[rxTail];
+    struct rxPipeFrame *f = pipePeek(&rxFree);
+    if (f == NULL) {
+      if (!rxWaiting) {
+        rxStarved++;
+        rxWaiting = 1;
       }
-      byte = 0;
+      break;
+    }
+    pipePop(&rxFree);
+    rxWaiting = 0;
+    ledActivity(LED_RX);
+    uint64_t handed = rxTimestamps(desc, &f->times);
+    f->length = desc->length;
+    f->pruStatus = desc->status;
+    f->timestamp = desc->timestamp;
+    if (f->length > (int)sizeof(f->raw)) {
+      f->length = sizeof(f->raw); // r_max_length keeps it shorter
+    }
+    // Durations may wrap around the end of the receive buffer
+    int len1 = R_BUF_END - desc->offset;
+    if (len1 > f->length) {
+      len1 = f->length;
     }
+    memcpy(f->raw, (uint8_t *)dataram + desc->offset, len1);
+    memcpy(f->raw + len1, (uint8_t *)dataram + R_BUF_START, f->length - len1);
+    releaseRxDesc(desc, handed);
+    if (firstFrameFrom && (f->pruStatus & ~0xff) == STATUS_INPUT_COMPLETE) {
+      firstFrame();
+    }
+    pipePush(&rxToCodec, f);
+    rxTail = (rxTail + 1) % RX_RING_SIZE;
+    taken++;
   }
-  if ((offset2 % 16) != 1) {
-    fprintf(stderr, "Bad offset2: %d\n", offset2);
-    return -1;
+  return taken;
+}
+
+// PRU stage: copy frames the codec thread has encoded into free transmit
+// descriptors, and give their buffers back to the socket thread.
+void pipeFillTxRing() {
+  struct txPipeFrame *f;
+  if (txBusy < TX_RING_SIZE && pipePeek(&txToPru) != NULL) {
+    metricObserve(&pipeTxDepth, pipeDepth(&txToPru));
   }
+  while (txBusy < TX_RING_SIZE && (f = pipePeek(&txToPru)) != NULL) {
+    volatile struct tx_desc *desc = &txIface->w_desc[txSlot];
+    if (txMode == TX_MODE_HALF_BITS) {
+      memcpy((uint8_t *)dataram + desc->buf, f->encoded, (f->halfBits + 7) / 8);
+      desc->length = f->halfBits;
+    } else {
+      memcpy((uint8_t *)dataram + desc->buf, f->data, f->length);
+      desc->length = f->length;
+    }
+    startTx(desc, f->length, f->queuedNs);
+    pipePop(&txToPru);
+    pipePush(&txFree, f);
+  }
+}
 
-  // Check the Ethernet CRC
-  uint16_t crcVal = crc(byteBuf, (byteCount - 2) / 2);
-  uint16_t readCrcVal = (byteBuf[byteCount - 2] << 8) | byteBuf[byteCount - 1];
-  if (crcVal != readCrcVal) {
-    fprintf(stderr, "Bad CRC %04x vs %04x\n", crcVal, readCrcVal);
-    return -1;
+// PRU stage: about to wait. Returns 0 if the other threads have passed
+// over something that can be taken now: an encoded frame with a transmit
+// descriptor free, or a buffer for a frame waiting in the receive ring.
+int pruSleep() {
+  return (txBusy == TX_RING_SIZE || pipeSleep(&txToPru)) && (!rxWaiting || pipeSleep(&rxFree));
+}
+
+// Socket thread: pass frames from the transmit queue to the codec thread,
+// as many as there are buffers for. The rest wait in the queue.
+void feedCodec() {
+  struct txFrame *frame;
+  struct txPipeFrame *f;
+  while ((frame = txQueueHead()) != NULL && (f = pipePeek(&txFree)) != NULL) {
+    pipePop(&txFree);
+    memcpy(f->data, frame->data, frame->length);
+    f->length = frame->length;
+    f->queuedNs = frame->queuedNs;
+    txQueuePop();
+    pipePush(&txToCodec, f);
   }
+}
 
-  return byteCount;
+// CPU time of the calling thread, s
+double threadCpu() {
+  struct timespec ts;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
 }
 
-// Generate CRC-16 for Alto Ethernet
-// buf is sequence of words stored big-endian.
-// len is length in words
-uint16_t crc(uint8_t *buf, int len) {
-  uint16_t crc = 0x8005; // Due to the sync bit
-  int n;
-  int i;
-  for (n = 0; n < 2 * len; n++) {
-    uint16_t data = buf[n] << 8;
-    for (i = 0; i < 8; i++) {
-      uint16_t xorFeedback = (crc ^ data) & 0x8000; // Test upper bit
-      crc = crc << 1;
-      data = data << 1;
-      if (xorFeedback) {
-        crc ^= 0x8005; // CRC-16 polynomial constant
+// Codec thread: decode frames from the Alto and encode frames to it,
+// waiting on its doorbell when there are none.
+void *codecMain(void *arg) {
+  struct rxPipeFrame *rf;
+  struct txPipeFrame *tf;
+  while (1) {
+    int stopping = codecStopping;
+    if (pipePeek(&rxToCodec) != NULL) {
+      metricObserve(&pipeDecodeDepth, pipeDepth(&rxToCodec));
+    }
+    while ((rf = pipePeek(&rxToCodec)) != NULL) {
+      rf->status = rf->pruStatus;
+      rf->decodedLen = decodeFromAlto(rf->raw, rf->length, rf->raw + rf->length, 0, &rf->status,
+          rf->udp + 2, &rf->times);
+      rf->error = decodeError;
+      pipePop(&rxToCodec);
+      pipePush(&rxToSocket, rf);
+    }
+    if (pipePeek(&txToCodec) != NULL) {
+      metricObserve(&pipeEncodeDepth, pipeDepth(&txToCodec));
+    }
+    while ((tf = pipePeek(&txToCodec)) != NULL) {
+      if (txMode == TX_MODE_HALF_BITS) {
+        tf->halfBits = encodeHalfBits(tf->data, tf->length, tf->encoded, W_BUF_SIZE);
       }
+      pipePop(&txToCodec);
+      pipePush(&txToPru, tf);
+    }
+    if (stopping) {
+      break;
+    }
+    if (pipeSleep(&rxToCodec) && pipeSleep(&txToCodec) && !codecStopping) {
+      pipeBellWait(codecBell);
+      syscalls += 2;
     }
   }
-  return crc;
+  codecCpu = threadCpu();
+  __sync_fetch_and_add(&pipeSyscalls, syscalls);
+  return NULL;
 }
 
-char *ledPath = "/sys/class/leds/beaglebone:green:usr";
-#define LED_LEN 60
-void initLeds() {
-  char ledBuf[LED_LEN];
+// Socket thread: everything but the PRU's rings and the codec. It sends
+// frames from the Alto on as the codec thread passes them over, and reads
+// frames for the Alto from UDP and the shared memory ring into the
+// transmit queue, which feedCodec() empties as buffers come back.
+void *socketMain(void *arg) {
+  struct epoll_event ready[6];
+  struct rxPipeFrame *f;
   int i;
-  for (i = 0; i < 4; i++) {
-    snprintf(ledBuf, LED_LEN, "%s%d/trigger", ledPath, i);
-    printf("%s\n", ledBuf);
-    FILE *trigger = fopen(ledBuf, "w");
-    if (trigger == NULL) {
-      perror(ledBuf);
-      exit(-1);
+  wakeNs = nowNs();
+  if (echoDest) {
+    // Nothing else wakes the thread up to send the first requests
+    echoGenerate(wakeNs);
+    feedCodec();
+  }
+  while (1) {
+    // Only wait for buffers back from the PRU stage if frames are waiting
+    // for them, and on the shared memory ring's doorbell if there is room
+    // to take frames from it.
+    int timeout = WAIT_MS;
+    if (!pipeSleep(&rxToSocket) || (txQueueDepth > 0 && !pipeSleep(&txFree)) ||
+        (shmPath && txQueueTail() != NULL && !shmringSleep(shm.in))) {
+      timeout = 0;
     }
-    fprintf(trigger, "none\n");
-    fclose(trigger);
-    snprintf(ledBuf, LED_LEN, "%s%d/brightness", ledPath, i);
-    printf("%s\n", ledBuf);
-    led[i] = fopen(ledBuf, "w");
-    if (led[i] == NULL) {
-      perror(ledBuf);
-      exit(-1);
+    int retval = epoll_wait(socketEpollFd, ready, 6, timeout);
+    syscalls++;
+    wakeNs = nowNs();
+    metricsTick(wakeNs);
+    int udpReady = 0;
+    for (i = 0; i < retval; i++) {
+      int fd = ready[i].data.fd;
+      uint64_t expirations;
+      if (fd == recvSock) {
+        udpReady = 1;
+      } else if (fd == batchTimerFd || fd == echoTimerFd) {
+        if (read(fd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN) {
+          perror("timerfd read");
+        }
+        if (fd == batchTimerFd) {
+          flushBatch();
+        }
+      } else if (shmPath && fd == shm.bellIn) {
+        shmringDrain(shm.bellIn);
+        syscalls++;
+      } else if (fd == socketBell) {
+        pipeBellDrain(socketBell);
+        syscalls++;
+      }
+    }
+
+    int stopping = socketStopping;
+    if (pipePeek(&rxToSocket) != NULL) {
+      metricObserve(&pipeSendDepth, pipeDepth(&rxToSocket));
+    }
+    while ((f = pipePeek(&rxToSocket)) != NULL) {
+      captureFromAlto(f->pruStatus, f->timestamp, f->raw, f->length, f->raw + f->length, 0,
+          f->udp + 2, f->decodedLen);
+      forwardFromAlto(f->udp, f->decodedLen, f->status, f->error, &f->times);
+      pipePop(&rxToSocket);
+      pipePush(&rxFree, f);
+    }
+    flushToUdp();
+
+    if (udpReady) {
+      ledActivity(LED_TX);
+      sendToAlto();
+    }
+    if (shmPath) {
+      recvFromRing();
+    }
+    if (echoDest) {
+      echoGenerate(wakeNs);
+      pipeEchoDone = echoFinished(wakeNs);
+    }
+    bootTick(&bootServer, wakeNs);
+    feedCodec();
+    if (stopping) {
+      break;
     }
-    setLed(i, 0);
   }
+  flushBatch();
+  socketCpu = threadCpu();
+  __sync_fetch_and_add(&pipeSyscalls, syscalls);
+  return NULL;
 }
 
-void setLed(int n, int brightness) {
-  fprintf(led[n], "%d\n", brightness);
-  fflush(led[n]);
+// Print how many frames were waiting in each pipeline queue when its
+// consumer took them, on average and at most, and how often a frame had to
+// wait in the receive ring for a buffer.
+void pipeReport(FILE *f) {
+  struct metricHistogram *queues[] = { &pipeDecodeDepth, &pipeSendDepth, &pipeEncodeDepth, &pipeTxDepth };
+  const char *names[] = { "decode", "send", "encode", "to PRU" };
+  int i;
+  if (!pipelined) {
+    return;
+  }
+  fprintf(f, "Pipeline queues, frames waiting when taken, mean/max:");
+  for (i = 0; i < 4; i++) {
+    struct metricHistogram *h = queues[i];
+    fprintf(f, "%s %s %.1f/%llu", i ? "," : "", names[i], h->count ? (double)h->sum / h->count : 0.0,
+        (unsigned long long)h->max);
+  }
+  fprintf(f, "; receive ring waited for a buffer %ld times\n", rxStarved);
 }
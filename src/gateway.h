@@ -0,0 +1,24 @@
+/*
+ * gateway.h
+ *
+ * Definitions shared between the gateway and its helper modules.
+ */
+
+#ifndef GATEWAY_H_
+#define GATEWAY_H_
+#include <stdint.h>
+
+#define UDP_RECV_PORT 42424 // Defined in ifs.cfg
+#define UDP_SEND_PORT 42425
+
+#define MAX_PUP_LENGTH (554 + 10) // Extra 10 for slop
+
+// UDP encapsulation. A datagram normally holds one frame: its length in
+// words, not counting the CRC, then the frame. A batched datagram starts
+// with UDP_BATCH_FLAG ORed with a count of frames, each in the same
+// format. A frame's length never has the high bit set, so both kinds can
+// share the port; a peer that sends a batched datagram is sent them too.
+#define UDP_BATCH_FLAG 0x8000
+#define UDP_BATCH_MAX_BYTES 8192 // Fragmented by IP, which costs less than a datagram per frame
+
+#endif /* GATEWAY_H_ */
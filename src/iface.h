@@ -29,21 +29,78 @@
 #define OWNER_ARM 1
 #define OWNER_PRU 2
 
+// Receive modes, in r_mode
+#define RECV_MODE_DURATIONS 0 // Raw pulse widths, one byte per transition
+#define RECV_MODE_BYTES 1 // Frame bytes, decoded by the PRU
+#define RECV_MODE_OFF 2 // Don't receive: the other PRU does
+
+// Transmit modes, in w_mode
+#define TX_MODE_BYTES 0 // Frame bytes, Manchester encoded by the PRU
+#define TX_MODE_HALF_BITS 1 // Levels for each half-bit, encoded by the ARM
+
+// Interface version, in version. The ARM writes IFACE_VERSION, and the
+// firmware answers IFACE_VERSION_OK before it touches anything else, so a
+// gateway and firmware built from different versions of this file stop
+// instead of reading each other's RAM in the wrong layout. Change it
+// whenever struct iface or the buffers' addresses change.
+#define IFACE_VERSION 0xA1700002
+#define IFACE_VERSION_OK (IFACE_VERSION ^ 0xFFFF0000)
+
+#define RX_RING_SIZE 8 // Receive descriptors
+#define TX_RING_SIZE 3 // Transmit descriptors
+
+// Receive descriptor. The PRU fills descriptors in order, each with the
+// durations or bytes of one packet, and the ARM hands them back in the
+// same order.
+struct rx_desc {
+	uint32_t owner; // in/out, OWNER_PRU when free
+	uint32_t offset; // out, start of the packet in the receive buffer
+	uint32_t length; // out, durations or bytes (see r_mode); may wrap at r_buf_end
+	uint32_t status; // out
+	uint32_t timestamp; // out, IEP timer (ns) at the sync edge
+	uint32_t end; // out, IEP timer (ns) when the packet was handed back
+};
+
+// Transmit descriptor. The PRU sends descriptors in order, waiting w_gap
+// after each packet before starting the next. A descriptor that comes back
+// with STATUS_BIT_COLLISION is not skipped: the PRU waits for the ARM to
+// pass it back, to send again or, with length 0, to drop.
+struct tx_desc {
+	uint32_t owner; // in/out, OWNER_PRU when there is a packet to send
+	uint32_t buf; // in (pointer)
+	uint32_t length; // in, bytes, or half-bits in TX_MODE_HALF_BITS; 0 to skip
+	uint32_t status; // out
+	uint32_t start; // out, IEP timer (ns) when the packet started, after carrier sense
+	uint32_t end; // out, IEP timer (ns) when the last bit was sent
+};
+
 // Interface between host and PRU
-// The idea is there are two buffers: r_ and w_.
+// Received packets go into a ring of descriptors, r_desc. Their durations,
+// or in RECV_MODE_BYTES their decoded bytes, are written one after another
+// into the receive buffer, which wraps from
+// r_buf_end back to r_buf_start. The PRU counts bytes written in r_produced
+// and the ARM counts bytes it has finished with in r_consumed, so the PRU
+// never overwrites a packet the ARM hasn't released.
+// Sending uses a ring of descriptors, w_desc, in the same way.
 // Ownership is passed back and forth between the PRU and the ARM processor.
 // The PRU sends a signal whenever it gives a buffer back to the ARM.
+// Timestamps in the descriptors are the IEP timer, in ns, which the ARM can
+// also read (see pru_backend.h) to map them to its own clock.
 // "in" and "out" below are from the perspective of the PRU.
 struct iface {
-	uint32_t r_owner; // in
-	uint32_t r_max_length; // in, bytes
-	uint32_t r_received_length; // out, bytes
-	uint32_t r_buf; // in (pointer)
-	uint32_t r_truncated; // out, boolean
-	uint32_t r_status; // out
-	uint32_t w_owner; // in
-	uint32_t w_length; // bytes, in (buffer length)
-	uint32_t w_buf; // in (pointer)
-	uint32_t w_status; // out
+	uint32_t version; // in/out, IFACE_VERSION, answered with IFACE_VERSION_OK; first in every version
+	uint32_t r_buf_start; // in (pointer)
+	uint32_t r_buf_end; // in (pointer)
+	uint32_t r_max_length; // in, bytes per packet
+	uint32_t r_mode; // in, RECV_MODE_*
+	uint32_t r_produced; // out, bytes
+	uint32_t r_consumed; // in, bytes
+	uint32_t r_dropped; // out, packets missed because no descriptor was free
+	uint32_t r_overrun; // out, packets cut short by a full buffer or r_max_length
+	uint32_t w_gap; // in, ns between packets sent back to back
+	uint32_t w_mode; // in, TX_MODE_BYTES or TX_MODE_HALF_BITS
+	uint32_t heartbeat; // out, counts up while the firmware runs, even with the line idle
+	struct rx_desc r_desc[RX_RING_SIZE];
+	struct tx_desc w_desc[TX_RING_SIZE];
 };
 #endif /* IFACE_H_ */
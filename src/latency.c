@@ -0,0 +1,86 @@
+// Per-stage frame latency through the gateway; see latency.h.
+#include <stdlib.h>
+#include <string.h>
+#include "latency.h"
+
+struct latencyStage latRxWire = { "rx wire" };
+struct latencyStage latRxWake = { "rx wake" };
+struct latencyStage latRxRelease = { "rx release" };
+struct latencyStage latRxDecode = { "rx decode" };
+struct latencyStage latRxSend = { "rx send" };
+struct latencyStage latRxTotal = { "rx total" };
+struct latencyStage latTxQueue = { "tx queue" };
+struct latencyStage latTxDefer = { "tx defer" };
+struct latencyStage latTxWire = { "tx wire" };
+struct latencyStage latTxTotal = { "tx total" };
+struct latencyStage latEchoRtt = { "echo rtt" };
+
+static struct latencyStage *stages[] = {
+  &latRxWire, &latRxWake, &latRxRelease, &latRxDecode, &latRxSend, &latRxTotal,
+  &latTxQueue, &latTxDefer, &latTxWire, &latTxTotal, &latEchoRtt,
+};
+#define COUNT(a) (sizeof(a) / sizeof(a[0]))
+
+// The latest mapping: the IEP timer read syncIep at CLOCK_MONOTONIC syncNs
+static uint32_t syncIep;
+static uint64_t syncNs; // 0 until the first mapping
+
+// Map the IEP timer to CLOCK_MONOTONIC from a reading of it, iep, taken
+// between the clock readings before and after. If they are too far apart
+// the reading is discarded and 0 returned, so the caller can try again.
+int latencyClockSync(uint32_t iep, uint64_t before, uint64_t after) {
+  if (after - before > LATENCY_SYNC_SLOP_NS) {
+    return 0;
+  }
+  syncIep = iep;
+  syncNs = before + (after - before) / 2;
+  return 1;
+}
+
+// Convert an IEP timestamp to CLOCK_MONOTONIC in *ns. It must be within
+// about 2 s of the mapping, which holds for the descriptors of frames
+// being handled at now. Returns 0 if there is no recent mapping.
+int latencyPruNs(uint32_t iep, uint64_t now, uint64_t *ns) {
+  if (syncNs == 0 || now - syncNs > LATENCY_SYNC_MAX_AGE_NS) {
+    return 0;
+  }
+  *ns = syncNs + (int32_t)(iep - syncIep);
+  return 1;
+}
+
+// Record a frame's time in stage s, from one event to a later one. The
+// mapping can be out by a little, so a stage that seems to end before it
+// starts counts as 0.
+void latencyRecord(struct latencyStage *s, uint64_t from, uint64_t to) {
+  uint64_t ns = to > from ? to - from : 0;
+  if (ns > s->max) {
+    s->max = ns;
+  }
+  s->samples[s->count++ % LATENCY_SAMPLES] = ns > UINT32_MAX ? UINT32_MAX : ns;
+}
+
+static int compare(const void *a, const void *b) {
+  uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+  return x < y ? -1 : x > y;
+}
+
+// Print each stage's median and 99th percentile over its latest samples,
+// and its maximum since the start. Stages with nothing recorded, e.g. all
+// of the PRU timed ones before the IEP timer is mapped, are left out.
+void latencyReport(FILE *f) {
+  static uint32_t sorted[LATENCY_SAMPLES];
+  unsigned i;
+  fprintf(f, "Latency, us: p50 and p99 of the last %d frames, max since the start\n", LATENCY_SAMPLES);
+  fprintf(f, "stage          frames       p50       p99       max\n");
+  for (i = 0; i < COUNT(stages); i++) {
+    struct latencyStage *s = stages[i];
+    int n = s->count < LATENCY_SAMPLES ? s->count : LATENCY_SAMPLES;
+    if (n == 0) {
+      continue;
+    }
+    memcpy(sorted, s->samples, n * sizeof(sorted[0]));
+    qsort(sorted, n, sizeof(sorted[0]), compare);
+    fprintf(f, "%-10s %10llu %9.1f %9.1f %9.1f\n", s->name, (unsigned long long)s->count,
+        sorted[n / 2] / 1e3, sorted[n * 99 / 100] / 1e3, s->max / 1e3);
+  }
+}
@@ -0,0 +1,52 @@
+/*
+ * latency.h
+ *
+ * Where frames spend their time on the way through the gateway, stage by
+ * stage, for finding the tail latency that makes an Alto time out. Stages
+ * are measured per frame from the PRU's IEP timestamps in the descriptors,
+ * mapped to CLOCK_MONOTONIC, and the gateway's own clock readings. The
+ * latest LATENCY_SAMPLES of each stage are kept for percentiles, which
+ * latencyReport() prints on demand.
+ *
+ * Like metrics.h, each stage is only recorded from one thread, and the
+ * IEP timer is only mapped and read from the main loop.
+ */
+
+#ifndef LATENCY_H_
+#define LATENCY_H_
+#include <stdint.h>
+#include <stdio.h>
+
+#define LATENCY_SAMPLES 4096 // Per stage, power of 2
+#define LATENCY_SYNC_NS 100000000 // How often the IEP timer is mapped again
+#define LATENCY_SYNC_SLOP_NS 5000 // Most the mapping may be out by; a slower read is retried
+#define LATENCY_SYNC_MAX_AGE_NS 1000000000 // Mapping too old to trust, well under the 4.3 s IEP wrap
+
+struct latencyStage {
+  const char *name;
+  uint64_t count; // Frames recorded
+  uint64_t max; // ns, since the start
+  uint32_t samples[LATENCY_SAMPLES]; // ns, the latest at (count - 1) % LATENCY_SAMPLES
+};
+
+// From the Alto
+extern struct latencyStage latRxWire; // Sync edge to the PRU handing the frame over
+extern struct latencyStage latRxWake; // Handed over to the gateway waking up
+extern struct latencyStage latRxRelease; // Handed over to the descriptor handed back
+extern struct latencyStage latRxDecode; // Waking up to the frame decoded
+extern struct latencyStage latRxSend; // Decoded to sent to IFS
+extern struct latencyStage latRxTotal; // Sync edge to sent to IFS
+// To the Alto
+extern struct latencyStage latTxQueue; // Read from IFS to handed to the PRU
+extern struct latencyStage latTxDefer; // Handed to the PRU to the first bit on the wire
+extern struct latencyStage latTxWire; // First bit to last
+extern struct latencyStage latTxTotal; // Read from IFS to the last bit on the wire
+// PUP echo (see echo.h)
+extern struct latencyStage latEchoRtt; // Request queued to its reply handled
+
+int latencyClockSync(uint32_t iep, uint64_t before, uint64_t after);
+int latencyPruNs(uint32_t iep, uint64_t now, uint64_t *ns);
+void latencyRecord(struct latencyStage *s, uint64_t from, uint64_t to);
+void latencyReport(FILE *f);
+
+#endif /* LATENCY_H_ */
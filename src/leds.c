@@ -0,0 +1,86 @@
+// BeagleBone user LEDs, driven by a low priority thread.
+#define _GNU_SOURCE // SCHED_IDLE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include "leds.h"
+
+uint32_t ledCounts[LED_COUNT];
+
+static char *ledPath = "/sys/class/leds/beaglebone:green:usr";
+#define LED_LEN 60
+
+static int ledFd[LED_COUNT];
+static pthread_t thread;
+
+static void writeLed(int n, int brightness) {
+  if (pwrite(ledFd[n], brightness ? "1\n" : "0\n", 2, 0) < 0) {
+    perror("LED write");
+  }
+}
+
+static void *ledThread(void *arg) {
+  uint32_t last[LED_COUNT];
+  int shown[LED_COUNT];
+  int i;
+  struct sched_param param;
+  memset(&param, 0, sizeof(param));
+  pthread_setschedparam(pthread_self(), SCHED_IDLE, &param);
+  for (i = 0; i < LED_COUNT; i++) {
+    last[i] = __atomic_load_n(&ledCounts[i], __ATOMIC_RELAXED);
+    shown[i] = 0;
+  }
+  struct timespec next;
+  clock_gettime(CLOCK_MONOTONIC, &next);
+  while (1) {
+    next.tv_nsec += LED_REFRESH_MS * 1000000;
+    if (next.tv_nsec >= 1000000000) {
+      next.tv_nsec -= 1000000000;
+      next.tv_sec++;
+    }
+    clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+    for (i = 0; i < LED_COUNT; i++) {
+      uint32_t count = __atomic_load_n(&ledCounts[i], __ATOMIC_RELAXED);
+      int on = count != last[i];
+      last[i] = count;
+      if (on != shown[i]) {
+        writeLed(i, on);
+        shown[i] = on;
+      }
+    }
+  }
+  return NULL;
+}
+
+// Take the LEDs over from their kernel triggers and start the LED thread.
+void ledsStart() {
+  char ledBuf[LED_LEN];
+  int i;
+  for (i = 0; i < LED_COUNT; i++) {
+    snprintf(ledBuf, LED_LEN, "%s%d/trigger", ledPath, i);
+    printf("%s\n", ledBuf);
+    int trigger = open(ledBuf, O_WRONLY);
+    if (trigger < 0 || write(trigger, "none\n", 5) < 0) {
+      perror(ledBuf);
+      exit(-1);
+    }
+    close(trigger);
+    snprintf(ledBuf, LED_LEN, "%s%d/brightness", ledPath, i);
+    printf("%s\n", ledBuf);
+    ledFd[i] = open(ledBuf, O_WRONLY);
+    if (ledFd[i] < 0) {
+      perror(ledBuf);
+      exit(-1);
+    }
+    writeLed(i, 0);
+  }
+  if (pthread_create(&thread, NULL, ledThread, NULL) != 0) {
+    fprintf(stderr, "Can't start LED thread\n");
+    exit(-1);
+  }
+}
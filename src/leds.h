@@ -0,0 +1,31 @@
+/*
+ * leds.h
+ *
+ * BeagleBone user LEDs, driven by a low priority thread.
+ * The main loop only bumps an activity counter, which costs no syscall.
+ * The LED thread looks at the counters LED_REFRESH_MS apart and lights
+ * each LED whose counter moved since the last look.
+ */
+
+#ifndef LEDS_H_
+#define LEDS_H_
+#include <stdint.h>
+
+#define LED_TX 0 // Packet sent to the Alto
+#define LED_RX 1 // Packet received from the Alto
+#define LED_IDLE 2 // Main loop timed out waiting for work
+#define LED_BUSY 3 // Main loop woke up with work to do
+#define LED_COUNT 4
+
+#define LED_REFRESH_MS 50
+
+extern uint32_t ledCounts[LED_COUNT];
+
+// Safe to call from any thread, whether or not the LED thread is running
+static inline void ledActivity(int n) {
+  __atomic_fetch_add(&ledCounts[n], 1, __ATOMIC_RELAXED);
+}
+
+void ledsStart();
+
+#endif /* LEDS_H_ */
@@ -10,61 +10,122 @@
 #include "iface.h"
 
 // The interface structure between the host and PRU
-#define IFACE ((volatile struct iface *)MEM_START)
+#define IFACE ((volatile struct iface *)PRU_MEM(MEM_START))
 
 // Forward definitions
-uint16_t send_packet();
-uint16_t receive_packet();
+uint16_t send_packet(volatile struct tx_desc *desc);
+uint16_t send_half_bits(volatile struct tx_desc *desc);
+uint16_t receive_packet(volatile struct rx_desc *desc);
+uint16_t receive_bytes(volatile struct rx_desc *desc);
+int wait_for_sync();
+int wait_for_idle();
+uint16_t collision();
+void skip_packet();
 void init_pwm();
 void wait_for_pwm_timer();
 void reset_iep_timer();
 void init_iep_timer();
 
+uint32_t w_head = 0; // Next transmit descriptor to send
+
 // Output values from board. Inverted by driver chip, and by transceiver.
 #define HIGH 1
 #define LOW 0
 
+// Longest a send waits for the Alto to finish a frame, a little over a
+// maximum length one
+#define DEFER_MAX_NS 2000000
+
 void main() {
 	*PRU_CTRL |= 8; // Enable cycle count, TRM 4.5.1.1
 
-	__R30 = (HIGH << COLL_PIN) | (HIGH << WRITE_PIN); // Set output
+	if (PRU_SENDS) {
+		__R30 = (HIGH << COLL_PIN) | (HIGH << WRITE_PIN); // Set output
+
+		init_pwm();
+		init_iep_timer();
+		reset_iep_timer();
+	}
 
-	init_pwm();
-	init_iep_timer();
-	reset_iep_timer();
+	// Wait for a gateway that uses this interface version, and answer it
+	while (IFACE->version != IFACE_VERSION) {
+	}
+	IFACE->version = IFACE_VERSION_OK;
 
+	uint32_t r_head = 0; // Next receive descriptor to fill
+	uint32_t w_end = 0; // IEP timer when the last packet was sent
 	int done = 0;
 	while (!done) {
-		if (IFACE->r_owner == OWNER_PRU) { // Read buffer passed to PRU
-			// Will block until packet received or interrupted by write
-			uint16_t status = receive_packet();
-			if (status != STATUS_SOFTWARE_RESET) {
-				// receive completed
-	            IFACE->r_owner = OWNER_ARM; // Read done, pass buffer back to ARM
-				IFACE->r_status = status;
-				__R31 = 35;  // Interrupt to host
+		IFACE->heartbeat++;
+		if (IFACE->r_mode != RECV_MODE_OFF) {
+			volatile struct rx_desc *desc = &IFACE->r_desc[r_head];
+			if (desc->owner == OWNER_PRU) { // Read descriptor passed to PRU
+				// Will block until packet received or interrupted by write
+				uint16_t status;
+				if (IFACE->r_mode == RECV_MODE_BYTES) {
+					status = receive_bytes(desc);
+				} else {
+					status = receive_packet(desc);
+				}
+				if (status != STATUS_SOFTWARE_RESET) {
+					// receive completed
+					desc->status = status;
+					desc->end = *IEP_TMR_CNT;
+					desc->owner = OWNER_ARM; // Read done, pass descriptor back to ARM
+					__R31 = ARM_INTERRUPT;  // Interrupt to host
+					__delay_cycles(20);
+					__R31 = 0;
+					if (++r_head == RX_RING_SIZE) {
+						r_head = 0;
+					}
+				}
+			} else if (!(__R31 & (1 << READ_PIN))) {
+				// Incoming data, but the ARM holds every descriptor
+				skip_packet();
+				IFACE->r_dropped++;
+			}
+		}
+		if (PRU_SENDS) {
+			volatile struct tx_desc *wdesc = &IFACE->w_desc[w_head];
+			if (wdesc->owner == OWNER_PRU) { // Write buffer passed to PRU
+				// Inter-frame gap after the previous packet we sent
+				while (*IEP_TMR_CNT - w_end < IFACE->w_gap) {
+				}
+				if (wdesc->length == 0) {
+					wdesc->status = STATUS_OUTPUT_COMPLETE; // Abandoned by the ARM
+				} else if (IFACE->w_mode == TX_MODE_HALF_BITS) {
+					wdesc->status = send_half_bits(wdesc);
+				} else {
+					wdesc->status = send_packet(wdesc);
+				}
+				w_end = *IEP_TMR_CNT;
+				uint16_t collided = wdesc->status & STATUS_BIT_COLLISION;
+				wdesc->owner = OWNER_ARM; // Write done, pass buffer back to ARM
+				__R31 = ARM_INTERRUPT;  // Interrupt to host
 				__delay_cycles(20);
 				__R31 = 0;
+				// After a collision the ARM passes the same descriptor back
+				// once it has backed off, so later packets stay behind it.
+				if (!collided && ++w_head == TX_RING_SIZE) {
+					w_head = 0;
+				}
 			}
-		} else if (!(__R31 & (1 << READ_PIN))) {
-		    // Incoming data, but we're not expecting it
-            IFACE->r_truncated = 1; // For debugging
-		}
-		if (IFACE->w_owner == OWNER_PRU) { // Write buffer passed to PRU
-			IFACE->w_status = send_packet();
-			IFACE->w_owner = OWNER_ARM; // Write done, pass buffer back to ARM
-			__R31 = 35;  // Interrupt to host
-			__delay_cycles(20);
-			__R31 = 0;
 		}
 	}
 	__halt();
 }
 
 // Sends an Ethernet packet. Must be stored big-endian.
-inline uint16_t send_packet() {
-	uint16_t len /* bytes */ = IFACE->w_length /* bytes */;
-	uint8_t *buf = (uint8_t *)IFACE->w_buf;
+// Returns STATUS_BIT_COLLISION if the Alto was sending, before the packet
+// started or during it.
+inline uint16_t send_packet(volatile struct tx_desc *desc) {
+	uint16_t len /* bytes */ = desc->length /* bytes */;
+	volatile uint8_t *buf = PRU_MEM(desc->buf);
+
+	if (!wait_for_idle()) {
+		return STATUS_BIT_COLLISION;
+	}
+	desc->start = *IEP_TMR_CNT;
 
 	// Generate CTR = PRD (counter = period) event
 	// Send sync 1 bit (1 then 0)
@@ -72,7 +133,6 @@ inline uint16_t send_packet() {
 	// Wait for timer, send (hold) 1
 	wait_for_pwm_timer();
 	__R30 = (HIGH << COLL_PIN) | (HIGH << WRITE_PIN);
-	uint8_t oldR31 = __R31 && (1 << READ_PIN);
 
 	// Wait for timer, send 0
 	wait_for_pwm_timer();
@@ -84,13 +144,8 @@ inline uint16_t send_packet() {
 		uint8_t bit_count;
 #pragma UNROLL(8)
 		for (bit_count = 0; bit_count < 8; bit_count++) {
-			if ((__R31 && (1 << READ_PIN)) == 42) {
-				// Raise collision signal
-				__R30 = (LOW << COLL_PIN) | (HIGH << WRITE_PIN);
-				__delay_cycles(200); // 1000 ns
-				__R30 = (HIGH << COLL_PIN) | (HIGH << WRITE_PIN);
-				IFACE->w_length = 42;
-				return STATUS_BIT_COLLISION;
+			if (!(__R31 & (1 << READ_PIN))) {
+				return collision();
 			}
 			if (byte & 0x80) {
 				// Send 1 (1 then 0)
@@ -112,42 +167,81 @@ inline uint16_t send_packet() {
 	// End with 1
 	wait_for_pwm_timer();
 	__R30 = (HIGH << COLL_PIN) | (HIGH << WRITE_PIN);
+	desc->end = *IEP_TMR_CNT;
 
 	// Return status
 	return STATUS_OUTPUT_COMPLETE;
 
 }
 
+// Sends a pre-encoded packet (TX_MODE_HALF_BITS): desc->length half-bits,
+// packed most significant bit first, each the level to hold for one
+// 170 ns tick. The ARM has already Manchester encoded the frame, with the
+// sync bit and the trailing 1, so every tick runs the same code: the next
+// level is ready before the timer fires and goes out as soon as it does.
+// Carrier sense and collisions are as for send_packet().
+inline uint16_t send_half_bits(volatile struct tx_desc *desc) {
+	uint32_t len /* half-bits */ = desc->length;
+	volatile uint8_t *buf = PRU_MEM(desc->buf);
+	uint32_t i;
+	uint32_t out;
+	uint8_t bits = 0;
+
+	if (!wait_for_idle()) {
+		return STATUS_BIT_COLLISION;
+	}
+	desc->start = *IEP_TMR_CNT;
+
+	for (i = 0; i < len; i++) {
+		if ((i & 7) == 0) {
+			bits = buf[i >> 3];
+		}
+		out = (HIGH << COLL_PIN) | ((bits >> 7) << WRITE_PIN);
+		bits <<= 1;
+		wait_for_pwm_timer();
+		__R30 = out;
+		if (!(__R31 & (1 << READ_PIN))) {
+			return collision();
+		}
+	}
+	desc->end = *IEP_TMR_CNT;
+	return STATUS_OUTPUT_COMPLETE;
+}
+
+uint32_t r_pos; // Next byte to write in the receive buffer
+
 // Receives an Ethernet packet as raw durations.
-// Dumps the durations as bytes to buf (the shared memory).
+// Dumps the durations as bytes into the receive buffer (the shared memory),
+// starting where the previous packet ended and wrapping at the end.
 // This routine blocks until a packet is received or a write request comes in.
 // Durations in units of 2 ns (i.e. divided by 2 so max value fits in a byte)
 // Return:
 //   STATUS_INPUT_COMPLETE if packet received
 //   STATUS_SOFTWARE_RESET if write request came in before a packet arrived
 //   STATUS_INPUT_OVERRUN if packet didn't fit in input buffer.
-inline uint16_t receive_packet() {
+inline uint16_t receive_packet(volatile struct rx_desc *desc) {
 	uint32_t prev_timer_cnt; // Old timer read value
 	uint32_t timer_cnt; // New timer read value
 	uint32_t last = 0; // last value read, low because of sync
 	uint16_t max_len /* bytes */ = IFACE->r_max_length /* bytes */;
-	uint8_t *buf = (uint8_t *)IFACE->r_buf; // Input buffer address
+	uint32_t start = IFACE->r_buf_start; // Input buffer address
+	uint32_t end = IFACE->r_buf_end;
+	uint32_t size = end - start;
+	uint32_t produced = IFACE->r_produced;
 	uint16_t count;
 	int i;
 
-	// Assume high (carrier). If we're in the middle of a packet,
-	// higher levels will reject the truncated packet.
+	if (r_pos < start || r_pos >= end) {
+		r_pos = start; // First packet
+	}
+	desc->offset = r_pos;
 
-	// Wait for midpoint of sync (low transition)
-	// This could be a long wait if there's no packet coming
-	while (__R31 & (1 << READ_PIN)) {
-		// Check for interrupt of receive, i.e. host wants to send
-		if (IFACE->w_owner == OWNER_PRU) {
-			return STATUS_SOFTWARE_RESET;
-		}
+	if (wait_for_sync()) {
+		return STATUS_SOFTWARE_RESET;
 	}
 
 	prev_timer_cnt = *IEP_TMR_CNT;
+	desc->timestamp = prev_timer_cnt;
 
 	// Check for input transition (unrolled loop)
 	for (count = 0; count < max_len; count++) {
@@ -158,23 +252,196 @@ inline uint16_t receive_packet() {
 		}
 
 		// End of packet timeout. Return.
-		IFACE->r_received_length = count;
-		// Record last value, just for debugging
-		timer_cnt = *IEP_TMR_CNT;
-		buf[count] = (timer_cnt - prev_timer_cnt) / 2; // Store (scaled) time since previous transition
+		desc->length = count;
+		IFACE->r_produced = produced;
 		return STATUS_INPUT_COMPLETE;
 
 		// Transition detected. Record pulse width.
 		detected:
 		timer_cnt = *IEP_TMR_CNT;
-		buf[count] = (timer_cnt - prev_timer_cnt) / 2; // Store (scaled) time since previous transition
+		if (produced - IFACE->r_consumed >= size) {
+			break; // Buffer full of packets the ARM hasn't released
+		}
+		*PRU_MEM(r_pos) = (timer_cnt - prev_timer_cnt) / 2; // Store (scaled) time since previous transition
+		if (++r_pos == end) {
+			r_pos = start;
+		}
+		produced++;
 		prev_timer_cnt = timer_cnt;
 
 		last = last ? 0 : (1 << READ_PIN); // Flip bit that we're waiting for.
 	}
+	desc->length = count;
+	IFACE->r_produced = produced;
+	IFACE->r_overrun++;
+	skip_packet(); // Don't start a new packet in the middle of this one
 	return STATUS_INPUT_OVERRUN;
 }
 
+// Receives an Ethernet packet and decodes it as it arrives (RECV_MODE_BYTES).
+// Like receive_packet(), but each pulse is classified when it ends, with
+// the same widths as the ARM's decoder, and only the frame bytes go into
+// the receive buffer: a sixteenth of the traffic at worst.
+// Manchester has a transition in the middle of every bit, and the level
+// before it is the bit's value. Timing starts in the middle of the sync
+// bit, so a short pulse moves between the middle of a bit and a cell
+// boundary, and a long one goes from the middle of one bit to the middle
+// of the next.
+// The ARM checks the CRC.
+// Return:
+//   as receive_packet(), except
+//   STATUS_TIMING_ERROR if a pulse was a bad width, or a long pulse started
+//     on a cell boundary
+//   STATUS_BIT_INCOMPLETE if the packet didn't end on a byte boundary
+inline uint16_t receive_bytes(volatile struct rx_desc *desc) {
+	uint32_t prev_timer_cnt; // Old timer read value
+	uint32_t timer_cnt; // New timer read value
+	uint32_t width; // ns
+	uint32_t last = 0; // last value read, low because of sync
+	uint16_t max_len /* bytes */ = IFACE->r_max_length /* bytes */;
+	uint32_t start = IFACE->r_buf_start; // Input buffer address
+	uint32_t end = IFACE->r_buf_end;
+	uint32_t size = end - start;
+	uint32_t produced = IFACE->r_produced;
+	uint16_t count = 0; // Bytes stored
+	uint8_t byte = 0;
+	uint8_t bits = 0; // Bits in byte
+	uint8_t at_mid = 1; // Current pulse started in the middle of a bit
+	int i;
+
+	if (r_pos < start || r_pos >= end) {
+		r_pos = start; // First packet
+	}
+	desc->offset = r_pos;
+
+	if (wait_for_sync()) {
+		return STATUS_SOFTWARE_RESET;
+	}
+
+	prev_timer_cnt = *IEP_TMR_CNT;
+	desc->timestamp = prev_timer_cnt;
+
+	while (1) {
+#pragma UNROLL(32) // 3 cycles per iteration = 15ns. Want to detect max pulse of 400ns.
+		for (i = 0; i < 32; i++) {
+			if ((__R31 & (1 << READ_PIN)) != last)
+				goto detected;
+		}
+
+		// End of packet timeout. Return.
+		desc->length = count;
+		IFACE->r_produced = produced;
+		return bits ? STATUS_BIT_INCOMPLETE : STATUS_INPUT_COMPLETE;
+
+		// Transition detected. Classify the pulse that just ended.
+		detected:
+		timer_cnt = *IEP_TMR_CNT;
+		width = timer_cnt - prev_timer_cnt;
+		prev_timer_cnt = timer_cnt;
+		if (width < 120 || width >= 400 || (width >= 230 && width < 280) ||
+				(width >= 280 && !at_mid)) {
+			desc->length = count;
+			IFACE->r_produced = produced;
+			skip_packet();
+			return STATUS_TIMING_ERROR;
+		}
+		if (width < 230) {
+			at_mid = !at_mid;
+		}
+		if (at_mid) {
+			// Mid-bit transition: high before it is a 1
+			byte = (byte << 1) | (last ? 1 : 0);
+			if (++bits == 8) {
+				if (count >= max_len || produced - IFACE->r_consumed >= size) {
+					break; // Too long, or buffer full of packets the ARM hasn't released
+				}
+				*PRU_MEM(r_pos) = byte;
+				if (++r_pos == end) {
+					r_pos = start;
+				}
+				produced++;
+				count++;
+				bits = 0;
+			}
+		}
+
+		last = last ? 0 : (1 << READ_PIN); // Flip bit that we're waiting for.
+	}
+	desc->length = count;
+	IFACE->r_produced = produced;
+	IFACE->r_overrun++;
+	skip_packet(); // Don't start a new packet in the middle of this one
+	return STATUS_INPUT_OVERRUN;
+}
+
+// Waits for the midpoint of the sync bit (low transition).
+// Assume high (carrier). If we're in the middle of a packet,
+// higher levels will reject the truncated packet.
+// This could be a long wait if there's no packet coming, so the heartbeat
+// is kept going here. It and the check for a write request are done once
+// every 16 polls, so they don't slow the poll down.
+// Returns 1 if a write request came in first, otherwise 0.
+inline int wait_for_sync() {
+	int i;
+	while (1) {
+#pragma UNROLL(16)
+		for (i = 0; i < 16; i++) {
+			if (!(__R31 & (1 << READ_PIN)))
+				return 0;
+		}
+		IFACE->heartbeat++;
+		// Check for interrupt of receive, i.e. host wants to send
+		if (PRU_SENDS && IFACE->w_desc[w_head].owner == OWNER_PRU) {
+			return 1;
+		}
+	}
+}
+
+// Carrier sense: waits until the line has been idle (high) for 32 polls,
+// longer than any high pulse in a frame, so a send doesn't start in the
+// middle of a frame from the Alto.
+// Returns 0 if the line is still busy after DEFER_MAX_NS, otherwise 1.
+inline int wait_for_idle() {
+	uint32_t start = *IEP_TMR_CNT;
+	int i;
+	while (*IEP_TMR_CNT - start < DEFER_MAX_NS) {
+#pragma UNROLL(32)
+		for (i = 0; i < 32; i++) {
+			if (!(__R31 & (1 << READ_PIN)))
+				goto busy;
+		}
+		return 1;
+		busy:
+		;
+	}
+	return 0;
+}
+
+// Handles a collision: the Alto started sending while we were. Stops
+// sending and pulses the collision signal so the Alto backs off too.
+inline uint16_t collision() {
+	__R30 = (LOW << COLL_PIN) | (HIGH << WRITE_PIN);
+	__delay_cycles(200); // 1000 ns
+	__R30 = (HIGH << COLL_PIN) | (HIGH << WRITE_PIN);
+	return STATUS_BIT_COLLISION;
+}
+
+// Waits for the end of a packet that can't be received.
+inline void skip_packet() {
+	uint32_t last = 0;
+	int i;
+	while (1) {
+#pragma UNROLL(32)
+		for (i = 0; i < 32; i++) {
+			if ((__R31 & (1 << READ_PIN)) != last)
+				goto detected;
+		}
+		return; // End of packet
+		detected:
+		last = last ? 0 : (1 << READ_PIN);
+	}
+}
+
 // Initializes the PWM timer, used to control output transitions.
 inline void init_pwm() {
 	*PRU_INTC_GER = 1; // Enable global interrupts
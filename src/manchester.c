@@ -0,0 +1,216 @@
+// Manchester encoding for Alto Ethernet frames.
+#include "crc.h"
+#include "manchester.h"
+
+// Encode frame bytes the way receive_packet() on the PRU would record them:
+// one byte per transition, holding the time since the previous transition
+// in units of RECV_WIDTH ns.
+// The PRU starts timing at the middle of the sync bit, so the first
+// duration is the low half of the sync bit. After the last data bit the
+// line returns high and stays there, so a final high run is never recorded.
+// Return the number of durations, or -1 if they don't fit in maxLen.
+int encodeDurations(const uint8_t *bytes, int len, uint8_t *durations, int maxLen) {
+  int count = 0;
+  int level = 0; // Low half of the sync bit
+  int halves = 1; // Length of the current run in half-bits
+  int i, b, h;
+  for (i = 0; i < len; i++) {
+    for (b = 7; b >= 0; b--) {
+      int bit = (bytes[i] >> b) & 1;
+      // A 1 is sent as high then low, a 0 as low then high.
+      for (h = 0; h < 2; h++) {
+        int half = h ? !bit : bit;
+        if (half == level) {
+          halves++;
+        } else {
+          if (count >= maxLen) {
+            return -1;
+          }
+          durations[count++] = halves * HALF_BIT_NS / RECV_WIDTH;
+          level = half;
+          halves = 1;
+        }
+      }
+    }
+  }
+  if (level == 0) {
+    // Trailing 1 ends the final low run.
+    if (count >= maxLen) {
+      return -1;
+    }
+    durations[count++] = halves * HALF_BIT_NS / RECV_WIDTH;
+  }
+  return count;
+}
+
+// Manchester cells for a byte: 16 half-bits, first half in the higher bit.
+// A 1 is high then low, a 0 low then high.
+static inline uint32_t byteToCells(uint8_t byte) {
+  // Spread the bits out to the even positions
+  uint32_t bits = byte;
+  bits = (bits | (bits << 4)) & 0x0f0f;
+  bits = (bits | (bits << 2)) & 0x3333;
+  bits = (bits | (bits << 1)) & 0x5555;
+  return (bits << 1) | (~bits & 0x5555);
+}
+
+// Encode frame bytes as the levels send_half_bits() puts on the wire, one
+// bit per half-bit, packed most significant bit first: the sync bit, the
+// data and the trailing 1 that returns the line high. The last byte is
+// padded with 1s.
+// Return the number of half-bits, or -1 if they don't fit in maxLen bytes.
+int encodeHalfBits(const uint8_t *bytes, int len, uint8_t *halfBits, int maxLen) {
+  int halves = 2 + 16 * len + 1;
+  uint32_t acc = 2; // Sync bit: high, low
+  int count = 2; // Bits in acc
+  int out = 0;
+  int i;
+  if ((halves + 7) / 8 > maxLen) {
+    return -1;
+  }
+  for (i = 0; i < len; i++) {
+    acc = (acc << 16) | byteToCells(bytes[i]);
+    count += 16;
+    while (count >= 8) {
+      count -= 8;
+      halfBits[out++] = acc >> count;
+    }
+  }
+  acc = (acc << 1) | 1; // Trailing 1
+  count++;
+  halfBits[out] = (acc << (8 - count)) | (0xff >> count);
+  return halves;
+}
+
+const char *decodeError;
+int decodeBadBits;
+
+// Pulse width classes, indexed by the raw PRU duration (units of RECV_WIDTH ns).
+// Under 120 ns is bad, under 230 is a half bit, under 280 is bad, under 400
+// is a full bit and anything longer is bad. The class is the pulse's length
+// in half-bits.
+#define WIDTH_BAD 0
+#define WIDTH_SHORT 1
+#define WIDTH_LONG 2
+static const uint8_t widthClass[256] = {
+  [120 / RECV_WIDTH ... 230 / RECV_WIDTH - 1] = WIDTH_SHORT,
+  [280 / RECV_WIDTH ... 400 / RECV_WIDTH - 1] = WIDTH_LONG,
+};
+
+// Convert 16 half-bits (8 bit cells, first half in the higher bit) to a byte.
+// A cell is 1 if it is high then low. A cell with no mid-bit transition
+// decodes as 0, and is counted in decodeBadBits.
+static inline uint8_t cellsToByte(uint32_t cells) {
+  uint32_t bits = (cells >> 1) & ~cells & 0x5555; // First half high, second low
+  uint32_t bad = ~(cells ^ (cells >> 1)) & 0x5555; // Both halves the same
+  if (bad) {
+    decodeBadBits += __builtin_popcount(bad);
+  }
+  // Gather the even bits into one byte
+  bits = (bits | (bits >> 1)) & 0x3333;
+  bits = (bits | (bits >> 2)) & 0x0f0f;
+  bits = (bits | (bits >> 4)) & 0x00ff;
+  return bits;
+}
+
+// The CRC is updated as bytes are produced, CRC_LAG bytes behind, since the
+// last two bytes are the CRC itself and an odd trailing byte is not covered.
+#define CRC_LAG 3
+
+// Decoder state, carried from one run of durations to the next.
+struct decodeState {
+  uint32_t cells; // Half-bits not yet converted, most recent in bit 0
+  int count; // Number of half-bits in cells
+  int halves; // Half-bits seen, including the sync half
+  int byteCount;
+  uint16_t crcVal;
+};
+
+// Convert the oldest 16 half-bits in cells to a byte.
+// Return -1 if the byte buffer is full.
+static inline int emitByte(struct decodeState *st, uint8_t *bytes, int maxBytes) {
+  st->count -= 16;
+  bytes[st->byteCount++] = cellsToByte(st->cells >> st->count);
+  if (st->byteCount >= maxBytes) {
+    decodeError = "buffer overflow";
+    return -1;
+  }
+  if (st->byteCount > CRC_LAG) {
+    st->crcVal = crcByte(st->crcVal, bytes[st->byteCount - 1 - CRC_LAG]);
+  }
+  return 0;
+}
+
+// Shift a run of durations into the decoder. first is the index of
+// durations[0] in the whole packet, which gives the level of each pulse.
+static inline int decodePulses(struct decodeState *st, const uint8_t *durations, int len, int first,
+    uint8_t *bytes, int maxBytes) {
+  int offset;
+  for (offset = 0; offset < len; offset++) {
+    int width = widthClass[durations[offset]];
+    if (width == WIDTH_BAD) {
+      decodeError = "bad width";
+      return -1;
+    }
+    uint32_t level = -(uint32_t)((first + offset) & 1); // Odd pulses are high
+    st->cells = (st->cells << width) | (((1 << width) - 1) & level);
+    st->count += width;
+    st->halves += width;
+    if (st->count >= 16 && emitByte(st, bytes, maxBytes) < 0) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+// Decode timings from PRU into bytes, in a single pass over the durations.
+// Each duration is a pulse of alternating level, starting with the low half
+// of the sync bit. Each pulse is classified as one or two half-bits, which
+// are shifted into cells; every 16 half-bits make a byte.
+// The durations may be split in two, where they wrap around the end of the
+// PRU's receive buffer: len1 bytes at d1 followed by len2 bytes at d2.
+// Return length in bytes or -1 for error, with the reason in decodeError.
+int decodeSplit(const uint8_t *d1, int len1, const uint8_t *d2, int len2, uint8_t *bytes, int maxBytes) {
+  // Starting with count at -1 drops the sync half-bit.
+  struct decodeState st = { 0, -1, 0, 0, CRC_SEED };
+
+  if (decodePulses(&st, d1, len1, 0, bytes, maxBytes) < 0 ||
+      decodePulses(&st, d2, len2, len1, bytes, maxBytes) < 0) {
+    return -1;
+  }
+  if ((st.halves % 2) == 0) {
+    // For a 0 bit, the last 1 signal gets combined with the no-signal state and lost.
+    // So add it back.
+    st.cells = (st.cells << 1) | 1;
+    st.count++;
+    st.halves++;
+    if (st.count >= 16 && emitByte(&st, bytes, maxBytes) < 0) {
+      return -1;
+    }
+  }
+  if ((st.halves % 16) != 1) {
+    decodeError = "bad offset2";
+    return -1;
+  }
+  int byteCount = st.byteCount;
+  if (byteCount < 2) {
+    decodeError = "short frame";
+    return -1;
+  }
+
+  // Check the Ethernet CRC. It covers whole words before the last two bytes.
+  if ((byteCount % 2) == 0 && byteCount > CRC_LAG) {
+    st.crcVal = crcByte(st.crcVal, bytes[byteCount - CRC_LAG]);
+  }
+  uint16_t readCrcVal = (bytes[byteCount - 2] << 8) | bytes[byteCount - 1];
+  if (st.crcVal != readCrcVal) {
+    decodeError = "bad CRC";
+    return -1;
+  }
+
+  return byteCount;
+}
+
+int decode(const uint8_t *durations, int len, uint8_t *bytes, int maxBytes) {
+  return decodeSplit(durations, len, 0, 0, bytes, maxBytes);
+}
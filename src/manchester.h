@@ -0,0 +1,27 @@
+/*
+ * manchester.h
+ *
+ * Conversion between Alto Ethernet frame bytes and the raw transition
+ * durations recorded by the PRU receive code.
+ */
+
+#ifndef MANCHESTER_H_
+#define MANCHESTER_H_
+#include <stdint.h>
+
+#define RECV_WIDTH 2 // Recv values are in units of 2 ns (to fit in byte)
+#define HALF_BIT_NS 170 // 3 Mb/s Ethernet: 340 ns per bit
+
+int encodeDurations(const uint8_t *bytes, int len, uint8_t *durations, int maxLen);
+int encodeHalfBits(const uint8_t *bytes, int len, uint8_t *halfBits, int maxLen);
+int decode(const uint8_t *durations, int len, uint8_t *bytes, int maxBytes);
+int decodeSplit(const uint8_t *d1, int len1, const uint8_t *d2, int len2, uint8_t *bytes, int maxBytes);
+
+// Adaptive clock recovery for marginal lines, in adaptive.c
+int decodeAdaptive(const uint8_t *durations, int len, uint8_t *bytes, int maxBytes);
+int decodeSplitAdaptive(const uint8_t *d1, int len1, const uint8_t *d2, int len2, uint8_t *bytes, int maxBytes);
+
+extern const char *decodeError; // Why the last decode() failed
+extern int decodeBadBits; // Bit cells with no mid-bit transition, decoded as 0
+
+#endif /* MANCHESTER_H_ */
@@ -0,0 +1,249 @@
+// In-process counters, gauges and histograms for the gateway.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "manchester.h"
+#include "metrics.h"
+
+struct metricCounter rxFrames = { "alto_gateway_rx_frames_total",
+  "Frames from the Alto decoded and sent over UDP" };
+struct metricCounter rxErrors = { "alto_gateway_rx_errors_total",
+  "Frames from the Alto that were lost, by reason", "reason" };
+struct metricCounter rxBadBits = { "alto_gateway_rx_bad_bits_total",
+  "Bit cells from the Alto with no mid-bit transition" };
+struct metricCounter txFrames = { "alto_gateway_tx_frames_total",
+  "Frames from UDP sent to the Alto" };
+struct metricCounter txErrors = { "alto_gateway_tx_errors_total",
+  "Frames from UDP that were not sent, by reason", "reason" };
+struct metricCounter txCollisions = { "alto_gateway_tx_collisions_total",
+  "Sends to the Alto that collided or found the line busy" };
+struct metricCounter txRetries = { "alto_gateway_tx_retries_total",
+  "Frames passed back to the PRU to send again after a collision" };
+
+struct metricCounter udpBatches = { "alto_gateway_udp_batches_total",
+  "Batched datagrams, each carrying several frames, by direction", "direction" };
+struct metricCounter fwdLookups = { "alto_gateway_fwd_lookups_total",
+  "Forwarding table lookups of destination hosts, by result", "result" };
+struct metricCounter fwdFiltered = { "alto_gateway_fwd_filtered_total",
+  "Frames dropped because the destination host is on the side they came from", "direction" };
+
+struct metricCounter pruRestarts = { "alto_gateway_pru_restarts_total",
+  "Times the PRU firmware was reloaded after its heartbeat stopped" };
+
+struct metricCounter bootFiles = { "alto_gateway_boot_files_total",
+  "Boot files the gateway sent itself instead of IFS, by result", "result" };
+struct metricCounter bootResent = { "alto_gateway_boot_resent_total",
+  "Boot file frames sent again because the Alto didn't acknowledge them" };
+
+struct metricHistogram rxFrameBytes = { "alto_gateway_rx_frame_bytes",
+  "Size of frames from the Alto, including the CRC",
+  8, { 32, 64, 128, 256, 384, 512, 560, 564 } };
+struct metricHistogram txFrameBytes = { "alto_gateway_tx_frame_bytes",
+  "Size of frames to the Alto, including the CRC",
+  8, { 32, 64, 128, 256, 384, 512, 560, 564 } };
+
+struct metricGauge txQueueDepthGauge = { "alto_gateway_tx_queue_depth",
+  "Frames waiting in the transmit queue" };
+struct metricGauge txQueueHighWaterGauge = { "alto_gateway_tx_queue_high_water",
+  "Most frames ever waiting in the transmit queue" };
+struct metricHistogram rxRingDepth = { "alto_gateway_rx_ring_depth",
+  "Receive descriptors ready each time the gateway woke up",
+  8, { 0, 1, 2, 3, 4, 5, 6, 7 } };
+struct metricHistogram pipeDecodeDepth = { "alto_gateway_pipe_decode_queue_depth",
+  "Frames from the Alto waiting for the codec thread each time it took some",
+  8, { 1, 2, 3, 4, 6, 8, 16, 32 } };
+struct metricHistogram pipeSendDepth = { "alto_gateway_pipe_send_queue_depth",
+  "Decoded frames from the Alto waiting for the socket thread each time it took some",
+  8, { 1, 2, 3, 4, 6, 8, 16, 32 } };
+struct metricHistogram pipeEncodeDepth = { "alto_gateway_pipe_encode_queue_depth",
+  "Frames to the Alto waiting for the codec thread each time it took some",
+  8, { 1, 2, 3, 4, 6, 8, 16, 32 } };
+struct metricHistogram pipeTxDepth = { "alto_gateway_pipe_tx_queue_depth",
+  "Encoded frames to the Alto waiting for a transmit descriptor each time the main loop took some",
+  8, { 1, 2, 3, 4, 6, 8, 16, 32 } };
+
+struct metricHistogram decodeNs = { "alto_gateway_decode_ns",
+  "Time to decode and check one frame from the Alto",
+  10, { 1000, 2000, 5000, 10000, 20000, 50000, 100000, 200000, 500000, 1000000 } };
+struct metricHistogram rxLatencyNs = { "alto_gateway_rx_latency_ns",
+  "Time from the PRU interrupt waking the gateway to the frame's UDP send",
+  10, { 5000, 10000, 20000, 50000, 100000, 200000, 500000, 1000000, 2000000, 5000000 } };
+
+// Pulse widths are counted per raw duration value, which is cheap enough
+// per pulse, and only turned into buckets when the file is written.
+static uint64_t pulseCounts[256];
+static struct metricHistogram pulseWidthNs = { "alto_gateway_pulse_width_ns",
+  "Widths of received pulses, from a sample of good frames and all bad ones",
+  22, { 80, 100, 118, 140, 160, 180, 200, 228, 250, 278,
+    300, 320, 340, 360, 380, 398, 420, 440, 460, 480, 500, 510 } };
+
+static struct metricCounter *counters[] = {
+  &rxFrames, &rxErrors, &rxBadBits, &txFrames, &txErrors, &txCollisions, &txRetries,
+  &fwdLookups, &fwdFiltered, &udpBatches, &pruRestarts, &bootFiles, &bootResent,
+};
+static struct metricGauge *gauges[] = {
+  &txQueueDepthGauge, &txQueueHighWaterGauge,
+};
+static struct metricHistogram *histograms[] = {
+  &rxFrameBytes, &txFrameBytes, &rxRingDepth, &decodeNs, &rxLatencyNs, &pulseWidthNs,
+  &pipeDecodeDepth, &pipeSendDepth, &pipeEncodeDepth, &pipeTxDepth,
+};
+#define COUNT(a) (sizeof(a) / sizeof(a[0]))
+
+// Index of a label value, added if it hasn't been seen. Label values are
+// a fixed set of literals, so running out of slots is a bug: stop rather
+// than count under the wrong label.
+static int labelIndex(struct metricCounter *c, const char *value) {
+  int i;
+  for (i = 0; i < c->n; i++) {
+    if (c->values[i] == value || strcmp(c->values[i], value) == 0) {
+      return i;
+    }
+  }
+  if (c->n == METRIC_MAX_LABELS) {
+    fprintf(stderr, "%s: no room for %s=\"%s\"; raise METRIC_MAX_LABELS\n", c->name, c->label, value);
+    abort();
+  }
+  c->values[c->n] = value;
+  return c->n++;
+}
+
+void metricAdd(struct metricCounter *c, const char *value, uint64_t n) {
+  c->counts[labelIndex(c, value)] += n;
+}
+
+// For counts kept elsewhere, e.g. by the PRU
+void metricSet(struct metricCounter *c, const char *value, uint64_t total) {
+  c->counts[labelIndex(c, value)] = total;
+}
+
+void metricObserve(struct metricHistogram *h, uint64_t value) {
+  int i;
+  for (i = 0; i < h->nBuckets && value > h->bounds[i]; i++) {
+  }
+  h->counts[i]++;
+  h->sum += value;
+  h->count++;
+  if (value > h->max) {
+    h->max = value;
+  }
+}
+
+void metricPulseWidths(const uint8_t *durations, int len) {
+  int i;
+  for (i = 0; i < len; i++) {
+    pulseCounts[durations[i]]++;
+  }
+}
+
+static void fillPulseWidths() {
+  int d;
+  memset(pulseWidthNs.counts, 0, sizeof(pulseWidthNs.counts));
+  pulseWidthNs.sum = 0;
+  pulseWidthNs.count = 0;
+  for (d = 0; d < 256; d++) {
+    if (pulseCounts[d]) {
+      int i;
+      for (i = 0; i < pulseWidthNs.nBuckets && d * RECV_WIDTH > pulseWidthNs.bounds[i]; i++) {
+      }
+      pulseWidthNs.counts[i] += pulseCounts[d];
+      pulseWidthNs.sum += pulseCounts[d] * d * RECV_WIDTH;
+      pulseWidthNs.count += pulseCounts[d];
+    }
+  }
+}
+
+static void writeCounter(FILE *f, struct metricCounter *c) {
+  int i;
+  fprintf(f, "# HELP %s %s\n# TYPE %s counter\n", c->name, c->help, c->name);
+  if (c->label == NULL) {
+    fprintf(f, "%s %llu\n", c->name, (unsigned long long)c->counts[0]);
+    return;
+  }
+  for (i = 0; i < c->n; i++) {
+    fprintf(f, "%s{%s=\"%s\"} %llu\n", c->name, c->label, c->values[i], (unsigned long long)c->counts[i]);
+  }
+}
+
+static void writeHistogram(FILE *f, struct metricHistogram *h) {
+  uint64_t total = 0;
+  int i;
+  fprintf(f, "# HELP %s %s\n# TYPE %s histogram\n", h->name, h->help, h->name);
+  for (i = 0; i < h->nBuckets; i++) {
+    total += h->counts[i];
+    fprintf(f, "%s_bucket{le=\"%u\"} %llu\n", h->name, h->bounds[i], (unsigned long long)total);
+  }
+  fprintf(f, "%s_bucket{le=\"+Inf\"} %llu\n", h->name, (unsigned long long)h->count);
+  fprintf(f, "%s_sum %llu\n", h->name, (unsigned long long)h->sum);
+  fprintf(f, "%s_count %llu\n", h->name, (unsigned long long)h->count);
+}
+
+// Write every metric to path. The file is written beside it and renamed,
+// so a reader never sees half of it. Returns -1 for error.
+int metricsWrite(const char *path) {
+  char tmpPath[256];
+  unsigned i;
+  snprintf(tmpPath, sizeof(tmpPath), "%s.tmp", path);
+  FILE *f = fopen(tmpPath, "w");
+  if (f == NULL) {
+    perror(tmpPath);
+    return -1;
+  }
+  fillPulseWidths();
+  for (i = 0; i < COUNT(counters); i++) {
+    writeCounter(f, counters[i]);
+  }
+  for (i = 0; i < COUNT(gauges); i++) {
+    fprintf(f, "# HELP %s %s\n# TYPE %s gauge\n%s %lld\n", gauges[i]->name, gauges[i]->help,
+        gauges[i]->name, gauges[i]->name, (long long)gauges[i]->value);
+  }
+  for (i = 0; i < COUNT(histograms); i++) {
+    writeHistogram(f, histograms[i]);
+  }
+  if (fclose(f) != 0 || rename(tmpPath, path) < 0) {
+    perror(path);
+    return -1;
+  }
+  return 0;
+}
+
+// Errors counted by c since its last summary
+static uint64_t unsummarized(struct metricCounter *c) {
+  uint64_t total = 0;
+  int i;
+  for (i = 0; i < c->n; i++) {
+    total += c->counts[i] - c->summarized[i];
+  }
+  return total;
+}
+
+static void summarizeCounter(FILE *f, struct metricCounter *c, const char *what) {
+  uint64_t total = unsummarized(c);
+  const char *sep = "";
+  int i;
+  if (total == 0) {
+    return;
+  }
+  fprintf(f, " %llu %s (", (unsigned long long)total, what);
+  for (i = 0; i < c->n; i++) {
+    uint64_t n = c->counts[i] - c->summarized[i];
+    if (n) {
+      fprintf(f, "%s%s %llu", sep, c->values[i], (unsigned long long)n);
+      sep = ", ";
+    }
+    c->summarized[i] = c->counts[i];
+  }
+  fprintf(f, ")");
+}
+
+// One line for the errors since the last summary, and nothing if there
+// were none.
+void metricsSummary(FILE *f, int seconds) {
+  if (unsummarized(&rxErrors) == 0 && unsummarized(&txErrors) == 0) {
+    return;
+  }
+  fprintf(f, "Last %d s:", seconds);
+  summarizeCounter(f, &rxErrors, "lost from Alto");
+  summarizeCounter(f, &txErrors, "lost to Alto");
+  fprintf(f, "\n");
+}
@@ -0,0 +1,102 @@
+/*
+ * metrics.h
+ *
+ * In-process counters, gauges and histograms for the gateway. They are
+ * written out as a text file in the Prometheus exposition format, e.g. for
+ * node_exporter's textfile collector, and errors are summarized on stderr
+ * at most once per METRICS_SUMMARY_S instead of once per packet.
+ *
+ * Each metric is only updated from one thread: the main loop, or in
+ * pipelined mode (gateway -P) the thread whose work it counts. So nothing
+ * is locked, and a reader on another thread may be a count behind.
+ */
+
+#ifndef METRICS_H_
+#define METRICS_H_
+#include <stdint.h>
+#include <stdio.h>
+
+#define METRIC_MAX_LABELS 16 // Values of a counter's label; rxErrors has the most, 10
+#define METRIC_MAX_BUCKETS 24
+
+#define METRICS_WRITE_S 10 // How often the metrics file is rewritten
+#define METRICS_SUMMARY_S 10 // Least time between error summaries
+
+// A counter, optionally split by the value of one label. Label values are
+// compared by pointer first, so string literals such as decodeError are
+// cheap to count.
+struct metricCounter {
+  const char *name;
+  const char *help;
+  const char *label; // Label name, or NULL for a plain counter
+  int n; // Label values seen
+  const char *values[METRIC_MAX_LABELS];
+  uint64_t counts[METRIC_MAX_LABELS];
+  uint64_t summarized[METRIC_MAX_LABELS]; // Counts at the last summary
+};
+
+struct metricGauge {
+  const char *name;
+  const char *help;
+  int64_t value;
+};
+
+struct metricHistogram {
+  const char *name;
+  const char *help;
+  int nBuckets;
+  uint32_t bounds[METRIC_MAX_BUCKETS]; // Upper bounds, ascending
+  uint64_t counts[METRIC_MAX_BUCKETS + 1]; // Last one is +Inf
+  uint64_t sum;
+  uint64_t count;
+  uint64_t max; // Largest value, for reports
+};
+
+// Frames
+extern struct metricCounter rxFrames; // Decoded from the Alto
+extern struct metricCounter rxErrors; // By reason
+extern struct metricCounter rxBadBits;
+extern struct metricCounter txFrames; // Sent by the PRU, without a collision
+extern struct metricCounter txErrors; // By reason
+extern struct metricCounter txCollisions;
+extern struct metricCounter txRetries;
+extern struct metricCounter udpBatches; // By direction
+extern struct metricCounter fwdLookups; // By result
+extern struct metricCounter fwdFiltered; // By direction
+extern struct metricHistogram rxFrameBytes;
+extern struct metricHistogram txFrameBytes;
+
+// PRU
+extern struct metricCounter pruRestarts; // Firmware reloaded after it stalled
+
+// Boot server
+extern struct metricCounter bootFiles; // By result
+extern struct metricCounter bootResent;
+
+// Queues
+extern struct metricGauge txQueueDepthGauge;
+extern struct metricGauge txQueueHighWaterGauge;
+extern struct metricHistogram rxRingDepth;
+extern struct metricHistogram pipeDecodeDepth; // Pipelined mode's queues between threads
+extern struct metricHistogram pipeSendDepth;
+extern struct metricHistogram pipeEncodeDepth;
+extern struct metricHistogram pipeTxDepth;
+
+// Timing
+extern struct metricHistogram decodeNs;
+extern struct metricHistogram rxLatencyNs;
+
+void metricAdd(struct metricCounter *c, const char *value, uint64_t n);
+void metricSet(struct metricCounter *c, const char *value, uint64_t total);
+void metricObserve(struct metricHistogram *h, uint64_t value);
+void metricPulseWidths(const uint8_t *durations, int len);
+
+// For counters without a label
+static inline void metricCount(struct metricCounter *c) {
+  c->counts[0]++;
+}
+
+int metricsWrite(const char *path);
+void metricsSummary(FILE *f, int seconds);
+
+#endif /* METRICS_H_ */
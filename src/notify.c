@@ -0,0 +1,62 @@
+// systemd service notifications; see notify.h.
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include "notify.h"
+
+static int sock = -1;
+static struct sockaddr_un addr;
+static socklen_t addrLen;
+static uint64_t watchdogNs; // How often to ping, 0 for never
+static uint64_t lastPing;
+
+// Find systemd's socket and the watchdog interval from the environment.
+// Returns nonzero if running under systemd with notification.
+int notifyOpen() {
+  const char *path = getenv("NOTIFY_SOCKET");
+  const char *usec = getenv("WATCHDOG_USEC");
+  if (path == NULL || (path[0] != '/' && path[0] != '@') || strlen(path) >= sizeof(addr.sun_path)) {
+    return 0;
+  }
+  sock = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+  if (sock < 0) {
+    perror("notify socket");
+    return 0;
+  }
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, path);
+  if (path[0] == '@') {
+    addr.sun_path[0] = '\0'; // Abstract namespace
+  }
+  addrLen = offsetof(struct sockaddr_un, sun_path) + strlen(path);
+  if (usec != NULL) {
+    // Ping at half the interval, as sd_watchdog_enabled() advises
+    watchdogNs = strtoull(usec, NULL, 10) * 1000 / 2;
+  }
+  return 1;
+}
+
+// Send systemd a state change such as "READY=1" or "STATUS=...".
+void notifySend(const char *state) {
+  if (sock < 0) {
+    return;
+  }
+  if (sendto(sock, state, strlen(state), MSG_NOSIGNAL, (struct sockaddr *)&addr, addrLen) < 0) {
+    perror("notify");
+  }
+}
+
+// Ping the watchdog when it is due. Called each time the main loop wakes
+// up, so systemd restarts the gateway if the loop hangs.
+void notifyTick(uint64_t now) {
+  if (watchdogNs == 0 || now - lastPing < watchdogNs) {
+    return;
+  }
+  lastPing = now;
+  notifySend("WATCHDOG=1");
+}
@@ -0,0 +1,18 @@
+/*
+ * notify.h
+ *
+ * systemd's service notification protocol, without libsystemd: readiness,
+ * status and watchdog pings as datagrams to $NOTIFY_SOCKET. When the
+ * gateway isn't run by systemd, or the unit has no WatchdogSec, the calls
+ * do nothing.
+ */
+
+#ifndef NOTIFY_H_
+#define NOTIFY_H_
+#include <stdint.h>
+
+int notifyOpen();
+void notifySend(const char *state);
+void notifyTick(uint64_t now);
+
+#endif /* NOTIFY_H_ */
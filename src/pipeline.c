@@ -0,0 +1,41 @@
+// Doorbells for the pipeline's rings; see pipeline.h.
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include "pipeline.h"
+
+// A doorbell for one consumer, shared by the rings it takes from. Returns
+// -1 on error.
+int pipeBellOpen() {
+  int fd = eventfd(0, EFD_NONBLOCK);
+  if (fd < 0) {
+    perror("eventfd");
+  }
+  return fd;
+}
+
+void pipeBellRing(int bell) {
+  uint64_t one = 1;
+  if (write(bell, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+    perror("pipeline doorbell");
+  }
+}
+
+// Empty the doorbell after waking.
+void pipeBellDrain(int bell) {
+  uint64_t count;
+  if (read(bell, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+    perror("pipeline doorbell");
+  }
+}
+
+// Wait for the doorbell, for a consumer with nothing else to wait on.
+void pipeBellWait(int bell) {
+  struct pollfd p = { bell, POLLIN, 0 };
+  if (poll(&p, 1, -1) < 0 && errno != EINTR) {
+    perror("poll");
+  }
+  pipeBellDrain(bell);
+}
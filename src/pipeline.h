@@ -0,0 +1,93 @@
+/*
+ * pipeline.h
+ *
+ * Rings between the threads of the gateway's pipelined mode (-P). Each
+ * carries pointers to frames from one stage to the next: bounded, with
+ * one producer and one consumer, and no locks. The frames come from fixed
+ * pools, which circulate through the stages and back on rings of their
+ * own, so a ring never holds more than its pool and a push only fails if
+ * something is wrong.
+ *
+ * head and tail count slots from 0 and wrap at 2^32, as in shmring.h.
+ * A consumer with nothing to do sets sleeping on each ring it wants to
+ * be woken for, issues a barrier, checks them again, and waits on its
+ * doorbell, an eventfd. A producer clears sleeping and rings the
+ * doorbell after publishing, so a busy consumer costs no syscalls.
+ */
+
+#ifndef PIPELINE_H_
+#define PIPELINE_H_
+#include <stdint.h>
+
+#define PIPE_RING_SLOTS 64 // Power of 2, at least the largest pool
+
+// head and tail are a cache line apart, so the producer and consumer
+// don't share a line they both write.
+struct pipeRing {
+  volatile uint32_t head; // Written by the producer
+  uint32_t pad1[15];
+  volatile uint32_t tail; // Written by the consumer
+  volatile uint32_t sleeping; // Consumer is waiting on bell
+  int bell; // The consumer's doorbell
+  uint32_t pad2[13];
+  void *slots[PIPE_RING_SLOTS];
+};
+
+int pipeBellOpen();
+void pipeBellRing(int bell);
+void pipeBellDrain(int bell);
+void pipeBellWait(int bell);
+
+static inline void pipeRingInit(struct pipeRing *r, int bell) {
+  r->head = r->tail = r->sleeping = 0;
+  r->bell = bell;
+}
+
+static inline int pipeDepth(struct pipeRing *r) {
+  return r->head - r->tail;
+}
+
+// Producer: pass p to the consumer. Returns 0 if the ring is full.
+static inline int pipePush(struct pipeRing *r, void *p) {
+  if (r->head - r->tail == PIPE_RING_SLOTS) {
+    return 0;
+  }
+  r->slots[r->head % PIPE_RING_SLOTS] = p;
+  __sync_synchronize();
+  r->head++;
+  __sync_synchronize();
+  if (r->sleeping) {
+    r->sleeping = 0;
+    pipeBellRing(r->bell);
+  }
+  return 1;
+}
+
+// Consumer: the oldest item, or NULL if the ring is empty. It stays in
+// the ring until pipePop().
+static inline void *pipePeek(struct pipeRing *r) {
+  if (r->tail == r->head) {
+    return NULL;
+  }
+  __sync_synchronize();
+  return r->slots[r->tail % PIPE_RING_SLOTS];
+}
+
+static inline void pipePop(struct pipeRing *r) {
+  __sync_synchronize();
+  r->tail++;
+}
+
+// Consumer: about to wait for the doorbell. Returns 0 if an item arrived
+// meanwhile, so it shouldn't wait.
+static inline int pipeSleep(struct pipeRing *r) {
+  r->sleeping = 1;
+  __sync_synchronize();
+  if (r->tail != r->head) {
+    r->sleeping = 0;
+    return 0;
+  }
+  return 1;
+}
+
+#endif /* PIPELINE_H_ */
@@ -0,0 +1,64 @@
+/*
+ * pru_backend.h
+ *
+ * Interface between the gateway and whatever is running the PRU side.
+ * The prussdrv backend drives the real PRU on the BeagleBone. The sim
+ * backend runs a software model of the firmware in a thread, so the
+ * gateway can be run and profiled on an ordinary Linux box.
+ */
+
+#ifndef PRU_BACKEND_H_
+#define PRU_BACKEND_H_
+#include <stdint.h>
+
+// PRU0 data RAM (8K) at 0, PRU1 data RAM (8K) at 0x2000, shared RAM (12K)
+// at 0x10000
+#define PRU_RAM_SIZE 0x13000
+#define PRU1_RAM 0x2000
+
+// The IEP timer's count register, which the firmware stamps descriptors
+// with, as an offset from PRU0 data RAM in the PRU subsystem's memory map
+#define PRU_IEP_COUNT 0x2E00C
+
+// Host events. With pruDual set, PRU1 receives and raises PRU_EVENT_RX,
+// and PRU0 sends and raises PRU_EVENT_TX. Otherwise PRU0 does both and
+// raises PRU_EVENT_TX for everything.
+#define PRU_EVENT_TX 0 // PRU_EVTOUT_0
+#define PRU_EVENT_RX 1 // PRU_EVTOUT_1
+#define PRU_EVENTS 2
+
+struct pruBackend {
+  const char *name;
+  int (*open)(); // Load and start the firmware. Returns -1 on failure.
+  volatile uint8_t *(*dataram)(); // Start of PRU0 data RAM
+  int (*eventFd)(int event); // Becomes readable when the PRU raises event
+  void (*waitEvent)(int event); // Consume the pending interrupt
+  void (*clearEvent)(int event); // Clear the interrupt at the PRU side
+  int (*finished)(); // Nonzero when a simulated run is complete
+  uint32_t (*iepNow)(); // The IEP timer, in ns
+  int (*restart)(); // Reload and restart the firmware after a stall. Returns -1 on failure.
+};
+
+extern struct pruBackend prussdrvBackend;
+extern struct pruBackend simBackend;
+
+extern int pruDual; // Receive on PRU1 and send on PRU0; set before open()
+
+// Simulated backend settings, set before open()
+extern int simFrames; // Frames to generate in each direction
+extern int simFrameLength; // Bytes per frame, including the CRC
+extern int simWireRate; // Frames from the Alto arrive at 3 Mb/s, not as fast as the ARM takes them
+extern int simBurst; // Frames arrive in bursts instead of one at a time
+extern int simCollide; // Every simCollide'th send collides, or 0 for none
+extern int simBatch; // IFS sends batched datagrams
+extern const char *simShm; // IFS attaches to the shared memory transport at this path, or NULL
+extern const char *simReplay; // Capture file with frames from the Alto to replay, or NULL
+extern int simEcho; // The Alto answers PUP echoes instead of sending frames, and IFS sends none
+extern int simStall; // The PRU wedges after handing over this many frames, once, or 0 for never
+extern int simBoot; // Altos that boot at once instead of sending frames, and IFS sends none of its own
+extern int simBootFile; // The boot file they ask for
+extern const char *simBootDir; // The simulated IFS's directory, as for -I
+#define SIM_BOOT_ALTOS 64
+void simReport();
+
+#endif /* PRU_BACKEND_H_ */
@@ -0,0 +1,199 @@
+// Emulated PRU peripherals for the host build of the firmware.
+//
+// Every register access goes through an accessor here, which advances a
+// virtual cycle clock and brings the peripherals up to date. The firmware
+// writes through the pointer an accessor returns, so writes are noticed on
+// the next access and take effect at the time of the access that made them.
+//
+// Modelled:
+// - R31: the input pin, from a waveform of edge times, and bit 30, the
+//   ECAP compare interrupt. Writes of bit 5 raise an interrupt to the host.
+// - R30: the output pins. Every change is recorded with its time.
+// - IEP: the counter counts ns from the last write to IEP_TMR_CNT.
+// - ECAP: in APWM mode, a compare event every APRD + 1 cycles from the last
+//   write to ECAP_TSCTR. Writing ECAP_ECCLR or PRU_INTC_SICR clears it.
+// Other registers read back what was written.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "pru_defs.h"
+
+#define R31_HOST_INT (1 << 5) // Strobe bit for interrupts to the host
+#define R31_ECAP_INT (1 << 30) // Host interrupt 0, mapped to the ECAP event
+
+// Register offsets, as in pru_defs.h
+#define REG_IEP_CNT (IEP_TMR + 0xc)
+#define REG_ECAP_TSCTR (ECAP + 0x00)
+#define REG_ECAP_APRD (ECAP + 0x10)
+#define REG_ECAP_ECCLR (ECAP + 0x30)
+#define REG_INTC_SICR (PRU_INTC + 0x24)
+#define REG_SPACE 0x40000
+
+uint8_t pruHostRam[PRU_HOST_RAM_SIZE];
+uint64_t pruHostNs;
+uint64_t pruHostLimitNs;
+uint64_t pruHostMaxLatencyNs;
+int pruHostInterrupts;
+struct pruHostEdge *pruHostOutput;
+int pruHostOutputCount;
+
+static uint8_t regs[REG_SPACE];
+static uint64_t lastAccessNs; // When the last accessor was called
+
+static volatile uint32_t r30, r31;
+static uint32_t r30Shadow, r31Shadow; // As handed out, to spot writes
+static uint32_t iepCntShadow, tsctrShadow;
+static uint64_t iepStartNs, pwmStartNs, pwmClearNs;
+
+static int outputSize;
+
+static int inputPin;
+static const uint64_t *inputEdges;
+static int inputCount;
+static int inputNext; // First edge not yet reached
+static int inputSeen; // Level the firmware last read
+
+static uint32_t *reg32(uint32_t addr) {
+  return (uint32_t *)(regs + addr);
+}
+
+static uint16_t *reg16(uint32_t addr) {
+  return (uint16_t *)(regs + addr);
+}
+
+static void recordOutput(uint64_t ns, uint32_t value) {
+  if (pruHostOutputCount == outputSize) {
+    outputSize = outputSize ? outputSize * 2 : 1024;
+    pruHostOutput = realloc(pruHostOutput, outputSize * sizeof(*pruHostOutput));
+  }
+  pruHostOutput[pruHostOutputCount].ns = ns;
+  pruHostOutput[pruHostOutputCount].r30 = value;
+  pruHostOutputCount++;
+}
+
+// Apply the writes made since the last access.
+static void sync() {
+  if (r30 != r30Shadow) {
+    recordOutput(lastAccessNs, r30);
+    r30Shadow = r30;
+  }
+  if (r31 != r31Shadow) {
+    if (r31 & R31_HOST_INT) {
+      pruHostInterrupts++;
+    }
+    r31Shadow = r31;
+  }
+  if (*reg32(REG_IEP_CNT) != iepCntShadow) {
+    iepStartNs = lastAccessNs;
+  }
+  if (*reg32(REG_ECAP_TSCTR) != tsctrShadow) {
+    pwmStartNs = lastAccessNs;
+    pwmClearNs = lastAccessNs;
+  }
+  if (*reg16(REG_ECAP_ECCLR) != 0 || *reg32(REG_INTC_SICR) != 0) {
+    pwmClearNs = lastAccessNs;
+    *reg16(REG_ECAP_ECCLR) = 0;
+    *reg32(REG_INTC_SICR) = 0;
+  }
+}
+
+// Advance the clock and bring the read-only state up to date.
+static void advance(uint32_t cycles) {
+  sync();
+  pruHostNs += cycles * PRU_HOST_CYCLE_NS;
+  lastAccessNs = pruHostNs;
+  if (pruHostLimitNs && pruHostNs > pruHostLimitNs) {
+    fprintf(stderr, "Firmware still running at %llu ns\n", (unsigned long long)pruHostNs);
+    exit(1);
+  }
+
+  iepCntShadow = pruHostNs - iepStartNs;
+  *reg32(REG_IEP_CNT) = iepCntShadow;
+  tsctrShadow = *reg32(REG_ECAP_TSCTR);
+}
+
+// Nonzero if an ECAP compare event has happened since the flags were cleared
+static int pwmFlag() {
+  uint64_t period = (*reg32(REG_ECAP_APRD) + 1) * PRU_HOST_CYCLE_NS;
+  if (*reg32(REG_ECAP_APRD) == 0) {
+    return 0;
+  }
+  return (pruHostNs - pwmStartNs) / period > (pwmClearNs - pwmStartNs) / period;
+}
+
+volatile uint32_t *pruHostR30() {
+  advance(PRU_HOST_R30_CYCLES);
+  return &r30;
+}
+
+volatile uint32_t *pruHostR31() {
+  advance(PRU_HOST_R31_CYCLES);
+  while (inputNext < inputCount && inputEdges[inputNext] <= pruHostNs) {
+    inputNext++;
+  }
+  int level = (inputNext & 1) == 0; // Idle high, each edge flips it
+  if (level != inputSeen && inputNext > 0) {
+    uint64_t latency = pruHostNs - inputEdges[inputNext - 1];
+    if (latency > pruHostMaxLatencyNs) {
+      pruHostMaxLatencyNs = latency;
+    }
+  }
+  inputSeen = level;
+  r31 = (level << inputPin) | (pwmFlag() ? R31_ECAP_INT : 0);
+  r31Shadow = r31;
+  return &r31;
+}
+
+volatile void *pruHostReg(uint32_t addr) {
+  if (addr + 4 > REG_SPACE) {
+    fprintf(stderr, "Bad register address 0x%x\n", addr);
+    exit(1);
+  }
+  advance(PRU_HOST_REG_CYCLES);
+  return regs + addr;
+}
+
+volatile uint8_t *pruHostMem(uint32_t addr) {
+  if (addr >= PRU_HOST_RAM_SIZE) {
+    fprintf(stderr, "Bad memory address 0x%x\n", addr);
+    exit(1);
+  }
+  advance(PRU_HOST_MEM_CYCLES);
+  return pruHostRam + addr;
+}
+
+void pruHostDelay(uint32_t cycles) {
+  advance(cycles);
+}
+
+// Clear the RAM, registers and recorded output, and restart the clock.
+void pruHostReset() {
+  memset(pruHostRam, 0, sizeof(pruHostRam));
+  memset(regs, 0, sizeof(regs));
+  pruHostNs = lastAccessNs = 0;
+  iepStartNs = pwmStartNs = pwmClearNs = 0;
+  iepCntShadow = tsctrShadow = 0;
+  r30 = r30Shadow = r31 = r31Shadow = 0;
+  pruHostMaxLatencyNs = 0;
+  pruHostInterrupts = 0;
+  pruHostOutputCount = 0;
+  inputCount = inputNext = 0;
+  inputSeen = 1;
+}
+
+// Drive input pin from now on: idle high, flipping at each of the edge
+// times (ns, ascending). The edges must stay valid until the next call.
+void pruHostInput(int pin, const uint64_t *edges, int count) {
+  inputPin = pin;
+  inputEdges = edges;
+  inputCount = count;
+  inputNext = 0;
+  inputSeen = 1;
+  pruHostMaxLatencyNs = 0;
+}
+
+// Record the firmware's last write, which is otherwise only noticed at its
+// next access.
+void pruHostFlush() {
+  sync();
+}
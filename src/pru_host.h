@@ -0,0 +1,51 @@
+/*
+ * pru_host.h
+ *
+ * Emulated PRU peripherals, for building the firmware on a Linux host with
+ * PRU_HOST defined. pru_defs.h maps the firmware's registers and memory
+ * onto the accessors here.
+ */
+
+#ifndef PRU_HOST_H_
+#define PRU_HOST_H_
+#include <stdint.h>
+
+// Virtual cycle clock: the PRU runs at 200 MHz.
+#define PRU_HOST_CYCLE_NS 5
+
+// Cycles charged for each access. Code between accesses is free, so
+// timings are a lower bound on what the firmware really takes.
+#define PRU_HOST_R31_CYCLES 3 // One iteration of a poll loop: read, test, branch
+#define PRU_HOST_R30_CYCLES 1
+#define PRU_HOST_REG_CYCLES 3 // ECAP, IEP, INTC and control registers
+#define PRU_HOST_MEM_CYCLES 1 // Data and shared RAM
+
+// PRU0 data RAM through the end of shared RAM, as the PRU addresses it
+#define PRU_HOST_RAM_SIZE 0x13000
+
+// A change of the output pins
+struct pruHostEdge {
+  uint64_t ns;
+  uint32_t r30;
+};
+
+extern uint8_t pruHostRam[PRU_HOST_RAM_SIZE];
+extern uint64_t pruHostNs; // Virtual time
+extern uint64_t pruHostLimitNs; // Exit if virtual time passes this, 0 for no limit
+extern uint64_t pruHostMaxLatencyNs; // Longest from an input edge to the R31 read that saw it
+extern int pruHostInterrupts; // Interrupts raised to the host through R31
+
+extern struct pruHostEdge *pruHostOutput; // Every R30 write that changed it
+extern int pruHostOutputCount;
+
+volatile uint32_t *pruHostR30();
+volatile uint32_t *pruHostR31();
+volatile void *pruHostReg(uint32_t addr);
+volatile uint8_t *pruHostMem(uint32_t addr);
+void pruHostDelay(uint32_t cycles);
+
+void pruHostReset();
+void pruHostInput(int pin, const uint64_t *edges, int count);
+void pruHostFlush();
+
+#endif /* PRU_HOST_H_ */
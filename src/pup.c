@@ -0,0 +1,47 @@
+// PUPs in Alto Ethernet frames; see pup.h.
+#include <stddef.h>
+#include "crc.h"
+#include "pup.h"
+
+// The PUP checksum: ones' complement add and left cycle over the words
+// from the length to the end of the data. 0177777 means none, so a sum
+// that comes out as that is sent as 0.
+int pupChecksum(const uint8_t *pup, int pupLength) {
+  uint32_t sum = 0;
+  int i;
+  for (i = 0; i < (pupLength - 1) / 2; i++) {
+    sum += pupWord(pup + 2 * i);
+    sum = (sum + (sum >> 16)) & 0xffff;
+    sum = ((sum << 1) | (sum >> 15)) & 0xffff;
+  }
+  return sum == 0xffff ? 0 : sum;
+}
+
+// Set the PUP's checksum and the frame's CRC. Returns the frame's length
+// in bytes with the CRC.
+int pupFinishFrame(uint8_t *frame) {
+  uint8_t *pup = frame + 4;
+  int pupLength = pupWord(pup + PUP_LENGTH);
+  int words = 2 + (pupLength + 1) / 2; // Ethernet header and the padded PUP
+  pupSetWord(pup + 2 * ((pupLength - 1) / 2), pupChecksum(pup, pupLength));
+  pupSetWord(frame + 2 * words, crc(frame, words));
+  return 2 * words + 2;
+}
+
+// The PUP in a frame of len bytes, not counting the CRC, or NULL if it
+// isn't a well-formed PUP of the given type
+const uint8_t *pupFind(const uint8_t *frame, int len, int type) {
+  const uint8_t *pup = frame + 4;
+  if (len < 4 + PUP_HEADER_BYTES + 2 || pupWord(frame + 2) != PUP_ETHER_TYPE) {
+    return NULL;
+  }
+  int pupLength = pupWord(pup + PUP_LENGTH);
+  if (pupLength < PUP_HEADER_BYTES + 2 || 4 + 2 * ((pupLength + 1) / 2) > len || pup[PUP_TYPE] != type) {
+    return NULL;
+  }
+  int checksum = pupWord(pup + 2 * ((pupLength - 1) / 2));
+  if (checksum != 0xffff && checksum != pupChecksum(pup, pupLength)) {
+    return NULL;
+  }
+  return pup;
+}
@@ -0,0 +1,49 @@
+/*
+ * pup.h
+ *
+ * PUPs carried in Alto Ethernet frames: destination and source host, the
+ * Ethernet type, then the PUP, padded to a word, and the CRC after it on
+ * the wire. A PUP is its length in bytes, transport control and type, a
+ * 32-bit ID, the destination and source ports (net, host and 32-bit
+ * socket), the data and a checksum word. All words are big-endian.
+ */
+
+#ifndef PUP_H_
+#define PUP_H_
+#include <stdint.h>
+
+#define PUP_ETHER_TYPE 01000
+#define PUP_HEADER_BYTES 20 // Length, type, ID and addresses; the checksum follows the data
+#define PUP_MAX_DATA 532
+
+// Byte offsets of the fields in a PUP
+#define PUP_LENGTH 0
+#define PUP_TRANSPORT 2 // Transport control
+#define PUP_TYPE 3
+#define PUP_ID 4
+#define PUP_DEST 8 // Net, host, socket
+#define PUP_SOURCE 14
+
+static inline int pupWord(const uint8_t *p) {
+  return (p[0] << 8) | p[1];
+}
+
+static inline void pupSetWord(uint8_t *p, int w) {
+  p[0] = w >> 8;
+  p[1] = w & 0xff;
+}
+
+static inline uint32_t pupLong(const uint8_t *p) {
+  return ((uint32_t)pupWord(p) << 16) | pupWord(p + 2);
+}
+
+static inline void pupSetLong(uint8_t *p, uint32_t l) {
+  pupSetWord(p, l >> 16);
+  pupSetWord(p + 2, l & 0xffff);
+}
+
+int pupChecksum(const uint8_t *pup, int pupLength);
+int pupFinishFrame(uint8_t *frame);
+const uint8_t *pupFind(const uint8_t *frame, int len, int type);
+
+#endif /* PUP_H_ */
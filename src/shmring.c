@@ -0,0 +1,85 @@
+// Opening the shared-memory transport between the gateway and IFS; see
+// shmring.h for the layout and protocol.
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "shmring.h"
+
+// Create or open a doorbell FIFO. It is opened for reading and writing so
+// neither side blocks waiting for the other, or sees end of file when the
+// other goes away.
+static int openBell(const char *path, const char *suffix) {
+  char name[256];
+  snprintf(name, sizeof(name), "%s.%s", path, suffix);
+  if (mkfifo(name, 0660) < 0 && errno != EEXIST) {
+    perror(name);
+    return -1;
+  }
+  int fd = open(name, O_RDWR | O_NONBLOCK);
+  if (fd < 0) {
+    perror(name);
+  }
+  return fd;
+}
+
+// Map the transport at path. The gateway (gateway nonzero) creates and
+// initializes it; IFS attaches to an initialized one. Returns -1 on error.
+int shmringOpen(const char *path, int gateway, struct shmringHandle *h) {
+  int fd = open(path, gateway ? O_RDWR | O_CREAT : O_RDWR, 0660);
+  if (fd < 0) {
+    perror(path);
+    return -1;
+  }
+  if (gateway && ftruncate(fd, sizeof(struct shmringFile)) < 0) {
+    perror(path);
+    close(fd);
+    return -1;
+  }
+  void *map = mmap(NULL, sizeof(struct shmringFile), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    perror(path);
+    return -1;
+  }
+  volatile struct shmringFile *file = map;
+  if (gateway) {
+    uint32_t generation = file->magic == SHMRING_MAGIC ? file->generation + 1 : 1;
+    memset(map, 0, sizeof(struct shmringFile));
+    file->version = SHMRING_VERSION;
+    file->generation = generation;
+    __sync_synchronize();
+    file->magic = SHMRING_MAGIC;
+  } else if (file->magic != SHMRING_MAGIC || file->version != SHMRING_VERSION) {
+    fprintf(stderr, "%s: not a version %d transport\n", path, SHMRING_VERSION);
+    munmap(map, sizeof(struct shmringFile));
+    return -1;
+  }
+  h->file = file;
+  h->in = &file->ring[gateway ? SHMRING_TO_GATEWAY : SHMRING_TO_IFS];
+  h->out = &file->ring[gateway ? SHMRING_TO_IFS : SHMRING_TO_GATEWAY];
+  h->bellIn = openBell(path, gateway ? "to-gateway" : "to-ifs");
+  h->bellOut = openBell(path, gateway ? "to-ifs" : "to-gateway");
+  if (h->bellIn < 0 || h->bellOut < 0) {
+    return -1;
+  }
+  return 0;
+}
+
+// Wake the consumer waiting on bell.
+void shmringRing(int bell) {
+  uint8_t b = 1;
+  if (write(bell, &b, 1) < 0 && errno != EAGAIN) {
+    perror("shmring doorbell");
+  }
+}
+
+// Empty the doorbell after waking.
+void shmringDrain(int bell) {
+  uint8_t buf[64];
+  while (read(bell, buf, sizeof(buf)) > 0) {
+  }
+}
@@ -0,0 +1,143 @@
+/*
+ * shmring.h
+ *
+ * Local transport between the gateway and an IFS on the same machine, in
+ * place of UDP over loopback: a pair of single-producer, single-consumer
+ * frame rings in a shared file, with named FIFOs as doorbells.
+ *
+ * ABI, version SHMRING_VERSION. Everything is in host byte order except
+ * the frames themselves.
+ * - The gateway creates the file, path (e.g. /dev/shm/alto-gateway), and
+ *   the FIFOs path.to-ifs and path.to-gateway. It initializes the file on
+ *   every start and increments generation; an attached IFS that sees
+ *   generation change must attach again.
+ * - The file holds one struct shmringFile. ring[SHMRING_TO_IFS] carries
+ *   frames from the Alto, produced by the gateway and consumed by IFS;
+ *   ring[SHMRING_TO_GATEWAY] carries frames the other way.
+ * - A slot holds one frame in the UDP single-frame format: the length in
+ *   words, not counting the CRC, big-endian, then the frame without its
+ *   CRC. slot.length is the size of that in bytes.
+ * - head and tail count slots from 0 and wrap at 2^32; slot n is
+ *   slots[n % SHMRING_SLOTS]. Only the producer writes head and only the
+ *   consumer writes tail. The ring is empty when head == tail and full
+ *   when head - tail == SHMRING_SLOTS.
+ * - The producer fills slots[head % SHMRING_SLOTS], then, after a memory
+ *   barrier, increments head. The consumer reads slots[tail %
+ *   SHMRING_SLOTS], then, after a barrier, increments tail.
+ * - Wakeups: a consumer about to wait sets sleeping, issues a full
+ *   barrier and checks the ring again before waiting for its FIFO to be
+ *   readable. A producer, after publishing, issues a full barrier and, if
+ *   sleeping is set, clears it and writes a byte to the consumer's FIFO.
+ *   The consumer reads its FIFO empty when it wakes. Extra bytes only
+ *   cause a spurious wakeup.
+ * - IFS sets attached to its pid once it has opened everything, and back
+ *   to 0 when it stops. While attached is 0 the gateway sends frames from
+ *   the Alto over UDP, but it takes frames from ring[SHMRING_TO_GATEWAY]
+ *   whenever there are any. If the pid no longer exists, because IFS was
+ *   killed before it could clear attached, the gateway clears it within a
+ *   second of the next frame from the Alto.
+ *
+ * The inline functions below implement the ring side of this; shmring.c
+ * opens the file and FIFOs.
+ */
+
+#ifndef SHMRING_H_
+#define SHMRING_H_
+#include <stdint.h>
+
+#define SHMRING_MAGIC 0x414c5452 // "ALTR"
+#define SHMRING_VERSION 1
+#define SHMRING_SLOTS 64 // Power of 2
+#define SHMRING_FRAME_BYTES 572 // Length word and the largest frame less its CRC, rounded up
+
+#define SHMRING_TO_IFS 0
+#define SHMRING_TO_GATEWAY 1
+
+struct shmringSlot {
+  uint32_t length; // Bytes in data
+  uint8_t data[SHMRING_FRAME_BYTES];
+};
+
+// head and tail are a cache line apart, so the producer and consumer
+// don't share a line they both write.
+struct shmring {
+  uint32_t head; // Written by the producer
+  uint32_t pad1[15];
+  uint32_t tail; // Written by the consumer
+  uint32_t sleeping; // Consumer is waiting on its FIFO
+  uint32_t pad2[14];
+  struct shmringSlot slots[SHMRING_SLOTS];
+};
+
+struct shmringFile {
+  uint32_t magic; // SHMRING_MAGIC once initialized
+  uint32_t version; // SHMRING_VERSION
+  uint32_t generation; // Incremented each time the gateway starts
+  uint32_t attached; // IFS's pid while it is attached, otherwise 0
+  uint32_t pad[12];
+  struct shmring ring[2];
+};
+
+// One side's view: the ring it consumes and the one it produces, with
+// their doorbells.
+struct shmringHandle {
+  volatile struct shmringFile *file;
+  volatile struct shmring *in;
+  volatile struct shmring *out;
+  int bellIn; // FIFO to wait on, readable when rung
+  int bellOut; // FIFO to ring
+};
+
+int shmringOpen(const char *path, int gateway, struct shmringHandle *h);
+void shmringRing(int bell);
+void shmringDrain(int bell);
+
+// Producer: the slot to fill next, or NULL if the ring is full.
+static inline volatile struct shmringSlot *shmringReserve(volatile struct shmring *r) {
+  if (r->head - r->tail == SHMRING_SLOTS) {
+    return NULL;
+  }
+  return &r->slots[r->head % SHMRING_SLOTS];
+}
+
+// Producer: pass the reserved slot to the consumer. Returns nonzero if the
+// consumer is waiting, so its doorbell needs ringing.
+static inline int shmringPublish(volatile struct shmring *r) {
+  __sync_synchronize();
+  r->head++;
+  __sync_synchronize();
+  if (r->sleeping) {
+    r->sleeping = 0;
+    return 1;
+  }
+  return 0;
+}
+
+// Consumer: the oldest unread slot, or NULL if the ring is empty.
+static inline volatile struct shmringSlot *shmringPeek(volatile struct shmring *r) {
+  if (r->tail == r->head) {
+    return NULL;
+  }
+  __sync_synchronize();
+  return &r->slots[r->tail % SHMRING_SLOTS];
+}
+
+// Consumer: hand the slot from shmringPeek() back to the producer.
+static inline void shmringRelease(volatile struct shmring *r) {
+  __sync_synchronize();
+  r->tail++;
+}
+
+// Consumer: about to wait for the doorbell. Returns 0 if a frame arrived
+// meanwhile, so it shouldn't wait.
+static inline int shmringSleep(volatile struct shmring *r) {
+  r->sleeping = 1;
+  __sync_synchronize();
+  if (r->tail != r->head) {
+    r->sleeping = 0;
+    return 0;
+  }
+  return 1;
+}
+
+#endif /* SHMRING_H_ */
@@ -0,0 +1,97 @@
+// Synthetic receive traces for testing and benchmarking the decoder.
+// The ideal trace comes from encodeDurations(), so it has the same sync
+// bit and trailing 1 as the PRU's. Faults are added to the transition
+// times, then the durations are rounded to RECV_WIDTH units as the PRU
+// would.
+#include <math.h>
+#include <string.h>
+#include "crc.h"
+#include "manchester.h"
+#include "tracegen.h"
+
+static uint64_t rngState = 0x9e3779b97f4a7c15ULL;
+
+void traceSeed(uint64_t seed) {
+  rngState = seed ? seed : 1;
+}
+
+// xorshift64*, so traces are the same on every run and every machine
+static uint64_t rng() {
+  rngState ^= rngState >> 12;
+  rngState ^= rngState << 25;
+  rngState ^= rngState >> 27;
+  return rngState * 0x2545f4914f6cdd1dULL;
+}
+
+// Uniform in [0, 1)
+static double uniform() {
+  return (rng() >> 11) * (1.0 / 9007199254740992.0);
+}
+
+// Normal with mean 0 and standard deviation 1 (Box-Muller)
+static double gaussian() {
+  double u = uniform();
+  if (u < 1e-300) {
+    u = 1e-300;
+  }
+  return sqrt(-2 * log(u)) * cos(2 * M_PI * uniform());
+}
+
+static int toUnits(double ns) {
+  int d = (int)(ns / RECV_WIDTH + 0.5);
+  return d < 0 ? 0 : d > 255 ? 255 : d;
+}
+
+// Encode len frame bytes as PRU durations with the faults in p.
+// Return the number of durations, or -1 if they don't fit in maxLen.
+int traceGenerate(const uint8_t *bytes, int len, const struct traceParams *p, uint8_t *durations, int maxLen) {
+  uint8_t ideal[16 * len + 2];
+  int n = encodeDurations(bytes, len, ideal, sizeof(ideal));
+  int count = 0;
+  int i;
+  // Durations alternate low, high, ... starting with the low half of the
+  // sync bit. Each transition moves by its own jitter, so a late edge
+  // lengthens one pulse and shortens the next. Skew moves falling edges
+  // later and rising edges earlier by half of skewNs each.
+  double edge = 0; // Ideal time of the transition that ends pulse i
+  double prev = 0; // Actual time of the transition that starts it
+  for (i = 0; i < n; i++) {
+    int high = i & 1;
+    edge += ideal[i] * RECV_WIDTH * (1 + p->rateError);
+    double next = edge + (high ? p->skewNs : -p->skewNs) / 2 + p->jitterNs * gaussian();
+    double width = next - prev;
+    if (p->glitchRate > 0 && uniform() < p->glitchRate) {
+      // A spike of the other level splits the pulse in three
+      double before = (width - p->glitchNs) / 2;
+      if (count + 2 >= maxLen) {
+        return -1;
+      }
+      durations[count++] = toUnits(before);
+      durations[count++] = toUnits(p->glitchNs);
+      width -= before + p->glitchNs;
+    }
+    if (count >= maxLen) {
+      return -1;
+    }
+    durations[count++] = toUnits(width);
+    prev = next;
+  }
+  return count;
+}
+
+// Fill frame with a PUP-like frame of len bytes: destination, source,
+// type 01000, random contents and the CRC. len must be even.
+int traceFrame(uint8_t *frame, int len) {
+  int i;
+  frame[0] = 1 + rng() % 254; // Destination host
+  frame[1] = 1 + rng() % 254; // Source host
+  frame[2] = 01000 >> 8; // PUP
+  frame[3] = 01000 & 0xff;
+  for (i = 4; i < len - 2; i++) {
+    frame[i] = rng();
+  }
+  uint16_t crcVal = crc(frame, (len - 2) / 2);
+  frame[len - 2] = crcVal >> 8;
+  frame[len - 1] = crcVal & 0xff;
+  return len;
+}
@@ -0,0 +1,24 @@
+/*
+ * tracegen.h
+ *
+ * Synthetic receive traces: frame bytes turned into the durations the
+ * PRU would record, with the timing faults of a real line added.
+ */
+
+#ifndef TRACEGEN_H_
+#define TRACEGEN_H_
+#include <stdint.h>
+
+struct traceParams {
+  double jitterNs; // Standard deviation of each transition's time
+  double skewNs; // Added to every high pulse and taken from every low one
+  double glitchRate; // Chance per pulse of a short spike in its middle
+  double glitchNs; // Width of a spike
+  double rateError; // Fractional clock error: 0.03 is a line 3% slow
+};
+
+void traceSeed(uint64_t seed);
+int traceGenerate(const uint8_t *bytes, int len, const struct traceParams *p, uint8_t *durations, int maxLen);
+int traceFrame(uint8_t *frame, int len);
+
+#endif /* TRACEGEN_H_ */
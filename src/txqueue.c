@@ -0,0 +1,55 @@
+// Transmit queue: frames from UDP waiting for a PRU write descriptor.
+#include <stddef.h>
+#include <string.h>
+#include "txqueue.h"
+
+static struct txFrame queue[TX_QUEUE_SIZE];
+static int head; // Oldest frame
+static int tail; // Next free entry
+
+int txQueueDepth, txQueueHighWater, txQueueDrops;
+
+// Returns the entry to fill with a new frame, or NULL if the queue is
+// full. The frame is only queued by txQueuePush().
+struct txFrame *txQueueTail() {
+  if (txQueueDepth == TX_QUEUE_SIZE) {
+    return NULL;
+  }
+  return &queue[tail];
+}
+
+void txQueuePush() {
+  tail = (tail + 1) % TX_QUEUE_SIZE;
+  txQueueDepth++;
+  if (txQueueDepth > txQueueHighWater) {
+    txQueueHighWater = txQueueDepth;
+  }
+}
+
+// Returns the oldest frame, or NULL if the queue is empty.
+struct txFrame *txQueueHead() {
+  if (txQueueDepth == 0) {
+    return NULL;
+  }
+  return &queue[head];
+}
+
+void txQueuePop() {
+  head = (head + 1) % TX_QUEUE_SIZE;
+  txQueueDepth--;
+}
+
+// Queue a frame of len bytes, with its CRC, that the gateway made itself.
+// Returns 0 if the queue is full.
+int txQueueAdd(const uint8_t *frame, int len, uint64_t now) {
+  struct txFrame *f = txQueueTail();
+  if (f == NULL) {
+    txQueueDrops++;
+    return 0;
+  }
+  memcpy(f->data, frame, len);
+  f->length = len;
+  f->queuedNs = now;
+  txQueuePush();
+  return 1;
+}
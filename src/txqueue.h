@@ -0,0 +1,32 @@
+/*
+ * txqueue.h
+ *
+ * Transmit queue: frames from UDP waiting for a PRU write descriptor.
+ * A bounded FIFO, so a burst from IFS is held here instead of backing up
+ * in the kernel socket buffer. When it is full, new frames are dropped.
+ */
+
+#ifndef TXQUEUE_H_
+#define TXQUEUE_H_
+#include <stdint.h>
+#include "gateway.h"
+
+#define TX_QUEUE_SIZE 64
+
+struct txFrame {
+  int length; // bytes, including the CRC
+  uint64_t queuedNs; // When the gateway read it from IFS
+  uint8_t data[MAX_PUP_LENGTH];
+};
+
+struct txFrame *txQueueTail();
+void txQueuePush();
+struct txFrame *txQueueHead();
+void txQueuePop();
+int txQueueAdd(const uint8_t *frame, int len, uint64_t now);
+
+extern int txQueueDepth; // Frames in the queue
+extern int txQueueHighWater; // Largest depth seen
+extern int txQueueDrops; // Frames dropped because the queue was full
+
+#endif /* TXQUEUE_H_ */